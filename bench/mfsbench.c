@@ -0,0 +1,334 @@
+// Benchmark driver for mfs.
+//
+// Generates a contiguous and a fragmented image with mkfat32, then times
+// each shell operation by running a batch script of many repetitions
+// through mfs. The cost of starting mfs and opening the image is measured
+// with an empty script and subtracted, so the figures are per operation.
+// Every measurement is the best of a few runs.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUNS 3
+#define METADATA_SCALE 50 // ls, stat and cd are cheap; run more of them
+#define MAX_MANIFEST 100000
+
+typedef struct
+{
+    char path[64];
+    uint32_t size;
+} BenchFile;
+
+static const char *mfs_path = "./mfs";
+static const char *mkfat_path = "./bench/mkfat32";
+static const char *work_dir = "bench/work";
+static int iterations = 200;
+
+static BenchFile *files;
+static uint32_t file_count;
+static char (*dirs)[64];
+static uint32_t dir_count;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    static char buffer[1 << 20];
+    size_t n;
+    int result = in && out ? 0 : -1;
+
+    while (result == 0 && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        if (fwrite(buffer, 1, n, out) != n)
+            result = -1;
+    }
+    if (in)
+        fclose(in);
+    if (out && fclose(out) != 0)
+        result = -1;
+    return result;
+}
+
+// Run mfs over a script; returns the elapsed seconds or -1 if it failed
+static double run_script(const char *script)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -b %s >/dev/null", mfs_path, script);
+
+    double start = now();
+    int status = system(command);
+    double elapsed = now() - start;
+    return status == 0 ? elapsed : -1;
+}
+
+// Generate an image and load its manifest of files and directories
+static int generate(const char *image, const char *options)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %s %s", mkfat_path, options, image);
+
+    FILE *manifest = popen(command, "r");
+    if (!manifest)
+        return -1;
+
+    file_count = 0;
+    dir_count = 1;
+    strcpy(dirs[0], "/");
+    char line[128];
+    while (fgets(line, sizeof(line), manifest) && file_count < MAX_MANIFEST)
+    {
+        BenchFile *file = &files[file_count];
+        if (sscanf(line, "%63s %u", file->path + 1, &file->size) != 2)
+            continue;
+        file->path[0] = '/';
+        file_count++;
+
+        // The parent directory, if it is new
+        char dir[64];
+        strcpy(dir, file->path);
+        *(strrchr(dir, '/') + 1) = '\0';
+        uint32_t i;
+        for (i = 0; i < dir_count; i++)
+        {
+            if (strcmp(dirs[i], dir) == 0)
+                break;
+        }
+        if (i == dir_count && dir_count < MAX_MANIFEST)
+            strcpy(dirs[dir_count++], dir);
+    }
+    return pclose(manifest) == 0 && file_count > 0 ? 0 : -1;
+}
+
+// Spread the repetitions over the whole tree rather than one hot entry
+static uint32_t pick(int i, uint32_t count)
+{
+    return (uint32_t)((uint64_t)i * 7919 % count);
+}
+
+typedef enum
+{
+    OP_LS,
+    OP_STAT,
+    OP_CD,
+    OP_READ,
+    OP_GET,
+    OP_PUT
+} BenchOp;
+
+static const char *op_names[] = {"ls", "stat", "cd", "read", "get", "put"};
+
+static int op_count(BenchOp op)
+{
+    return op <= OP_CD ? iterations * METADATA_SCALE : iterations;
+}
+
+// Write the script for one operation; returns the bytes it moves
+static uint64_t write_script(const char *script, const char *image, BenchOp op, uint32_t put_size)
+{
+    FILE *out = fopen(script, "w");
+    uint64_t bytes = 0;
+
+    if (!out)
+        return 0;
+    fprintf(out, "open %s\n", image);
+
+    for (int i = 0; i < op_count(op); i++)
+    {
+        const BenchFile *file = &files[pick(i, file_count)];
+        switch (op)
+        {
+        case OP_LS:
+            fprintf(out, "ls %s\n", dirs[pick(i, dir_count)]);
+            break;
+        case OP_STAT:
+            fprintf(out, "stat %s\n", file->path);
+            break;
+        case OP_CD:
+            fprintf(out, "cd %s\n", dirs[pick(i, dir_count)]);
+            break;
+        case OP_READ:
+            fprintf(out, "read %s 0 %u -raw\n", file->path, file->size);
+            bytes += file->size;
+            break;
+        case OP_GET:
+            fprintf(out, "get %s %s/get.out\n", file->path, work_dir);
+            bytes += file->size;
+            break;
+        case OP_PUT:
+            // put does not grow directories, so the new files are spread
+            // over all of them; the cd is cheap next to the write
+            fprintf(out, "cd %s\nput %s/put.src P%07d.DAT\n", dirs[i % dir_count], work_dir, i);
+            bytes += put_size;
+            break;
+        }
+    }
+    fprintf(out, "close\n");
+    fclose(out);
+    return bytes;
+}
+
+static int write_put_source(uint32_t size)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/put.src", work_dir);
+
+    FILE *out = fopen(path, "wb");
+    if (!out)
+        return -1;
+    for (uint32_t i = 0; i < size; i++)
+        fputc((int)(i * 2654435761u >> 24), out);
+    return fclose(out);
+}
+
+static void bench_image(const char *label, const char *options, uint32_t put_size)
+{
+    char image[512], pristine[512], script[512];
+    snprintf(image, sizeof(image), "%s/%s.img", work_dir, label);
+    snprintf(pristine, sizeof(pristine), "%s/%s.orig", work_dir, label);
+    snprintf(script, sizeof(script), "%s/%s.mfs", work_dir, label);
+
+    if (generate(pristine, options) != 0)
+    {
+        fprintf(stderr, "Error: Could not generate the %s image\n", label);
+        return;
+    }
+
+    // Startup and open/close cost, subtracted from every figure below
+    double baseline = -1;
+    FILE *out = fopen(script, "w");
+    if (out)
+    {
+        fprintf(out, "open %s\nclose\n", pristine);
+        fclose(out);
+    }
+    for (int run = 0; run < RUNS; run++)
+    {
+        double t = run_script(script);
+        if (t >= 0 && (baseline < 0 || t < baseline))
+            baseline = t;
+    }
+    if (baseline < 0)
+    {
+        fprintf(stderr, "Error: %s cannot open the %s image\n", mfs_path, label);
+        return;
+    }
+
+    for (BenchOp op = OP_LS; op <= OP_PUT; op++)
+    {
+        // put changes the image, so every run starts from a fresh copy
+        const char *target = op == OP_PUT ? image : pristine;
+        uint64_t bytes = write_script(script, target, op, put_size);
+        double best = -1;
+
+        for (int run = 0; run < RUNS; run++)
+        {
+            if (op == OP_PUT && copy_file(pristine, image) != 0)
+                break;
+            double t = run_script(script);
+            if (t >= 0 && (best < 0 || t < best))
+                best = t;
+        }
+        if (best < 0)
+        {
+            printf("%-12s %-6s %8s\n", label, op_names[op], "failed");
+            continue;
+        }
+
+        double seconds = best - baseline;
+        if (seconds < 1e-6)
+            seconds = 1e-6;
+        printf("%-12s %-6s %8d %10.4f %12.1f", label, op_names[op], op_count(op), seconds, op_count(op) / seconds);
+        if (bytes)
+            printf(" %10.1f\n", bytes / seconds / (1024 * 1024));
+        else
+            printf(" %10s\n", "-");
+    }
+    remove(image);
+    remove(pristine);
+    remove(script);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-m mfs] [-g mkfat32] [-w workdir] [-i iterations]\n", program);
+    fprintf(stderr, "          [-s MB] [-c sectors-per-cluster] [-n files] [-d fan-out]\n");
+    fprintf(stderr, "          [-f fragmentation] [-z mean-file-bytes]\n");
+    fprintf(stderr, "Image options are passed to mkfat32; -f applies to the fragmented image.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t size_mb = 128;
+    uint32_t sectors_per_cluster = 8;
+    uint32_t count = 500;
+    uint32_t fan_out = 4;
+    double fragmentation = 0.5;
+    uint32_t mean_size = 64 * 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:g:w:i:s:c:n:d:f:z:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm': mfs_path = optarg; break;
+        case 'g': mkfat_path = optarg; break;
+        case 'w': work_dir = optarg; break;
+        case 'i': iterations = atoi(optarg); break;
+        case 's': size_mb = atoi(optarg); break;
+        case 'c': sectors_per_cluster = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'd': fan_out = atoi(optarg); break;
+        case 'f': fragmentation = atof(optarg); break;
+        case 'z': mean_size = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || iterations < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    files = calloc(MAX_MANIFEST, sizeof(BenchFile));
+    dirs = calloc(MAX_MANIFEST, sizeof(*dirs));
+    if (!files || !dirs || write_put_source(mean_size) != 0)
+    {
+        fprintf(stderr, "Error: Cannot set up %s: %s\n", work_dir, strerror(errno));
+        return 1;
+    }
+
+    printf("%u MB image, %u sectors per cluster, %u files of about %u bytes, fan-out %u\n", size_mb,
+           sectors_per_cluster, count, mean_size, fan_out);
+    printf("%-12s %-6s %8s %10s %12s %10s\n", "image", "op", "count", "seconds", "ops/sec", "MB/s");
+
+    char options[256];
+    snprintf(options, sizeof(options), "-s %u -c %u -n %u -d %u -z %u -f 0", size_mb, sectors_per_cluster, count,
+             fan_out, mean_size);
+    bench_image("contiguous", options, mean_size);
+    snprintf(options, sizeof(options), "-s %u -c %u -n %u -d %u -z %u -f %g", size_mb, sectors_per_cluster, count,
+             fan_out, mean_size, fragmentation);
+    bench_image("fragmented", options, mean_size);
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/put.src", work_dir);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/get.out", work_dir);
+    remove(path);
+    free(files);
+    free(dirs);
+    return 0;
+}
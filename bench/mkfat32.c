@@ -0,0 +1,325 @@
+// Synthetic FAT32 image generator for the benchmarks.
+//
+// Builds an image of the requested size and cluster size holding a
+// directory tree (fan-out subdirectories per level, two levels deep) and
+// a number of files of pseudo-random size and content spread over it.
+// With a fragmentation above zero, free gaps are left between the
+// clusters of files so their chains are broken into many runs. A manifest
+// line "path size" is printed for every file so a driver knows what to
+// ask for.
+
+#include "../mfs.h"
+#include "../struct.h"
+
+#include <getopt.h>
+
+typedef struct
+{
+    uint32_t parent; // index of the containing directory
+    uint32_t children;
+    uint32_t firstCluster;
+    uint32_t clusterCount;
+    uint32_t used; // entries written so far
+    char name[11];
+    char path[32];
+} Directory;
+
+static FILE *image;
+static uint32_t *fat;
+static uint32_t cluster_count; // data clusters, plus the two reserved entries
+static uint32_t next_cluster;
+static uint32_t bytes_per_cluster;
+static uint32_t first_data_sector;
+static uint64_t random_state;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ull;
+}
+
+static off_t cluster_offset(uint32_t cluster)
+{
+    return ((off_t)first_data_sector + (off_t)(cluster - 2) * (bytes_per_cluster / SECTOR_SIZE)) * SECTOR_SIZE;
+}
+
+// Claim count clusters as one chain, leaving a gap now and then when
+// fragmenting. Returns the first cluster, or 0 when the image is full.
+static uint32_t allocate_chain(uint32_t count, double fragmentation)
+{
+    uint32_t first = 0;
+    uint32_t previous = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (i > 0 && fragmentation > 0 && (next_random() % 1000) < fragmentation * 1000)
+            next_cluster += 1 + next_random() % 8;
+        if (next_cluster >= cluster_count)
+            return 0;
+
+        uint32_t cluster = next_cluster++;
+        fat[cluster] = 0x0FFFFFFF;
+        if (previous)
+            fat[previous] = cluster;
+        else
+            first = cluster;
+        previous = cluster;
+    }
+    return first;
+}
+
+static void set_name(char *name, const char *base, const char *ext)
+{
+    memset(name, ' ', 11);
+    memcpy(name, base, strlen(base));
+    memcpy(name + 8, ext, strlen(ext));
+}
+
+static void add_entry(Directory *dir, const char *name, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    DirEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.DIR_Name, name, 11);
+    entry.DIR_Attr = attr;
+    entry.DIR_FstClusHI = cluster >> 16;
+    entry.DIR_FstClusLO = cluster & 0xFFFF;
+    entry.DIR_FileSize = size;
+
+    // Directory chains are contiguous, so entry n is at a fixed offset
+    fseeko(image, cluster_offset(dir->firstCluster) + (off_t)dir->used * sizeof(DirEntry), SEEK_SET);
+    fwrite(&entry, sizeof(entry), 1, image);
+    dir->used++;
+}
+
+static void write_file(uint32_t first, uint32_t size, uint8_t *buffer)
+{
+    uint32_t cluster = first;
+    while (size > 0 && cluster >= 2 && cluster < 0x0FFFFFF8)
+    {
+        uint32_t length = size < bytes_per_cluster ? size : bytes_per_cluster;
+        for (uint32_t i = 0; i < length; i += 8)
+        {
+            uint64_t value = next_random();
+            memcpy(buffer + i, &value, length - i < 8 ? length - i : 8);
+        }
+        fseeko(image, cluster_offset(cluster), SEEK_SET);
+        fwrite(buffer, length, 1, image);
+        size -= length;
+        cluster = fat[cluster];
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-s MB] [-c sectors-per-cluster] [-n files] [-d fan-out]\n", program);
+    fprintf(stderr, "          [-f fragmentation] [-z mean-file-bytes] [-r seed] image\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t size_mb = 64;
+    uint32_t sectors_per_cluster = 8;
+    uint32_t file_count = 200;
+    uint32_t fan_out = 4;
+    double fragmentation = 0;
+    uint32_t mean_size = 64 * 1024;
+    random_state = 0x9E3779B97F4A7C15ull;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:n:d:f:z:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': size_mb = atoi(optarg); break;
+        case 'c': sectors_per_cluster = atoi(optarg); break;
+        case 'n': file_count = atoi(optarg); break;
+        case 'd': fan_out = atoi(optarg); break;
+        case 'f': fragmentation = atof(optarg); break;
+        case 'z': mean_size = atoi(optarg); break;
+        case 'r': random_state ^= strtoull(optarg, NULL, 0) * 0x2545F4914F6CDD1Dull; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+        sectors_per_cluster > 128 || size_mb < 33 || fan_out < 1 || fan_out > 64 || file_count > 99999)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Geometry: the FAT must cover the clusters that remain after it
+    uint32_t total_sectors = size_mb * 2048;
+    uint32_t reserved = 32;
+    uint32_t fat_sectors = 1;
+    for (;;)
+    {
+        uint32_t clusters = (total_sectors - reserved - 2 * fat_sectors) / sectors_per_cluster;
+        uint32_t needed = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (needed <= fat_sectors)
+            break;
+        fat_sectors = needed;
+    }
+    first_data_sector = reserved + 2 * fat_sectors;
+    cluster_count = (total_sectors - first_data_sector) / sectors_per_cluster + 2;
+    bytes_per_cluster = sectors_per_cluster * SECTOR_SIZE;
+
+    image = fopen(argv[optind], "wb+");
+    fat = calloc(fat_sectors, SECTOR_SIZE);
+    uint8_t *buffer = malloc(bytes_per_cluster + 8);
+    if (!image || !fat || !buffer || ftruncate(fileno(image), (off_t)total_sectors * SECTOR_SIZE) != 0)
+    {
+        fprintf(stderr, "Error: Cannot create %s\n", argv[optind]);
+        return 1;
+    }
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = 0x0FFFFFFF;
+    fat[2] = 0x0FFFFFFF;
+
+    // Directory tree: the root, fan_out directories under it, and fan_out
+    // under each of those
+    uint32_t dir_count = 1 + fan_out + fan_out * fan_out;
+    Directory *dirs = calloc(dir_count, sizeof(Directory));
+    if (!dirs)
+        return 1;
+    for (uint32_t i = 1; i < dir_count; i++)
+    {
+        uint32_t parent = i <= fan_out ? 0 : (i - fan_out - 1) / fan_out + 1;
+        char base[16];
+        snprintf(base, sizeof(base), "DIR%u", (i - 1) % fan_out);
+        dirs[i].parent = parent;
+        set_name(dirs[i].name, base, "");
+        snprintf(dirs[i].path, sizeof(dirs[i].path), "%.16s%.8s/", dirs[parent].path, base);
+        dirs[parent].children++;
+    }
+
+    // Files are dealt round-robin over every directory
+    uint32_t *file_sizes = malloc(file_count * sizeof(uint32_t));
+    if (!file_sizes)
+        return 1;
+    for (uint32_t i = 0; i < file_count; i++)
+    {
+        file_sizes[i] = 1 + next_random() % (2 * (uint64_t)mean_size);
+        dirs[i % dir_count].children++;
+    }
+
+    // Directories are laid out first and contiguously, so the tree itself
+    // stays compact and add_entry can address entries directly; the root
+    // is the first of them and lands on cluster 2
+    next_cluster = 2;
+    for (uint32_t i = 0; i < dir_count; i++)
+    {
+        uint32_t bytes = (dirs[i].children + 2) * sizeof(DirEntry);
+        dirs[i].clusterCount = (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
+        dirs[i].firstCluster = allocate_chain(dirs[i].clusterCount, 0);
+        if (!dirs[i].firstCluster)
+        {
+            fprintf(stderr, "Error: Image too small for %u directories\n", dir_count);
+            return 1;
+        }
+
+        // Zeroed clusters end the directory
+        memset(buffer, 0, bytes_per_cluster);
+        for (uint32_t c = 0; c < dirs[i].clusterCount; c++)
+        {
+            fseeko(image, cluster_offset(dirs[i].firstCluster + c), SEEK_SET);
+            fwrite(buffer, bytes_per_cluster, 1, image);
+        }
+    }
+    for (uint32_t i = 1; i < dir_count; i++)
+    {
+        Directory *parent = &dirs[dirs[i].parent];
+        add_entry(&dirs[i], ".          ", ATTRIBUTE_DIRECTORY, dirs[i].firstCluster, 0);
+        add_entry(&dirs[i], "..         ", ATTRIBUTE_DIRECTORY, dirs[i].parent ? parent->firstCluster : 0, 0);
+        add_entry(parent, dirs[i].name, ATTRIBUTE_DIRECTORY, dirs[i].firstCluster, 0);
+    }
+
+    for (uint32_t i = 0; i < file_count; i++)
+    {
+        Directory *dir = &dirs[i % dir_count];
+        uint32_t clusters = (file_sizes[i] + bytes_per_cluster - 1) / bytes_per_cluster;
+        uint32_t first = allocate_chain(clusters, fragmentation);
+        if (!first)
+        {
+            fprintf(stderr, "Error: Image full after %u files\n", i);
+            return 1;
+        }
+        write_file(first, file_sizes[i], buffer);
+
+        char base[16];
+        char name[11];
+        snprintf(base, sizeof(base), "F%05u", i);
+        set_name(name, base, "DAT");
+        add_entry(dir, name, ATTRIBUTE_ARCHIVE, first, file_sizes[i]);
+        printf("%s%s.DAT %u\n", dir->path, base, file_sizes[i]);
+    }
+
+    uint32_t free_count = 0;
+    for (uint32_t c = 2; c < cluster_count; c++)
+    {
+        if (fat[c] == 0)
+            free_count++;
+    }
+
+    BootSector boot;
+    memset(&boot, 0, sizeof(boot));
+    memcpy(boot.jumpInstruction, "\xEB\x58\x90", 3);
+    memcpy(boot.oemName, "MFSBENCH", 8);
+    boot.bytesPerSector = SECTOR_SIZE;
+    boot.sectorsPerCluster = sectors_per_cluster;
+    boot.reservedSectorCount = reserved;
+    boot.numberOfFATs = 2;
+    boot.mediaDescriptor = 0xF8;
+    boot.sectorsPerTrack = 63;
+    boot.numberOfHeads = 255;
+    boot.totalSectors32 = total_sectors;
+    boot.fatSize32 = fat_sectors;
+    boot.rootCluster = 2;
+    boot.fsInfoSector = 1;
+    boot.backupBootSector = 6;
+    boot.driveNumber = 0x80;
+
+    uint8_t sector[SECTOR_SIZE];
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &boot, sizeof(boot));
+    sector[sizeof(boot) + 1] = 0x29; // extended boot signature
+    memcpy(sector + 71, "MFSBENCH   FAT32   ", 19);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    FSInfo info;
+    memset(&info, 0, sizeof(info));
+    info.leadSignature = FSINFO_LEAD_SIGNATURE;
+    info.structSignature = FSINFO_STRUCT_SIGNATURE;
+    info.freeCount = free_count;
+    info.nextFree = next_cluster;
+    info.trailSignature = FSINFO_TRAIL_SIGNATURE;
+
+    for (uint32_t copy = 0; copy <= 6; copy += 6)
+    {
+        fseeko(image, (off_t)copy * SECTOR_SIZE, SEEK_SET);
+        fwrite(sector, SECTOR_SIZE, 1, image);
+        fwrite(&info, sizeof(info), 1, image);
+    }
+    for (uint32_t copy = 0; copy < 2; copy++)
+    {
+        fseeko(image, (off_t)(reserved + copy * fat_sectors) * SECTOR_SIZE, SEEK_SET);
+        fwrite(fat, SECTOR_SIZE, fat_sectors, image);
+    }
+
+    int failed = ferror(image);
+    if (fclose(image) != 0 || failed)
+    {
+        fprintf(stderr, "Error: Could not write %s\n", argv[optind]);
+        return 1;
+    }
+    free(file_sizes);
+    free(dirs);
+    free(buffer);
+    free(fat);
+    return 0;
+}
@@ -0,0 +1,263 @@
+// Concurrent read check and benchmark for libmfs.
+//
+// Generates an image with mkfat32, opens it once, and reads every file in
+// full on one thread to get reference contents. Then runs increasing
+// numbers of threads that all read random ranges of random files through
+// the same handle, comparing every byte with the reference, and reports
+// the aggregate throughput for each thread count and I/O backend. Any
+// mismatch or failed read is reported and makes the exit status nonzero.
+
+#include "../libmfs.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FILES 100000
+
+typedef struct
+{
+    char path[64];
+    uint32_t size;
+    uint8_t *data; // reference contents
+} RefFile;
+
+typedef struct
+{
+    mfs_fs *fs;
+    uint32_t reads;
+    uint32_t chunk;
+    uint64_t seed;
+    uint64_t bytes;
+    uint32_t failures;
+} Reader;
+
+static RefFile *files;
+static uint32_t file_count;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static int generate(const char *mkfat_path, const char *image, const char *options)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %s %s", mkfat_path, options, image);
+
+    FILE *manifest = popen(command, "r");
+    if (!manifest)
+        return -1;
+
+    char line[128];
+    file_count = 0;
+    while (fgets(line, sizeof(line), manifest) && file_count < MAX_FILES)
+    {
+        RefFile *file = &files[file_count];
+        if (sscanf(line, "%63s %u", file->path + 1, &file->size) != 2)
+            continue;
+        file->path[0] = '/';
+        file_count++;
+    }
+    return pclose(manifest) == 0 && file_count > 0 ? 0 : -1;
+}
+
+static int load_reference(mfs_fs *fs)
+{
+    for (uint32_t i = 0; i < file_count; i++)
+    {
+        RefFile *file = &files[i];
+        file->data = malloc(file->size ? file->size : 1);
+        if (!file->data || mfs_read(fs, file->path, 0, file->data, file->size) != file->size)
+        {
+            char message[256];
+            mfs_last_error(fs, message, sizeof(message));
+            fprintf(stderr, "Error: Reading %s: %s", file->path, message);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+    Reader *reader = arg;
+    uint8_t *buffer = malloc(reader->chunk);
+
+    if (!buffer)
+    {
+        reader->failures++;
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < reader->reads; i++)
+    {
+        const RefFile *file = &files[next_random(&reader->seed) % file_count];
+        uint64_t offset = next_random(&reader->seed) % file->size;
+        uint32_t length = reader->chunk;
+        if (length > file->size - offset)
+            length = file->size - offset;
+
+        int64_t got = mfs_read(reader->fs, file->path, offset, buffer, reader->chunk);
+        if (got != length || memcmp(buffer, file->data + offset, length) != 0)
+        {
+            if (reader->failures++ == 0)
+                fprintf(stderr, "Error: %s at %llu: got %lld of %u bytes%s\n", file->path,
+                        (unsigned long long)offset, (long long)got, length, got == length ? ", wrong data" : "");
+            continue;
+        }
+        reader->bytes += got;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Run the readers; returns the number of failed reads
+static uint32_t run_readers(mfs_fs *fs, const char *label, int threads, uint32_t reads, uint32_t chunk,
+                            double *single)
+{
+    Reader readers[threads];
+    pthread_t ids[threads];
+
+    for (int t = 0; t < threads; t++)
+    {
+        readers[t] = (Reader){fs, reads / threads, chunk, 0x9E3779B97F4A7C15ull * (t + 1), 0, 0};
+    }
+
+    double start = now();
+    int started = 0;
+    while (started < threads && pthread_create(&ids[started], NULL, reader_thread, &readers[started]) == 0)
+        started++;
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+    double seconds = now() - start;
+
+    uint64_t bytes = 0;
+    uint32_t failures = started < threads ? 1 : 0;
+    for (int t = 0; t < started; t++)
+    {
+        bytes += readers[t].bytes;
+        failures += readers[t].failures;
+    }
+
+    double rate = bytes / seconds / (1024 * 1024);
+    if (threads == 1)
+        *single = rate;
+    printf("%-8s %7d %10.4f %10.1f %8.2fx %8u\n", label, threads, seconds, rate, *single > 0 ? rate / *single : 0,
+           failures);
+    return failures;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-g mkfat32] [-w workdir] [-t max-threads] [-r reads] [-k chunk-bytes]\n", program);
+    fprintf(stderr, "          [-s MB] [-c sectors-per-cluster] [-n files] [-f fragmentation]\n");
+    fprintf(stderr, "          [-z mean-file-bytes]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mkfat_path = "./bench/mkfat32";
+    const char *work_dir = "bench/work";
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 1 ? (cpus < 16 ? cpus : 16) : 4;
+    uint32_t reads = 20000;
+    uint32_t chunk = 16 * 1024;
+    uint32_t size_mb = 128;
+    uint32_t sectors_per_cluster = 8;
+    uint32_t count = 500;
+    double fragmentation = 0.5;
+    uint32_t mean_size = 64 * 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:w:t:r:k:s:c:n:f:z:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g': mkfat_path = optarg; break;
+        case 'w': work_dir = optarg; break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'r': reads = atoi(optarg); break;
+        case 'k': chunk = atoi(optarg); break;
+        case 's': size_mb = atoi(optarg); break;
+        case 'c': sectors_per_cluster = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'f': fragmentation = atof(optarg); break;
+        case 'z': mean_size = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc || max_threads < 1 || max_threads > 256 || reads < 1 || chunk < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char image[512], options[256];
+    snprintf(image, sizeof(image), "%s/mtread.img", work_dir);
+    snprintf(options, sizeof(options), "-s %u -c %u -n %u -z %u -f %g", size_mb, sectors_per_cluster, count,
+             mean_size, fragmentation);
+
+    files = calloc(MAX_FILES, sizeof(RefFile));
+    if (!files || generate(mkfat_path, image, options) != 0)
+    {
+        fprintf(stderr, "Error: Could not generate %s\n", image);
+        return 1;
+    }
+
+    printf("%u files of about %u bytes, %u reads of up to %u bytes per run\n", file_count, mean_size, reads, chunk);
+    printf("%-8s %7s %10s %10s %9s %8s\n", "backend", "threads", "seconds", "MB/s", "speedup", "failed");
+
+    uint32_t failures = 0;
+    static const struct
+    {
+        const char *label;
+        int flags;
+    } backends[] = {{"mmap", 0}, {"pread", MFS_OPEN_PREAD}};
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        mfs_fs *fs = mfs_open(image, backends[b].flags);
+        if (!fs)
+        {
+            fprintf(stderr, "Error: Cannot open %s\n", image);
+            return 1;
+        }
+        if (b == 0 && load_reference(fs) != 0)
+            return 1;
+
+        double single = 0;
+        // Powers of two, then the maximum
+        for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+        {
+            failures += run_readers(fs, backends[b].label, threads, reads, chunk, &single);
+            if (threads == max_threads)
+                break;
+        }
+        mfs_close(fs);
+    }
+
+    remove(image);
+    for (uint32_t i = 0; i < file_count; i++)
+        free(files[i].data);
+    free(files);
+    return failures ? 1 : 0;
+}
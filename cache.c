@@ -0,0 +1,352 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Bounded write-back sector cache in front of the pread backend. Blocks are
+// kept on an LRU list and in a chained hash table keyed by sector number.
+// Dirty blocks are written back when they are evicted and on cache_flush().
+// One mutex guards the lists; a read drops it while it fetches missing
+// sectors, which is safe because a sector that is not cached is current on
+// the image, so concurrent readers overlap their I/O.
+typedef struct CacheBlock
+{
+    uint32_t sector;
+    int dirty;
+    struct CacheBlock *prev; // LRU list, most recently used at the head
+    struct CacheBlock *next;
+    struct CacheBlock *hash_next;
+    uint8_t *data;
+} CacheBlock;
+
+struct CacheState
+{
+    uint32_t cache_capacity;
+    uint32_t cache_used;
+    uint32_t cache_block_size;
+    CacheBlock *cache_blocks;
+    uint8_t *cache_data;
+    CacheBlock **cache_buckets;
+    uint32_t cache_bucket_mask;
+    CacheBlock *lru_head;
+    CacheBlock *lru_tail;
+    CacheBlock *free_blocks;
+
+    CacheStats stats;
+    pthread_mutex_t lock;
+};
+
+#define CACHE (mfs_current->cache)
+
+CacheState *cache_state_new(void)
+{
+    CacheState *state = calloc(1, sizeof(CacheState));
+    if (state)
+    {
+        state->cache_capacity = CACHE_DEFAULT_BLOCKS;
+        pthread_mutex_init(&state->lock, NULL);
+    }
+    return state;
+}
+
+static uint32_t bucket_of(uint32_t sector)
+{
+    return (sector * 2654435761u) & CACHE->cache_bucket_mask;
+}
+
+static void lru_unlink(CacheBlock *block)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        CACHE->lru_head = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    else
+        CACHE->lru_tail = block->prev;
+    block->prev = block->next = NULL;
+}
+
+static void lru_push_front(CacheBlock *block)
+{
+    block->prev = NULL;
+    block->next = CACHE->lru_head;
+    if (CACHE->lru_head)
+        CACHE->lru_head->prev = block;
+    CACHE->lru_head = block;
+    if (!CACHE->lru_tail)
+        CACHE->lru_tail = block;
+}
+
+static CacheBlock *lookup(uint32_t sector)
+{
+    for (CacheBlock *block = CACHE->cache_buckets[bucket_of(sector)]; block; block = block->hash_next)
+    {
+        if (block->sector == sector)
+            return block;
+    }
+    return NULL;
+}
+
+static void hash_remove(CacheBlock *block)
+{
+    CacheBlock **link = &CACHE->cache_buckets[bucket_of(block->sector)];
+    while (*link && *link != block)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = block->hash_next;
+    block->hash_next = NULL;
+}
+
+static int write_back(CacheBlock *block)
+{
+    if (!block->dirty)
+        return 0;
+    if (disk_raw_write(block->sector, 1, block->data) != 1)
+        return -1;
+    block->dirty = 0;
+    CACHE->stats.writebacks++;
+    return 0;
+}
+
+// Get a block for a sector that is not cached, evicting the LRU block if full
+static CacheBlock *take_block(uint32_t sector)
+{
+    CacheBlock *block = CACHE->free_blocks;
+
+    if (block)
+    {
+        CACHE->free_blocks = block->next;
+        CACHE->cache_used++;
+    }
+    else
+    {
+        block = CACHE->lru_tail;
+        if (!block || write_back(block) != 0)
+            return NULL;
+        lru_unlink(block);
+        hash_remove(block);
+        CACHE->stats.evictions++;
+    }
+
+    block->sector = sector;
+    block->dirty = 0;
+    block->hash_next = CACHE->cache_buckets[bucket_of(sector)];
+    CACHE->cache_buckets[bucket_of(sector)] = block;
+    lru_push_front(block);
+    return block;
+}
+
+int cache_init(void)
+{
+    cache_release();
+
+    if (CACHE->cache_capacity == 0 || bs.bytesPerSector == 0)
+        return 0;
+
+    uint32_t buckets = 1;
+    while (buckets < CACHE->cache_capacity * 2)
+        buckets <<= 1;
+
+    CACHE->cache_block_size = bs.bytesPerSector;
+    CACHE->cache_blocks = calloc(CACHE->cache_capacity, sizeof(CacheBlock));
+    CACHE->cache_data = malloc((size_t)CACHE->cache_capacity * CACHE->cache_block_size);
+    CACHE->cache_buckets = calloc(buckets, sizeof(CacheBlock *));
+    if (!CACHE->cache_blocks || !CACHE->cache_data || !CACHE->cache_buckets)
+    {
+        cache_release();
+        return -1;
+    }
+
+    CACHE->cache_bucket_mask = buckets - 1;
+    for (uint32_t i = 0; i < CACHE->cache_capacity; i++)
+    {
+        CACHE->cache_blocks[i].data = CACHE->cache_data + (size_t)i * CACHE->cache_block_size;
+        CACHE->cache_blocks[i].next = CACHE->free_blocks;
+        CACHE->free_blocks = &CACHE->cache_blocks[i];
+    }
+    return 0;
+}
+
+void cache_release(void)
+{
+    free(CACHE->cache_blocks);
+    free(CACHE->cache_data);
+    free(CACHE->cache_buckets);
+    CACHE->cache_blocks = NULL;
+    CACHE->cache_data = NULL;
+    CACHE->cache_buckets = NULL;
+    CACHE->lru_head = CACHE->lru_tail = CACHE->free_blocks = NULL;
+    CACHE->cache_used = 0;
+}
+
+int cache_enabled(void)
+{
+    return CACHE->cache_blocks != NULL;
+}
+
+void cache_set_capacity(uint32_t blocks)
+{
+    CACHE->cache_capacity = blocks;
+}
+
+int cache_read(uint32_t sector, uint32_t count, void *buffer, int insert)
+{
+    uint8_t *out = buffer;
+    uint32_t i = 0;
+
+    pthread_mutex_lock(&CACHE->lock);
+    while (i < count)
+    {
+        CacheBlock *block = lookup(sector + i);
+        if (block)
+        {
+            memcpy(out + (size_t)i * CACHE->cache_block_size, block->data, CACHE->cache_block_size);
+            lru_unlink(block);
+            lru_push_front(block);
+            if (insert)
+                CACHE->stats.hits++;
+            i++;
+            continue;
+        }
+
+        // Read the whole run of missing sectors with one backend request
+        uint32_t run = 1;
+        while (i + run < count && !lookup(sector + i + run))
+            run++;
+
+        uint8_t *dest = out + (size_t)i * CACHE->cache_block_size;
+        pthread_mutex_unlock(&CACHE->lock);
+        int result = disk_raw_read(sector + i, run, dest);
+        pthread_mutex_lock(&CACHE->lock);
+        if (result != 1)
+        {
+            pthread_mutex_unlock(&CACHE->lock);
+            return 0;
+        }
+        if (insert)
+        {
+            CACHE->stats.misses += run;
+            for (uint32_t j = 0; j < run; j++)
+            {
+                // Another reader may have brought it in meanwhile
+                if (lookup(sector + i + j))
+                    continue;
+                CacheBlock *fresh = take_block(sector + i + j);
+                if (fresh)
+                    memcpy(fresh->data, dest + (size_t)j * CACHE->cache_block_size, CACHE->cache_block_size);
+            }
+        }
+        i += run;
+    }
+    pthread_mutex_unlock(&CACHE->lock);
+    return 1;
+}
+
+static int write_locked(uint32_t sector, uint32_t count, const void *buffer, int insert)
+{
+    const uint8_t *in = buffer;
+
+    if (!insert)
+    {
+        // Large writes go straight to the image; refresh any cached copies
+        if (disk_raw_write(sector, count, buffer) != 1)
+            return 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            CacheBlock *block = lookup(sector + i);
+            if (block)
+            {
+                memcpy(block->data, in + (size_t)i * CACHE->cache_block_size, CACHE->cache_block_size);
+                block->dirty = 0;
+            }
+        }
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        CacheBlock *block = lookup(sector + i);
+        if (block)
+        {
+            lru_unlink(block);
+            lru_push_front(block);
+        }
+        else
+        {
+            block = take_block(sector + i);
+            if (!block)
+                return disk_raw_write(sector + i, count - i, in + (size_t)i * CACHE->cache_block_size);
+        }
+        memcpy(block->data, in + (size_t)i * CACHE->cache_block_size, CACHE->cache_block_size);
+        block->dirty = 1;
+    }
+    return 1;
+}
+
+int cache_write(uint32_t sector, uint32_t count, const void *buffer, int insert)
+{
+    pthread_mutex_lock(&CACHE->lock);
+    int result = write_locked(sector, count, buffer, insert);
+    pthread_mutex_unlock(&CACHE->lock);
+    return result;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    uint32_t sa = (*(CacheBlock *const *)a)->sector;
+    uint32_t sb = (*(CacheBlock *const *)b)->sector;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static int flush_locked(void)
+{
+    if (!CACHE->cache_blocks)
+        return 0;
+
+    CacheBlock **dirty = malloc(CACHE->cache_used * sizeof(CacheBlock *) + 1);
+    if (!dirty)
+        return -1;
+
+    uint32_t count = 0;
+    for (CacheBlock *block = CACHE->lru_head; block; block = block->next)
+    {
+        if (block->dirty)
+            dirty[count++] = block;
+    }
+
+    // Write back in sector order so the image sees one forward pass
+    qsort(dirty, count, sizeof(CacheBlock *), compare_blocks);
+
+    int result = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (write_back(dirty[i]) != 0)
+            result = -1;
+    }
+
+    free(dirty);
+    return result;
+}
+
+int cache_flush(void)
+{
+    pthread_mutex_lock(&CACHE->lock);
+    int result = flush_locked();
+    pthread_mutex_unlock(&CACHE->lock);
+    return result;
+}
+
+void cache_get_stats(CacheStats *out)
+{
+    pthread_mutex_lock(&CACHE->lock);
+    *out = CACHE->stats;
+    out->capacity = CACHE->cache_capacity;
+    out->used = CACHE->cache_used;
+    pthread_mutex_unlock(&CACHE->lock);
+}
+
+void cache_reset_stats(void)
+{
+    pthread_mutex_lock(&CACHE->lock);
+    memset(&CACHE->stats, 0, sizeof(CACHE->stats));
+    pthread_mutex_unlock(&CACHE->lock);
+}
@@ -0,0 +1,534 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <pthread.h>
+
+// Consistency check. Worker threads take directories from a shared queue,
+// read them, and walk the chain of every entry through the in-memory FAT,
+// claiming each cluster in an ownership bitmap with an atomic OR. A cluster
+// that is already claimed is cross-linked; a chain that leaves the volume
+// or runs into a free or bad cluster is broken; a file chain whose length
+// does not fit DIR_FileSize is reported as well. Once the tree is done, one
+// pass over the FAT finds clusters in use that nobody claimed, and the
+// mirror FATs are compared with the active one. Chains still held by
+// deleted files (see undelete.c) do not count as lost.
+//
+// The repair pass runs afterwards on the calling thread. A damaged chain is
+// cut at the last cluster worth keeping, the clusters it owned past that
+// point are freed and the entry's size is brought in line; lost clusters are
+// freed and the mirrors are rewritten at the next sync.
+#define CHECK_CROSS_LINK 0
+#define CHECK_BAD_CHAIN 1
+#define CHECK_SIZE 2
+#define CHECK_UNREADABLE 3
+
+typedef struct
+{
+    int kind; // CHECK_*
+    char *path;
+    uint32_t dir_cluster; // directory holding the entry, 0 for the root itself
+    char name[11];
+    int is_directory;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t cluster; // where the chain went wrong
+    uint32_t owned;   // clusters of the chain claimed by this entry
+    uint32_t keep;    // clusters the repair leaves in the chain
+    uint32_t needed;  // clusters DIR_FileSize calls for
+} CheckIssue;
+
+typedef struct
+{
+    uint32_t cluster;
+    char *path;
+} CheckDir;
+
+typedef struct
+{
+    mfs_fs *fs; // the workers act on the caller's filesystem
+    uint64_t *owned;
+    uint32_t limit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    CheckDir *dirs; // queue: taken from head, appended at count
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+    int busy; // workers inside a directory
+    int failed; // out of memory
+    int partial; // some directory could not be walked in full
+
+    CheckIssue *issues;
+    uint32_t issue_count;
+    uint32_t issue_capacity;
+
+    uint32_t files;
+    uint32_t directories;
+} CheckWalk;
+
+// Set the cluster's bit; 0 if it was already set
+static int claim(CheckWalk *walk, uint32_t cluster)
+{
+    uint64_t bit = 1ULL << (cluster & 63);
+    return !(__atomic_fetch_or(&walk->owned[cluster >> 6], bit, __ATOMIC_RELAXED) & bit);
+}
+
+static int is_owned(const CheckWalk *walk, uint32_t cluster)
+{
+    return (walk->owned[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+static void add_issue(CheckWalk *walk, const CheckIssue *issue)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->issue_count == walk->issue_capacity)
+    {
+        uint32_t capacity = walk->issue_capacity ? walk->issue_capacity * 2 : 16;
+        CheckIssue *grown = realloc(walk->issues, capacity * sizeof(CheckIssue));
+        if (!grown)
+        {
+            __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&walk->lock);
+            free(issue->path);
+            return;
+        }
+        walk->issues = grown;
+        walk->issue_capacity = capacity;
+    }
+    walk->issues[walk->issue_count++] = *issue;
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Takes ownership of path
+static void queue_dir(CheckWalk *walk, uint32_t cluster, char *path)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->count == walk->capacity)
+    {
+        uint32_t capacity = walk->capacity ? walk->capacity * 2 : 64;
+        CheckDir *grown = realloc(walk->dirs, capacity * sizeof(CheckDir));
+        if (!grown)
+        {
+            __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&walk->lock);
+            free(path);
+            return;
+        }
+        walk->dirs = grown;
+        walk->capacity = capacity;
+    }
+    walk->dirs[walk->count++] = (CheckDir){cluster, path};
+    pthread_cond_signal(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Claim the chain starting at issue->first_cluster. Returns 1 if it ended
+// cleanly, 0 with issue->kind and issue->cluster set if it did not.
+static int claim_chain(CheckWalk *walk, CheckIssue *issue)
+{
+    uint32_t cluster = issue->first_cluster;
+
+    issue->owned = 0;
+    if (cluster == 0 && !issue->is_directory)
+        return 1;
+
+    while (issue->owned < walk->limit)
+    {
+        if (cluster < 2 || cluster >= walk->limit)
+        {
+            issue->kind = CHECK_BAD_CHAIN;
+            issue->cluster = cluster;
+            return 0;
+        }
+        if (!claim(walk, cluster))
+        {
+            issue->kind = CHECK_CROSS_LINK;
+            issue->cluster = cluster;
+            return 0;
+        }
+        issue->owned++;
+
+        uint32_t next = get_fat_entry(cluster);
+        if (next >= EOC)
+            return 1;
+        cluster = next;
+    }
+    return 1;
+}
+
+static char *join_path(const char *parent, const char *name)
+{
+    size_t length = strlen(parent) + strlen(name) + 2;
+    char *path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s%s%s", parent, strcmp(parent, "/") == 0 ? "" : "/", name);
+    return path;
+}
+
+static void check_entry(CheckWalk *walk, const DirEntry *entry, uint32_t dir_cluster, const char *dir_path)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    char display[13];
+    path_display_name(entry->DIR_Name, display);
+
+    CheckIssue issue = {0};
+    issue.dir_cluster = dir_cluster;
+    memcpy(issue.name, entry->DIR_Name, 11);
+    issue.is_directory = (entry->DIR_Attr & ATTRIBUTE_DIRECTORY) != 0;
+    issue.first_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    issue.size = entry->DIR_FileSize;
+    issue.needed = (uint32_t)(((uint64_t)issue.size + bytes_per_cluster - 1) / bytes_per_cluster);
+
+    int clean = claim_chain(walk, &issue);
+    if (issue.is_directory)
+    {
+        __atomic_fetch_add(&walk->directories, 1, __ATOMIC_RELAXED);
+        issue.keep = issue.owned;
+        if (clean)
+        {
+            char *path = join_path(dir_path, display);
+            if (path)
+                queue_dir(walk, issue.first_cluster, path);
+            else
+                __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_store_n(&walk->partial, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&walk->files, 1, __ATOMIC_RELAXED);
+        issue.keep = issue.owned < issue.needed ? issue.owned : issue.needed;
+        if (clean && issue.owned == issue.needed)
+            return;
+        if (clean)
+            issue.kind = CHECK_SIZE;
+    }
+
+    issue.path = join_path(dir_path, display);
+    if (!issue.path)
+    {
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    add_issue(walk, &issue);
+}
+
+static void check_dir(CheckWalk *walk, const CheckDir *dir)
+{
+    DirEntry *entries;
+    uint32_t count;
+    if (dir_read_entries(dir->cluster, &entries, &count) != 0)
+    {
+        CheckIssue issue = {.kind = CHECK_UNREADABLE, .path = strdup(dir->path)};
+        __atomic_store_n(&walk->partial, 1, __ATOMIC_RELAXED);
+        if (issue.path)
+            add_issue(walk, &issue);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        check_entry(walk, &entries[i], dir->cluster, dir->path);
+    free(entries);
+}
+
+static void *check_worker(void *arg)
+{
+    CheckWalk *walk = arg;
+
+    mfs_current = walk->fs;
+    pthread_mutex_lock(&walk->lock);
+    for (;;)
+    {
+        while (walk->head == walk->count && walk->busy > 0)
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        if (walk->head == walk->count)
+            break;
+
+        CheckDir dir = walk->dirs[walk->head++];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        check_dir(walk, &dir);
+        free(dir.path);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        if (walk->head == walk->count && walk->busy == 0)
+            pthread_cond_broadcast(&walk->changed);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+static int compare_issues(const void *a, const void *b)
+{
+    const CheckIssue *x = a;
+    const CheckIssue *y = b;
+    return strcmp(x->path, y->path);
+}
+
+static void print_issue(const CheckIssue *issue)
+{
+    switch (issue->kind)
+    {
+    case CHECK_CROSS_LINK:
+        printf("Cross-linked: %s shares cluster %u\n", issue->path, issue->cluster);
+        break;
+    case CHECK_BAD_CHAIN:
+        if (issue->cluster == 0)
+            printf("Broken chain: %s runs into a free cluster after %u clusters\n", issue->path, issue->owned);
+        else
+            printf("Broken chain: %s reaches invalid cluster %u after %u clusters\n", issue->path, issue->cluster,
+                   issue->owned);
+        break;
+    case CHECK_SIZE:
+        printf("Size mismatch: %s has %u clusters, its size needs %u\n", issue->path, issue->owned,
+               issue->needed);
+        break;
+    case CHECK_UNREADABLE:
+        printf("Unreadable directory: %s\n", issue->path);
+        break;
+    }
+}
+
+// Cut a chain after keep clusters and free the ones it owned past that
+static void truncate_chain(uint32_t first, uint32_t keep, uint32_t owned)
+{
+    uint32_t cluster = first;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < keep; i++)
+    {
+        last = cluster;
+        cluster = get_fat_entry(cluster);
+    }
+    if (last)
+        update_fat_entry(last, 0x0FFFFFFF);
+
+    for (uint32_t i = keep; i < owned; i++)
+    {
+        uint32_t next = get_fat_entry(cluster);
+        update_fat_entry(cluster, 0);
+        cluster = next;
+    }
+}
+
+static int repair_issue(const CheckIssue *issue)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+
+    if (issue->kind == CHECK_UNREADABLE || (issue->is_directory && issue->keep == 0))
+        return 0;
+
+    // The root directory has no entry of its own; only its chain is cut
+    uint32_t sector = 0, slot = 0;
+    DirEntry entry;
+    if (issue->dir_cluster &&
+        !find_deleted_file_entry(issue->name, issue->dir_cluster, &entry, &sector, &slot, 0))
+        return 0;
+
+    uint8_t buffer[SECTOR_SIZE];
+    DirEntry previous;
+    int repaired = 0;
+    int entry_written = 0;
+    fat_begin();
+    journal_begin();
+    truncate_chain(issue->first_cluster, issue->keep, issue->owned);
+    if (!issue->dir_cluster || issue->is_directory)
+    {
+        repaired = fat_flush() == 0;
+    }
+    else if (read_disk_sector(sector, buffer) == 1 && fat_flush() == 0)
+    {
+        DirEntry *dir = &((DirEntry *)buffer)[slot];
+        previous = *dir;
+        uint64_t kept_bytes = (uint64_t)issue->keep * bytes_per_cluster;
+        if (kept_bytes < dir->DIR_FileSize)
+            dir->DIR_FileSize = kept_bytes;
+        if (issue->keep == 0)
+        {
+            dir->DIR_FstClusHI = 0;
+            dir->DIR_FstClusLO = 0;
+        }
+        repaired = entry_written = write_disk_sector(sector, buffer) == 1;
+    }
+    if (journal_end() != 0 && repaired)
+    {
+        // Not durable: leave the entry and the chain as they were
+        if (entry_written)
+        {
+            ((DirEntry *)buffer)[slot] = previous;
+            write_disk_sector(sector, buffer);
+        }
+        repaired = 0;
+    }
+    if (repaired)
+        fat_commit();
+    else
+        fat_abort();
+    return repaired;
+}
+
+// check [-repair]: returns the number of problems left, or -1 if the check
+// itself failed
+int cmd_check(int repair)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return -1;
+    }
+
+    CheckWalk walk = {0};
+    walk.fs = mfs_current;
+    walk.limit = fat_cluster_limit();
+    walk.owned = calloc((walk.limit + 63) / 64, sizeof(uint64_t));
+    if (!walk.owned)
+    {
+        print_error("Memory allocation failed\n");
+        return -1;
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.changed, NULL);
+
+    // The root's own chain, then everything below it
+    CheckIssue root = {.first_cluster = bs.rootCluster, .is_directory = 1};
+    if (claim_chain(&walk, &root))
+    {
+        queue_dir(&walk, bs.rootCluster, strdup("/"));
+    }
+    else
+    {
+        root.keep = root.owned;
+        root.path = strdup("/");
+        walk.partial = 1;
+        if (root.path)
+            add_issue(&walk, &root);
+    }
+
+    pthread_t threads[CHECK_THREADS];
+    int started = 0;
+    while (started < CHECK_THREADS - 1 && pthread_create(&threads[started], NULL, check_worker, &walk) == 0)
+        started++;
+    check_worker(&walk);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    // Chains that del left to deleted files are kept for undel, not lost
+    const DeletedFile *deleted;
+    uint32_t deleted_count;
+    if (deleted_index_get(&deleted, &deleted_count) != 0)
+        deleted_count = 0;
+    for (uint32_t i = 0; i < deleted_count; i++)
+    {
+        uint32_t cluster = deleted[i].firstCluster;
+        if (deleted[i].state != DELETED_HELD)
+            continue;
+        while (cluster >= 2 && cluster < walk.limit && get_fat_entry(cluster) != 0 && claim(&walk, cluster))
+            cluster = get_fat_entry(cluster);
+    }
+
+    // One pass over the FAT for clusters in use that no entry reached. A
+    // lost cluster no other lost cluster points at starts a lost chain.
+    uint64_t *pointed = calloc((walk.limit + 63) / 64, sizeof(uint64_t));
+    uint32_t lost_clusters = 0, lost_chains = 0, in_use = 0;
+    for (uint32_t c = 2; c < walk.limit && pointed; c++)
+    {
+        uint32_t next = get_fat_entry(c);
+        if (next == 0 || next == 0x0FFFFFF7)
+            continue;
+        in_use++;
+        if (is_owned(&walk, c))
+            continue;
+        lost_clusters++;
+        if (next >= 2 && next < walk.limit)
+            pointed[next >> 6] |= 1ULL << (next & 63);
+    }
+    for (uint32_t c = 2; c < walk.limit && pointed; c++)
+    {
+        uint32_t next = get_fat_entry(c);
+        if (next != 0 && next != 0x0FFFFFF7 && !is_owned(&walk, c) && !((pointed[c >> 6] >> (c & 63)) & 1))
+            lost_chains++;
+    }
+    if (lost_clusters > 0 && lost_chains == 0)
+        lost_chains = 1; // nothing but loops
+
+    int64_t mirror_sectors = fat_check_mirrors();
+
+    if (!pointed || walk.failed)
+    {
+        print_error("Memory allocation failed\n");
+    }
+    else if (mirror_sectors < 0)
+    {
+        print_error("Could not read the FAT mirrors\n");
+    }
+
+    uint32_t problems = walk.issue_count + (lost_clusters > 0) + (mirror_sectors > 0);
+    if (walk.issue_count > 0)
+        qsort(walk.issues, walk.issue_count, sizeof(CheckIssue), compare_issues);
+    for (uint32_t i = 0; i < walk.issue_count; i++)
+        print_issue(&walk.issues[i]);
+    if (lost_clusters > 0)
+        printf("Lost: %u clusters in %u chains\n", lost_clusters, lost_chains);
+    if (mirror_sectors > 0)
+        printf("FAT mirrors: %lld sectors differ from the active FAT\n", (long long)mirror_sectors);
+
+    printf("Checked %u files and %u directories, %u clusters in use: ", walk.files, walk.directories + 1, in_use);
+    if (problems == 0)
+        printf("no problems found\n");
+    else
+        printf("%u problem%s found\n", problems, problems == 1 ? "" : "s");
+
+    uint32_t repaired = 0;
+    if (repair && problems > 0 && pointed && !walk.failed)
+    {
+        for (uint32_t i = 0; i < walk.issue_count; i++)
+            repaired += repair_issue(&walk.issues[i]);
+
+        // Whatever sits below a directory that was not walked looks lost
+        if (lost_clusters > 0 && walk.partial)
+        {
+            printf("Lost clusters kept: some directories could not be walked\n");
+        }
+        else if (lost_clusters > 0)
+        {
+            fat_begin();
+            journal_begin();
+            for (uint32_t c = 2; c < walk.limit; c++)
+            {
+                uint32_t next = get_fat_entry(c);
+                if (next != 0 && next != 0x0FFFFFF7 && !is_owned(&walk, c))
+                    update_fat_entry(c, 0);
+            }
+            int freed = fat_flush() == 0;
+            if (journal_end() != 0)
+                freed = 0;
+            if (freed)
+                fat_commit();
+            else
+                fat_abort();
+            repaired += freed;
+        }
+        if (mirror_sectors > 0)
+        {
+            fat_mark_mirrors_stale();
+            repaired++;
+        }
+        printf("Repaired %u of %u problems\n", repaired, problems);
+    }
+
+    for (uint32_t i = 0; i < walk.issue_count; i++)
+        free(walk.issues[i].path);
+    free(walk.issues);
+    free(walk.dirs);
+    free(walk.owned);
+    free(pointed);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.changed);
+
+    if (!pointed || walk.failed || mirror_sectors < 0)
+        return -1;
+    return problems - repaired;
+}
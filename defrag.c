@@ -0,0 +1,383 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Fragmentation report and online defragmentation. A file's fragmentation
+// is the number of runs in the part of its chain that holds data, taken
+// from the in-memory FAT. Defragmenting a file copies that part into freshly
+// allocated runs, in large pieces, and then switches the directory entry
+// over and frees the old chain in one metadata transaction, so until the
+// switch the file is untouched. Directories are reported but not moved:
+// their first cluster is also named by "." and by every child's "..".
+#define DEFRAG_MOVED 0
+#define DEFRAG_CONTIGUOUS 1
+#define DEFRAG_NO_SPACE 2
+#define DEFRAG_FAILED -1
+
+typedef struct
+{
+    uint32_t files;
+    uint32_t fragmented;
+    uint32_t moved;
+    uint32_t no_space;
+    uint32_t failed;
+    uint64_t extents_before;
+    uint64_t extents_after;
+} DefragTotals;
+
+static uint32_t entry_cluster(const DirEntry *entry)
+{
+    return ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+}
+
+// Clusters that hold data: the size for files, the whole chain otherwise
+static uint32_t data_clusters(const DirEntry *entry)
+{
+    if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
+        return UINT32_MAX;
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    return (uint32_t)(((uint64_t)entry->DIR_FileSize + bytes_per_cluster - 1) / bytes_per_cluster);
+}
+
+static int count_extents(const DirEntry *entry, uint32_t *extents, uint32_t *clusters)
+{
+    *extents = 0;
+    *clusters = 0;
+
+    uint32_t first = entry_cluster(entry);
+    uint32_t wanted = data_clusters(entry);
+    if (first < 2 || wanted == 0)
+        return 0;
+
+    Extent *runs;
+    uint32_t count;
+    if (fat_build_extents(first, wanted, &runs, &count) != 0)
+        return -1;
+    for (uint32_t i = 0; i < count; i++)
+        *clusters += runs[i].clusterCount;
+    *extents = count;
+    free(runs);
+    return 0;
+}
+
+static void print_frag_line(const DirEntry *entry, uint32_t extents, uint32_t clusters)
+{
+    char display[14];
+    path_display_name(entry->DIR_Name, display);
+    if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
+        strcat(display, "/");
+    printf("%-13s %8u %9u\n", display, extents, clusters);
+}
+
+// frag [path]: runs per file, or per entry of a directory with a summary
+void cmd_frag(const char *path)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+
+    DirEntry found;
+    uint32_t dir_cluster = current_dir_cluster;
+    if (path && !path_find_entry(path, &found, NULL))
+    {
+        print_error("File not found\n");
+        return;
+    }
+
+    uint32_t extents, clusters;
+    if (path && !(found.DIR_Attr & ATTRIBUTE_DIRECTORY))
+    {
+        if (count_extents(&found, &extents, &clusters) != 0)
+        {
+            print_error("Memory allocation failed\n");
+            return;
+        }
+        printf("%-13s %8s %9s\n", "name", "extents", "clusters");
+        print_frag_line(&found, extents, clusters);
+        return;
+    }
+    if (path)
+    {
+        dir_cluster = entry_cluster(&found);
+        if (dir_cluster == 0)
+            dir_cluster = bs.rootCluster;
+    }
+
+    DirEntry *entries;
+    uint32_t entry_count;
+    if (dir_read_entries(dir_cluster, &entries, &entry_count) != 0)
+    {
+        print_error("Could not read directory\n");
+        return;
+    }
+
+    DefragTotals totals = {0};
+    printf("%-13s %8s %9s\n", "name", "extents", "clusters");
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        if (count_extents(&entries[i], &extents, &clusters) != 0)
+        {
+            print_error("Memory allocation failed\n");
+            break;
+        }
+        print_frag_line(&entries[i], extents, clusters);
+        if (entries[i].DIR_Attr & ATTRIBUTE_DIRECTORY)
+            continue;
+        totals.files++;
+        totals.extents_before += extents;
+        if (extents > 1)
+            totals.fragmented++;
+    }
+    free(entries);
+
+    // The directory's own chain
+    DirEntry self = {.DIR_Attr = ATTRIBUTE_DIRECTORY};
+    self.DIR_FstClusHI = (dir_cluster >> 16) & 0xFFFF;
+    self.DIR_FstClusLO = dir_cluster & 0xFFFF;
+    count_extents(&self, &extents, &clusters);
+    printf("%u files, %u fragmented, %llu extents", totals.files, totals.fragmented,
+           (unsigned long long)totals.extents_before);
+    if (totals.files > 0)
+        printf(" (%.2f per file)", (double)totals.extents_before / totals.files);
+    printf("; directory itself: %u extent%s\n", extents, extents == 1 ? "" : "s");
+}
+
+// Copy the data clusters of from into to, both lists in chain order, a
+// buffer's worth at a time
+static int copy_runs(const Extent *from, uint32_t from_count, const Extent *to, uint32_t to_count)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t chunk_clusters = DISK_COPY_CHUNK / bytes_per_cluster;
+    if (chunk_clusters == 0)
+        chunk_clusters = 1;
+
+    uint8_t *buffer = malloc((size_t)chunk_clusters * bytes_per_cluster);
+    if (!buffer)
+        return -1;
+
+    uint32_t f = 0, t = 0;
+    uint32_t f_done = 0, t_done = 0; // clusters used of the current runs
+    int result = 0;
+    while (f < from_count && t < to_count)
+    {
+        uint32_t piece = from[f].clusterCount - f_done;
+        if (piece > to[t].clusterCount - t_done)
+            piece = to[t].clusterCount - t_done;
+        if (piece > chunk_clusters)
+            piece = chunk_clusters;
+
+        uint32_t sectors = piece * bs.sectorsPerCluster;
+        if (read_disk_sectors(get_first_sector_of_cluster(from[f].startCluster + f_done), sectors, buffer) != 1 ||
+            write_disk_sectors(get_first_sector_of_cluster(to[t].startCluster + t_done), sectors, buffer) != 1)
+        {
+            result = -1;
+            break;
+        }
+
+        f_done += piece;
+        t_done += piece;
+        if (f_done == from[f].clusterCount)
+        {
+            f++;
+            f_done = 0;
+        }
+        if (t_done == to[t].clusterCount)
+        {
+            t++;
+            t_done = 0;
+        }
+    }
+
+    free(buffer);
+    return result;
+}
+
+// Move one file's data into as few runs as the free space allows. The entry
+// at sector/slot must be the live entry for the file.
+static int defrag_entry(const DirEntry *entry, uint32_t sector, uint32_t slot, uint32_t *before, uint32_t *after)
+{
+    uint32_t first = entry_cluster(entry);
+    uint32_t wanted = data_clusters(entry);
+    *before = *after = 0;
+    if (first < 2 || wanted == 0)
+        return DEFRAG_CONTIGUOUS;
+
+    Extent *old_runs;
+    uint32_t old_count;
+    if (fat_build_extents(first, wanted, &old_runs, &old_count) != 0)
+        return DEFRAG_FAILED;
+    *before = *after = old_count;
+    if (old_count <= 1)
+    {
+        free(old_runs);
+        return DEFRAG_CONTIGUOUS;
+    }
+
+    uint32_t clusters = 0;
+    for (uint32_t i = 0; i < old_count; i++)
+        clusters += old_runs[i].clusterCount;
+
+    // The old chain stays allocated, so the new runs never overlap it
+    Extent *new_runs;
+    uint32_t new_count;
+    fat_begin();
+    if (fat_alloc_chain(clusters, &new_runs, &new_count) != 0)
+    {
+        fat_abort();
+        free(old_runs);
+        return DEFRAG_NO_SPACE;
+    }
+    if (new_count >= old_count)
+    {
+        fat_abort();
+        free(old_runs);
+        free(new_runs);
+        return DEFRAG_NO_SPACE;
+    }
+
+    // Data first; none of it is reachable until the entry is switched
+    if (journal_barrier() != 0 || copy_runs(old_runs, old_count, new_runs, new_count) != 0)
+    {
+        fat_abort();
+        free(old_runs);
+        free(new_runs);
+        return DEFRAG_FAILED;
+    }
+
+    uint32_t new_first = new_runs[0].startCluster;
+    free(old_runs);
+    free(new_runs);
+
+    // Metadata: the new chain, the freed old one and the entry together. The
+    // FAT transaction stays open until the journal has committed them.
+    uint8_t buffer[SECTOR_SIZE];
+    int result = DEFRAG_FAILED;
+    fat_free_chain(first);
+    journal_begin();
+    if (read_disk_sector(sector, buffer) == 1 && fat_flush() == 0)
+    {
+        DirEntry *dir = &((DirEntry *)buffer)[slot];
+        dir->DIR_FstClusHI = (new_first >> 16) & 0xFFFF;
+        dir->DIR_FstClusLO = new_first & 0xFFFF;
+        if (write_disk_sector(sector, buffer) == 1)
+            result = DEFRAG_MOVED;
+    }
+    if (journal_end() != 0 && result == DEFRAG_MOVED)
+    {
+        // Point the entry back at the old chain; the overlay takes the write
+        DirEntry *dir = &((DirEntry *)buffer)[slot];
+        dir->DIR_FstClusHI = (first >> 16) & 0xFFFF;
+        dir->DIR_FstClusLO = first & 0xFFFF;
+        write_disk_sector(sector, buffer);
+        result = DEFRAG_FAILED;
+    }
+    if (result != DEFRAG_MOVED)
+    {
+        fat_abort();
+        return result;
+    }
+    fat_commit();
+    *after = new_count;
+    return result;
+}
+
+static void defrag_named(const DirEntry *entry, uint32_t dir_cluster, DefragTotals *totals)
+{
+    uint32_t sector, slot, before, after;
+    DirEntry live;
+
+    totals->files++;
+    if (!find_deleted_file_entry(entry->DIR_Name, dir_cluster, &live, &sector, &slot, 0))
+    {
+        totals->failed++;
+        return;
+    }
+
+    int result = defrag_entry(&live, sector, slot, &before, &after);
+    totals->extents_before += before;
+    totals->extents_after += after;
+    if (before > 1)
+        totals->fragmented++;
+    if (result == DEFRAG_MOVED)
+        totals->moved++;
+    else if (result == DEFRAG_NO_SPACE)
+        totals->no_space++;
+    else if (result == DEFRAG_FAILED)
+        totals->failed++;
+}
+
+static int defrag_tree(uint32_t dir_cluster, int depth, DefragTotals *totals)
+{
+    if (depth >= MAX_PATH_DEPTH)
+        return -1;
+
+    DirEntry *entries;
+    uint32_t count;
+    if (dir_read_entries(dir_cluster, &entries, &count) != 0)
+        return -1;
+
+    int result = 0;
+    for (uint32_t i = 0; i < count && result == 0; i++)
+    {
+        if (!(entries[i].DIR_Attr & ATTRIBUTE_DIRECTORY))
+        {
+            defrag_named(&entries[i], dir_cluster, totals);
+            continue;
+        }
+        uint32_t child = entry_cluster(&entries[i]);
+        if (child >= 2 && child != dir_cluster)
+            result = defrag_tree(child, depth + 1, totals);
+    }
+    free(entries);
+    return result;
+}
+
+// defrag FILE | defrag -all
+void cmd_defrag(const char *target)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+
+    DefragTotals totals = {0};
+    if (strcmp(target, "-all") == 0)
+    {
+        if (defrag_tree(bs.rootCluster, 0, &totals) != 0)
+            print_error("Could not read directory\n");
+        printf("Defragmented %u of %u fragmented files (%llu extents, now %llu)\n", totals.moved, totals.fragmented,
+               (unsigned long long)totals.extents_before, (unsigned long long)totals.extents_after);
+        if (totals.no_space > 0)
+            printf("%u files left as they were: not enough contiguous free space\n", totals.no_space);
+        if (totals.failed > 0)
+            print_error("Could not move %u files\n", totals.failed);
+        return;
+    }
+
+    DirEntry entry;
+    uint32_t dir_cluster;
+    if (!path_find_entry(target, &entry, &dir_cluster))
+    {
+        print_error("File not found\n");
+        return;
+    }
+    if (entry.DIR_Attr & ATTRIBUTE_DIRECTORY)
+    {
+        print_error("Cannot defragment a directory\n");
+        return;
+    }
+
+    defrag_named(&entry, dir_cluster, &totals);
+    if (totals.failed > 0)
+        print_error("Could not move the file\n");
+    else if (totals.moved > 0)
+        printf("Defragmented: %llu extents, now %llu\n", (unsigned long long)totals.extents_before,
+               (unsigned long long)totals.extents_after);
+    else if (totals.no_space > 0)
+        printf("Not enough contiguous free space; left at %llu extents\n",
+               (unsigned long long)totals.extents_before);
+    else
+        printf("Already contiguous\n");
+}
@@ -0,0 +1,617 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Hash index of directory entries, one per recently used directory. Each
+// index maps the raw 11-byte name of an entry to the sector and slot that
+// holds it; deleted entries are indexed under their 0xE5-prefixed name. An
+// index is built by one scan of the directory chain the first time it is
+// needed and is updated or dropped by the commands that edit the directory.
+// Entries with a long name are also found by it, case folded, through a
+// second table that maps the folded long name to the 8.3 name; the parts of
+// the long name are put together once, while the index is built.
+// Concurrent readers build and consult indexes under the state's mutex; the
+// confirming read of the directory sector happens outside it. Every edit
+// bumps a generation so image-wide data built from the directories can tell
+// it is stale.
+typedef struct
+{
+    char name[11];
+    uint8_t used;
+    uint8_t hasLong; // longHash names its slot in the long-name table
+    uint32_t longHash;
+    uint32_t sector;
+    uint32_t slot;
+} IndexSlot;
+
+typedef struct
+{
+    char *folded; // NULL if unused
+    uint32_t hash;
+    char name[11]; // the 8.3 entry it belongs to
+} LongSlot;
+
+typedef struct
+{
+    uint32_t cluster; // first cluster of the directory, 0 if unused
+    uint32_t capacity; // power of two
+    uint32_t count;
+    IndexSlot *slots;
+    uint32_t longCapacity; // power of two, 0 until a long name is added
+    uint32_t longCount;
+    LongSlot *longSlots;
+    uint64_t lastUsed;
+} DirIndex;
+
+struct DirIndexState
+{
+    DirIndex dir_indexes[DIR_INDEX_SLOTS];
+    uint64_t dir_index_clock;
+    uint32_t generation;
+    pthread_mutex_t lock;
+};
+
+#define DIRS (mfs_current->dirs)
+
+DirIndexState *dir_index_state_new(void)
+{
+    DirIndexState *state = calloc(1, sizeof(DirIndexState));
+    if (state)
+        pthread_mutex_init(&state->lock, NULL);
+    return state;
+}
+
+static uint32_t hash_name(const char *name)
+{
+    // FNV-1a over the 11 name bytes
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_long(const char *folded)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *p = folded; *p; p++)
+    {
+        hash ^= (uint8_t)*p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void release_index(DirIndex *index)
+{
+    for (uint32_t i = 0; i < index->longCapacity; i++)
+        free(index->longSlots[i].folded);
+    free(index->longSlots);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+static IndexSlot *find_slot(DirIndex *index, const char *name)
+{
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_name(name) & mask;
+
+    while (index->slots[i].used)
+    {
+        if (memcmp(index->slots[i].name, name, 11) == 0)
+            return &index->slots[i];
+        i = (i + 1) & mask;
+    }
+    return &index->slots[i]; // empty slot where the name would go
+}
+
+static int grow_index(DirIndex *index)
+{
+    uint32_t old_capacity = index->capacity;
+    IndexSlot *old_slots = index->slots;
+
+    index->capacity = old_capacity ? old_capacity * 2 : 64;
+    index->slots = calloc(index->capacity, sizeof(IndexSlot));
+    if (!index->slots)
+    {
+        index->slots = old_slots;
+        index->capacity = old_capacity;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].used)
+            *find_slot(index, old_slots[i].name) = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+// Insert a name; an existing entry earlier in the directory wins, which
+// matters only for deleted entries that share a name
+static int insert_name(DirIndex *index, const char *name, uint32_t sector, uint32_t slot)
+{
+    if ((index->count + 1) * 2 > index->capacity && grow_index(index) != 0)
+        return -1;
+
+    IndexSlot *entry = find_slot(index, name);
+    if (entry->used)
+    {
+        if (entry->sector < sector || (entry->sector == sector && entry->slot < slot))
+            return 0;
+    }
+    else
+    {
+        index->count++;
+    }
+
+    memcpy(entry->name, name, 11);
+    entry->used = 1;
+    entry->hasLong = 0;
+    entry->sector = sector;
+    entry->slot = slot;
+    return 0;
+}
+
+static LongSlot *find_long(DirIndex *index, const char *folded, uint32_t hash)
+{
+    uint32_t mask = index->longCapacity - 1;
+    uint32_t i = hash & mask;
+
+    while (index->longSlots[i].folded)
+    {
+        if (index->longSlots[i].hash == hash && strcmp(index->longSlots[i].folded, folded) == 0)
+            return &index->longSlots[i];
+        i = (i + 1) & mask;
+    }
+    return &index->longSlots[i];
+}
+
+static int grow_long(DirIndex *index)
+{
+    uint32_t old_capacity = index->longCapacity;
+    LongSlot *old_slots = index->longSlots;
+
+    index->longCapacity = old_capacity ? old_capacity * 2 : 32;
+    index->longSlots = calloc(index->longCapacity, sizeof(LongSlot));
+    if (!index->longSlots)
+    {
+        index->longSlots = old_slots;
+        index->longCapacity = old_capacity;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].folded)
+            *find_long(index, old_slots[i].folded, old_slots[i].hash) = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+// Add the long name of the 8.3 entry already indexed under name
+static int insert_long(DirIndex *index, const char *long_name, const char *name)
+{
+    if ((index->longCount + 1) * 2 > index->longCapacity && grow_long(index) != 0)
+        return -1;
+
+    char folded[LFN_NAME_BYTES];
+    lfn_fold(long_name, folded, sizeof(folded));
+    uint32_t hash = hash_long(folded);
+    LongSlot *entry = find_long(index, folded, hash);
+    if (entry->folded)
+        return 0; // the earlier entry keeps it
+
+    entry->folded = strdup(folded);
+    if (!entry->folded)
+        return -1;
+    entry->hash = hash;
+    memcpy(entry->name, name, 11);
+    index->longCount++;
+
+    IndexSlot *owner = find_slot(index, name);
+    if (owner->used)
+    {
+        owner->hasLong = 1;
+        owner->longHash = hash;
+    }
+    return 0;
+}
+
+// Drop the long name that belongs to the 8.3 entry name
+static void remove_long(DirIndex *index, uint32_t hash, const char *name)
+{
+    uint32_t mask = index->longCapacity - 1;
+    uint32_t hole = hash & mask;
+
+    while (index->longSlots[hole].folded &&
+           (index->longSlots[hole].hash != hash || memcmp(index->longSlots[hole].name, name, 11) != 0))
+        hole = (hole + 1) & mask;
+    if (!index->longSlots[hole].folded)
+        return;
+
+    free(index->longSlots[hole].folded);
+    index->longSlots[hole].folded = NULL;
+    index->longCount--;
+
+    for (uint32_t i = (hole + 1) & mask; index->longSlots[i].folded; i = (i + 1) & mask)
+    {
+        uint32_t home = index->longSlots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            index->longSlots[hole] = index->longSlots[i];
+            index->longSlots[i].folded = NULL;
+            hole = i;
+        }
+    }
+}
+
+static void remove_name(DirIndex *index, const char *name)
+{
+    IndexSlot *entry = find_slot(index, name);
+    if (!entry->used)
+        return;
+    if (entry->hasLong && index->longCapacity)
+        remove_long(index, entry->longHash, name);
+
+    // Backward-shift deletion keeps linear probing chains intact
+    uint32_t mask = index->capacity - 1;
+    uint32_t hole = entry - index->slots;
+    uint32_t i = (hole + 1) & mask;
+
+    entry->used = 0;
+    index->count--;
+
+    while (index->slots[i].used)
+    {
+        uint32_t home = hash_name(index->slots[i].name) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            index->slots[hole] = index->slots[i];
+            index->slots[i].used = 0;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int build_index(DirIndex *index, uint32_t dir_cluster)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint8_t *scratch = malloc(bytes_per_cluster);
+
+    release_index(index);
+    if (!scratch || grow_index(index) != 0)
+    {
+        free(scratch);
+        release_index(index);
+        return -1;
+    }
+    index->cluster = dir_cluster;
+
+    LfnBuilder lfn;
+    lfn_reset(&lfn);
+    uint32_t cluster = dir_cluster;
+    uint32_t walked = 0;
+    while (cluster >= 2 && cluster < EOC && walked++ < fat_cluster_limit())
+    {
+        uint32_t sector = get_first_sector_of_cluster(cluster);
+        const uint8_t *data = disk_view_sectors(sector, bs.sectorsPerCluster, scratch);
+        if (!data)
+            break;
+
+        const DirEntry *dir = (const DirEntry *)data;
+        for (uint32_t i = 0; i < bytes_per_cluster / sizeof(DirEntry); i++)
+        {
+            STATS_ADD(dirEntriesScanned, 1);
+            if (dir[i].DIR_Name[0] == 0x00)
+            {
+                free(scratch);
+                return 0; // End of directory
+            }
+            if (dir[i].DIR_Attr == ATTRIBUTE_LONG_NAME)
+            {
+                lfn_feed(&lfn, &dir[i]);
+                continue;
+            }
+
+            char long_name[LFN_NAME_BYTES];
+            int has_long = lfn_take(&lfn, &dir[i], long_name, sizeof(long_name));
+            if (insert_name(index, dir[i].DIR_Name, sector + i / entries_per_sector, i % entries_per_sector) != 0 ||
+                (has_long && insert_long(index, long_name, dir[i].DIR_Name) != 0))
+            {
+                free(scratch);
+                release_index(index);
+                return -1;
+            }
+        }
+
+        cluster = get_fat_entry(cluster);
+    }
+
+    free(scratch);
+    return 0;
+}
+
+static DirIndex *cached_index(uint32_t dir_cluster)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        if (DIRS->dir_indexes[i].slots && DIRS->dir_indexes[i].cluster == dir_cluster)
+            return &DIRS->dir_indexes[i];
+    }
+    return NULL;
+}
+
+static DirIndex *get_index(uint32_t dir_cluster)
+{
+    DirIndex *index = cached_index(dir_cluster);
+
+    if (!index)
+    {
+        // Replace the least recently used index
+        index = &DIRS->dir_indexes[0];
+        for (int i = 1; i < DIR_INDEX_SLOTS; i++)
+        {
+            if (DIRS->dir_indexes[i].lastUsed < index->lastUsed)
+                index = &DIRS->dir_indexes[i];
+        }
+        if (build_index(index, dir_cluster) != 0)
+            return NULL;
+    }
+
+    index->lastUsed = ++DIRS->dir_index_clock;
+    return index;
+}
+
+int dir_index_lookup(uint32_t dir_cluster, const char *name, DirEntry *entry, uint32_t *sector, uint32_t *slot)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        pthread_mutex_lock(&DIRS->lock);
+        DirIndex *index = get_index(dir_cluster);
+        IndexSlot found = {{0}};
+        if (index)
+            found = *find_slot(index, name);
+        pthread_mutex_unlock(&DIRS->lock);
+
+        if (!index)
+            return -1;
+        if (!found.used)
+            return 0;
+
+        // Confirm against the directory itself in case it changed under us
+        uint8_t buffer[SECTOR_SIZE];
+        const uint8_t *data = disk_view_sectors(found.sector, 1, buffer);
+        if (data)
+        {
+            const DirEntry *dir = (const DirEntry *)data + found.slot;
+            if (memcmp(dir->DIR_Name, name, 11) == 0)
+            {
+                memcpy(entry, dir, sizeof(DirEntry));
+                if (sector)
+                    *sector = found.sector;
+                if (slot)
+                    *slot = found.slot;
+                return 1;
+            }
+        }
+
+        dir_index_invalidate(dir_cluster);
+    }
+    return 0;
+}
+
+// Find an entry by its long name, through the 8.3 name it maps to
+int dir_index_lookup_long(uint32_t dir_cluster, const char *long_name, DirEntry *entry, uint32_t *sector,
+                          uint32_t *slot)
+{
+    char folded[LFN_NAME_BYTES];
+    lfn_fold(long_name, folded, sizeof(folded));
+    uint32_t hash = hash_long(folded);
+
+    char name[11];
+    int found = 0;
+    pthread_mutex_lock(&DIRS->lock);
+    DirIndex *index = get_index(dir_cluster);
+    if (index && index->longCount > 0)
+    {
+        LongSlot *match = find_long(index, folded, hash);
+        if (match->folded)
+        {
+            memcpy(name, match->name, 11);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&DIRS->lock);
+
+    if (!index)
+        return -1;
+    if (!found)
+        return 0;
+    return dir_index_lookup(dir_cluster, name, entry, sector, slot);
+}
+
+void dir_index_add(uint32_t dir_cluster, const char *name, uint32_t sector, uint32_t slot)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    DirIndex *index = cached_index(dir_cluster);
+    if (index && insert_name(index, name, sector, slot) != 0)
+        release_index(index);
+    DIRS->generation++;
+    pthread_mutex_unlock(&DIRS->lock);
+}
+
+void dir_index_add_long(uint32_t dir_cluster, const char *long_name, const char *name, uint32_t sector,
+                        uint32_t slot)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    DirIndex *index = cached_index(dir_cluster);
+    if (index && (insert_name(index, name, sector, slot) != 0 || insert_long(index, long_name, name) != 0))
+        release_index(index);
+    DIRS->generation++;
+    pthread_mutex_unlock(&DIRS->lock);
+}
+
+void dir_index_remove(uint32_t dir_cluster, const char *name)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    DirIndex *index = cached_index(dir_cluster);
+    if (index)
+        remove_name(index, name);
+    DIRS->generation++;
+    pthread_mutex_unlock(&DIRS->lock);
+}
+
+void dir_index_invalidate(uint32_t dir_cluster)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    DirIndex *index = cached_index(dir_cluster);
+    if (index)
+        release_index(index);
+    DIRS->generation++;
+    pthread_mutex_unlock(&DIRS->lock);
+}
+
+void dir_index_clear(void)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+        release_index(&DIRS->dir_indexes[i]);
+    DIRS->generation++;
+    pthread_mutex_unlock(&DIRS->lock);
+}
+
+uint32_t dir_index_generation(void)
+{
+    pthread_mutex_lock(&DIRS->lock);
+    uint32_t generation = DIRS->generation;
+    pthread_mutex_unlock(&DIRS->lock);
+    return generation;
+}
+
+// Read the live entries of a directory, and if names is set the name to show
+// for each
+static int read_entries(uint32_t dir_cluster, DirEntry **entries, char ***names, uint32_t *count)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t capacity = 64;
+    uint32_t found = 0;
+    DirEntry *list = malloc(capacity * sizeof(DirEntry));
+    char **shown = names ? malloc(capacity * sizeof(char *)) : NULL;
+    uint8_t *scratch = malloc(bytes_per_cluster);
+    int result = 0;
+
+    if (!list || !scratch || (names && !shown))
+    {
+        free(list);
+        free(shown);
+        free(scratch);
+        return -1;
+    }
+
+    LfnBuilder lfn;
+    lfn_reset(&lfn);
+    uint32_t cluster = dir_cluster;
+    uint32_t walked = 0;
+    int done = 0;
+    while (!done && result == 0 && cluster >= 2 && cluster < EOC && walked++ < fat_cluster_limit())
+    {
+        const uint8_t *data = disk_view_sectors(get_first_sector_of_cluster(cluster), bs.sectorsPerCluster, scratch);
+        if (!data)
+            break;
+
+        const DirEntry *dir = (const DirEntry *)data;
+        for (uint32_t i = 0; i < bytes_per_cluster / sizeof(DirEntry); i++)
+        {
+            STATS_ADD(dirEntriesScanned, 1);
+            uint8_t first = (uint8_t)dir[i].DIR_Name[0];
+            if (first == 0x00)
+            {
+                done = 1;
+                break;
+            }
+            if (dir[i].DIR_Attr == ATTRIBUTE_LONG_NAME)
+            {
+                if (names)
+                    lfn_feed(&lfn, &dir[i]);
+                continue;
+            }
+
+            char long_name[LFN_NAME_BYTES];
+            int has_long = names && lfn_take(&lfn, &dir[i], long_name, sizeof(long_name));
+            if (first == 0xE5 || first == '.' || (dir[i].DIR_Attr & ATTRIBUTE_VOLUME_ID))
+                continue;
+
+            if (found == capacity)
+            {
+                capacity *= 2;
+                DirEntry *grown = realloc(list, capacity * sizeof(DirEntry));
+                if (!grown)
+                {
+                    result = -1;
+                    break;
+                }
+                list = grown;
+                if (names)
+                {
+                    char **grown_names = realloc(shown, capacity * sizeof(char *));
+                    if (!grown_names)
+                    {
+                        result = -1;
+                        break;
+                    }
+                    shown = grown_names;
+                }
+            }
+            if (names)
+            {
+                if (!has_long)
+                    path_display_name(dir[i].DIR_Name, long_name);
+                shown[found] = strdup(long_name);
+                if (!shown[found])
+                {
+                    result = -1;
+                    break;
+                }
+            }
+            list[found++] = dir[i];
+        }
+
+        cluster = get_fat_entry(cluster);
+    }
+    free(scratch);
+
+    if (result != 0)
+    {
+        dir_free_names(list, shown, found);
+        return -1;
+    }
+    *entries = list;
+    if (names)
+        *names = shown;
+    *count = found;
+    return 0;
+}
+
+int dir_read_entries(uint32_t dir_cluster, DirEntry **entries, uint32_t *count)
+{
+    return read_entries(dir_cluster, entries, NULL, count);
+}
+
+int dir_read_names(uint32_t dir_cluster, DirEntry **entries, char ***names, uint32_t *count)
+{
+    return read_entries(dir_cluster, entries, names, count);
+}
+
+void dir_free_names(DirEntry *entries, char **names, uint32_t count)
+{
+    for (uint32_t i = 0; names && i < count; i++)
+        free(names[i]);
+    free(names);
+    free(entries);
+}
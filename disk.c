@@ -0,0 +1,309 @@
+#define _GNU_SOURCE // copy_file_range
+
+#include "mfs.h"
+#include "struct.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Sector I/O for the open image. Two backends are available:
+//   IO_BACKEND_MMAP  - the image is mapped shared; reads and writes are plain
+//                      memory copies and callers can get direct pointers.
+//   IO_BACKEND_PREAD - positional pread/pwrite on the image descriptor.
+// The backend is chosen when the image is opened; mmap falls back to pread if
+// the image cannot be mapped. The pread backend is fronted by the sector
+// cache in cache.c; the mapping needs no cache of its own. Neither keeps a
+// file position, so any number of threads can read through them at once.
+struct DiskState
+{
+    int preferred_backend;
+    int active_backend;
+    uint8_t *disk_map;
+    size_t disk_map_size;
+};
+
+#define DISK (mfs_current->disk)
+
+DiskState *disk_state_new(void)
+{
+    DiskState *state = calloc(1, sizeof(DiskState));
+    if (state)
+    {
+        state->preferred_backend = IO_BACKEND_MMAP;
+        state->active_backend = IO_BACKEND_PREAD;
+    }
+    return state;
+}
+
+void disk_set_backend(int backend)
+{
+    DISK->preferred_backend = backend;
+}
+
+int disk_backend(void)
+{
+    return DISK->active_backend;
+}
+
+int disk_attach(void)
+{
+    DISK->active_backend = IO_BACKEND_PREAD;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (DISK->preferred_backend == IO_BACKEND_MMAP && fstat(disk_fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+
+    if (map == MAP_FAILED)
+        return cache_init();
+
+    DISK->disk_map = map;
+    DISK->disk_map_size = st.st_size;
+    DISK->active_backend = IO_BACKEND_MMAP;
+    return 0;
+}
+
+void disk_detach(void)
+{
+    cache_flush();
+    cache_release();
+
+    if (DISK->disk_map)
+    {
+        msync(DISK->disk_map, DISK->disk_map_size, MS_SYNC);
+        munmap(DISK->disk_map, DISK->disk_map_size);
+    }
+    DISK->disk_map = NULL;
+    DISK->disk_map_size = 0;
+    DISK->active_backend = IO_BACKEND_PREAD;
+}
+
+int disk_flush(void)
+{
+    if (disk_fd < 0)
+        return -1;
+
+    if (DISK->disk_map)
+        return msync(DISK->disk_map, DISK->disk_map_size, MS_SYNC);
+
+    return cache_flush();
+}
+
+// pread or pwrite the whole range, resuming after short transfers
+static int transfer_all(int writing, uint8_t *data, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = writing ? pwrite(disk_fd, data, length, offset) : pread(disk_fd, data, length, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Byte range of count sectors starting at sector, or 0 if it is off the map
+static int map_range(uint32_t sector, uint32_t count, size_t *offset, size_t *length)
+{
+    *offset = (size_t)sector * bs.bytesPerSector;
+    *length = (size_t)count * bs.bytesPerSector;
+    return *offset <= DISK->disk_map_size && *length <= DISK->disk_map_size - *offset;
+}
+
+const uint8_t *disk_view_sectors(uint32_t sector, uint32_t count, void *scratch)
+{
+    if (disk_fd < 0)
+        return NULL;
+
+    if (DISK->disk_map)
+    {
+        size_t offset, length;
+        if (!map_range(sector, count, &offset, &length))
+            return NULL;
+        stats_count_io(offset, length, 0);
+        if (!journal_covers(sector, count))
+            return DISK->disk_map + offset;
+
+        // Journalled sectors that are not yet checkpointed have to be patched in
+        memcpy(scratch, DISK->disk_map + offset, length);
+        journal_overlay(sector, count, scratch);
+        return scratch;
+    }
+
+    if (read_disk_sectors(sector, count, scratch) != 1)
+        return NULL;
+    return scratch;
+}
+
+// Implementation of read_disk_sector
+int read_disk_sector(uint32_t sector, void *buffer)
+{
+    return read_disk_sectors(sector, 1, buffer);
+}
+
+// Implementation of write_disk_sector
+int write_disk_sector(uint32_t sector, const void *buffer)
+{
+    return write_disk_sectors(sector, 1, buffer);
+}
+
+// Read count consecutive sectors, through the cache when it is enabled.
+// Requests larger than CACHE_MAX_RUN sectors are served but not cached.
+int read_disk_sectors(uint32_t sector, uint32_t count, void *buffer)
+{
+    if (disk_fd < 0)
+        return -1;
+
+    int result;
+    if (cache_enabled())
+        result = cache_read(sector, count, buffer, count <= CACHE_MAX_RUN);
+    else
+        result = disk_raw_read(sector, count, buffer);
+
+    if (result == 1)
+        journal_overlay(sector, count, buffer);
+    return result;
+}
+
+// Write count consecutive sectors, through the cache when it is enabled.
+// Metadata written while the journal is capturing goes to the journal instead.
+int write_disk_sectors(uint32_t sector, uint32_t count, const void *buffer)
+{
+    if (disk_fd < 0)
+        return -1;
+
+    if (journal_capturing(sector, count))
+        return journal_log(sector, count, buffer);
+
+    if (cache_enabled())
+        return cache_write(sector, count, buffer, count <= CACHE_MAX_RUN);
+
+    return disk_raw_write(sector, count, buffer);
+}
+
+// Backend read of count consecutive sectors in one request
+int disk_raw_read(uint32_t sector, uint32_t count, void *buffer)
+{
+    stats_count_io((uint64_t)sector * bs.bytesPerSector, (uint64_t)count * bs.bytesPerSector, 0);
+
+    if (DISK->disk_map)
+    {
+        size_t offset, length;
+        if (!map_range(sector, count, &offset, &length))
+            return 0;
+        memcpy(buffer, DISK->disk_map + offset, length);
+        return 1;
+    }
+
+    return transfer_all(0, buffer, (size_t)count * bs.bytesPerSector, (off_t)sector * bs.bytesPerSector) == 0;
+}
+
+// Backend write of count consecutive sectors in one request
+int disk_raw_write(uint32_t sector, uint32_t count, const void *buffer)
+{
+    stats_count_io((uint64_t)sector * bs.bytesPerSector, (uint64_t)count * bs.bytesPerSector, 1);
+
+    if (DISK->disk_map)
+    {
+        size_t offset, length;
+        if (!map_range(sector, count, &offset, &length))
+            return 0;
+        memcpy(DISK->disk_map + offset, buffer, length);
+        return 1;
+    }
+
+    return transfer_all(1, (void *)buffer, (size_t)count * bs.bytesPerSector, (off_t)sector * bs.bytesPerSector) == 0;
+}
+
+// Push all cached writes down to the image file so that descriptor-level
+// I/O on it sees current data. Unlike disk_flush() this does not fsync.
+int disk_prepare_fd_io(void)
+{
+    if (disk_fd < 0)
+        return -1;
+    if (DISK->disk_map)
+        return 0;
+
+    return cache_flush();
+}
+
+// Write the whole buffer to a descriptor, resuming after short writes
+int write_all(int fd, const void *buffer, size_t length)
+{
+    const uint8_t *data = buffer;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Copy length bytes starting at sector straight to out_fd. The mapping is
+// written out directly; otherwise copy_file_range moves the data in the
+// kernel, with a large pread/write loop as the fallback.
+int disk_copy_to_fd(uint32_t sector, uint64_t length, int out_fd)
+{
+    if (disk_fd < 0)
+        return -1;
+
+    off_t offset = (off_t)sector * bs.bytesPerSector;
+    stats_count_io(offset, length, 0);
+
+    if (DISK->disk_map)
+    {
+        if ((uint64_t)offset > DISK->disk_map_size || length > DISK->disk_map_size - offset)
+            return -1;
+        return write_all(out_fd, DISK->disk_map + offset, length);
+    }
+
+    int in_fd = disk_fd;
+    while (length > 0)
+    {
+        ssize_t n = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        length -= n;
+    }
+    if (length == 0)
+        return 0;
+
+    size_t chunk = length < DISK_COPY_CHUNK ? length : DISK_COPY_CHUNK;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer)
+        return -1;
+
+    int result = 0;
+    while (length > 0)
+    {
+        size_t want = length < chunk ? length : chunk;
+        ssize_t n = pread(in_fd, buffer, want, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || write_all(out_fd, buffer, n) != 0)
+        {
+            result = -1;
+            break;
+        }
+        offset += n;
+        length -= n;
+    }
+
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,180 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Per-file extent maps for random access. A map lists the runs of a chain in
+// logical order together with the logical cluster each run starts at, so a
+// seek is a binary search instead of a walk down the FAT. A handful of maps
+// are kept, keyed by first cluster, and rebuilt when the FAT has changed
+// since they were made.
+//
+// A map handed out by extent_map_get() stays valid until extent_map_put(),
+// even with other threads reading: a slot in use is never rebuilt or
+// evicted, and when every slot is in use the caller gets a private map that
+// is freed on release.
+struct ExtentMap
+{
+    uint32_t firstCluster;
+    uint32_t generation;
+    uint32_t extentCount;
+    Extent *extents;
+    uint32_t *logicalStart;
+    uint64_t lastUsed;
+    uint32_t users;
+    int cached; // one of the slots rather than a private map
+};
+
+struct ExtentState
+{
+    ExtentMap extent_maps[EXTENT_CACHE_SLOTS];
+    uint64_t extent_clock;
+    pthread_mutex_t lock;
+};
+
+#define EXTENTS (mfs_current->extents)
+
+ExtentState *extent_state_new(void)
+{
+    ExtentState *state = calloc(1, sizeof(ExtentState));
+    if (state)
+        pthread_mutex_init(&state->lock, NULL);
+    return state;
+}
+
+static void release_map(ExtentMap *map)
+{
+    free(map->extents);
+    free(map->logicalStart);
+    memset(map, 0, sizeof(*map));
+}
+
+void extent_cache_clear(void)
+{
+    pthread_mutex_lock(&EXTENTS->lock);
+    for (int i = 0; i < EXTENT_CACHE_SLOTS; i++)
+        release_map(&EXTENTS->extent_maps[i]);
+    pthread_mutex_unlock(&EXTENTS->lock);
+}
+
+static int build_map(ExtentMap *map, uint32_t first_cluster)
+{
+    Extent *extents;
+    uint32_t count;
+
+    if (fat_build_extents(first_cluster, UINT32_MAX, &extents, &count) != 0)
+        return -1;
+
+    uint32_t *starts = malloc((count + 1) * sizeof(uint32_t));
+    if (!starts)
+    {
+        free(extents);
+        return -1;
+    }
+
+    uint32_t logical = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        starts[i] = logical;
+        logical += extents[i].clusterCount;
+    }
+    starts[count] = logical;
+
+    release_map(map);
+    map->firstCluster = first_cluster;
+    map->generation = fat_generation();
+    map->extentCount = count;
+    map->extents = extents;
+    map->logicalStart = starts;
+    return 0;
+}
+
+static ExtentMap *find_map(uint32_t first_cluster)
+{
+    ExtentMap *victim = NULL;
+
+    for (int i = 0; i < EXTENT_CACHE_SLOTS; i++)
+    {
+        ExtentMap *map = &EXTENTS->extent_maps[i];
+        if (map->extents && map->firstCluster == first_cluster &&
+            (map->generation == fat_generation() || map->users == 0))
+        {
+            if (map->generation != fat_generation() && build_map(map, first_cluster) != 0)
+                return NULL;
+            return map;
+        }
+        if (map->users == 0 && (!victim || map->lastUsed < victim->lastUsed))
+            victim = map;
+    }
+
+    // Not cached: replace the least recently used slot nobody is reading
+    if (victim)
+        return build_map(victim, first_cluster) == 0 ? victim : NULL;
+
+    ExtentMap *private = calloc(1, sizeof(ExtentMap));
+    if (private && build_map(private, first_cluster) != 0)
+    {
+        free(private);
+        return NULL;
+    }
+    return private;
+}
+
+const ExtentMap *extent_map_get(uint32_t first_cluster)
+{
+    pthread_mutex_lock(&EXTENTS->lock);
+    ExtentMap *map = find_map(first_cluster);
+    if (map)
+    {
+        map->cached = map >= EXTENTS->extent_maps && map < EXTENTS->extent_maps + EXTENT_CACHE_SLOTS;
+        map->lastUsed = ++EXTENTS->extent_clock;
+        map->users++;
+    }
+    pthread_mutex_unlock(&EXTENTS->lock);
+    return map;
+}
+
+void extent_map_put(const ExtentMap *map)
+{
+    if (!map)
+        return;
+
+    ExtentMap *held = (ExtentMap *)map;
+    pthread_mutex_lock(&EXTENTS->lock);
+    held->users--;
+    int discard = !held->cached;
+    pthread_mutex_unlock(&EXTENTS->lock);
+
+    if (discard)
+    {
+        release_map(held);
+        free(held);
+    }
+}
+
+const Extent *extent_map_runs(const ExtentMap *map, uint32_t *count)
+{
+    *count = map->extentCount;
+    return map->extents;
+}
+
+uint32_t extent_map_lookup(const ExtentMap *map, uint32_t logical_cluster, uint32_t *run_left)
+{
+    if (!map || map->extentCount == 0 || logical_cluster >= map->logicalStart[map->extentCount])
+        return 0;
+
+    // Last extent whose logical start is <= the cluster we want
+    uint32_t lo = 0;
+    uint32_t hi = map->extentCount - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (map->logicalStart[mid] <= logical_cluster)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    uint32_t into = logical_cluster - map->logicalStart[lo];
+    if (run_left)
+        *run_left = map->extents[lo].clusterCount - into;
+    return map->extents[lo].startCluster + into;
+}
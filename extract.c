@@ -0,0 +1,492 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Copying files out of the image, several at a time. The caller resolves
+// the entries; each job then builds its own extent list from the in-memory
+// FAT and copies every run with positional I/O (disk_copy_to_fd), so the
+// workers share nothing but the counter that hands out jobs. A fragmented
+// file is instead read ahead run by run (readahead.c), so the reads of its
+// later runs are in flight while earlier ones are written out.
+typedef struct
+{
+    mfs_fs *fs; // the workers act on the caller's filesystem
+    ExtractJob *jobs;
+    uint32_t count;
+    uint32_t next;
+} ExtractQueue;
+
+// A chain that ends (or turns free) before the file does cannot supply all
+// of its bytes
+static int extents_cover(const Extent *extents, uint32_t extent_count, uint32_t clusters_needed)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < extent_count; i++)
+        total += extents[i].clusterCount;
+    return total >= clusters_needed;
+}
+
+static int copy_read_ahead(const Extent *extents, uint32_t extent_count, uint32_t size, int out_fd)
+{
+    ReadAhead *ra = readahead_open(extents, extent_count, 0, size);
+    if (!ra)
+        return EXTRACT_NO_MEMORY;
+
+    int status = EXTRACT_OK;
+    const uint8_t *data;
+    uint32_t length;
+    int more;
+    while ((more = readahead_next(ra, &data, &length)) == 1)
+    {
+        if (write_all(out_fd, data, length) != 0)
+        {
+            status = EXTRACT_CREATE_FAILED;
+            break;
+        }
+    }
+    if (more < 0)
+        status = EXTRACT_READ_FAILED;
+
+    readahead_close(ra);
+    return status;
+}
+
+static int extract_one(ExtractJob *job)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t clusters_needed = (uint32_t)(((uint64_t)job->size + bytes_per_cluster - 1) / bytes_per_cluster);
+
+    int out_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+        return EXTRACT_CREATE_FAILED;
+
+    Extent *extents = NULL;
+    uint32_t extent_count = 0;
+    if (fat_build_extents(job->firstCluster, clusters_needed, &extents, &extent_count) != 0)
+    {
+        close(out_fd);
+        return EXTRACT_NO_MEMORY;
+    }
+    if (!extents_cover(extents, extent_count, clusters_needed))
+    {
+        free(extents);
+        close(out_fd);
+        return EXTRACT_READ_FAILED;
+    }
+
+    int status = EXTRACT_OK;
+    uint32_t size_remaining = job->size;
+    if (extent_count > 1 && readahead_depth() > 0)
+    {
+        status = copy_read_ahead(extents, extent_count, job->size, out_fd);
+        size_remaining = 0;
+    }
+    for (uint32_t i = 0; i < extent_count && size_remaining > 0; i++)
+    {
+        uint64_t run_bytes = (uint64_t)extents[i].clusterCount * bytes_per_cluster;
+        uint32_t bytes_to_write = run_bytes < size_remaining ? run_bytes : size_remaining;
+        uint32_t sector = get_first_sector_of_cluster(extents[i].startCluster);
+
+        if (disk_copy_to_fd(sector, bytes_to_write, out_fd) != 0)
+        {
+            status = EXTRACT_READ_FAILED;
+            break;
+        }
+        size_remaining -= bytes_to_write;
+    }
+
+    free(extents);
+    if (close(out_fd) != 0 && status == EXTRACT_OK)
+        status = EXTRACT_CREATE_FAILED;
+    return status;
+}
+
+static void *extract_worker(void *arg)
+{
+    ExtractQueue *queue = arg;
+
+    mfs_current = queue->fs;
+    for (;;)
+    {
+        uint32_t i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (i >= queue->count)
+            break;
+        queue->jobs[i].status = extract_one(&queue->jobs[i]);
+    }
+    return NULL;
+}
+
+int extract_files(ExtractJob *jobs, uint32_t count, int workers)
+{
+    ExtractQueue queue = {mfs_current, jobs, count, 0};
+
+    // Descriptor-level reads must see everything written through the cache
+    if (disk_prepare_fd_io() != 0)
+        return -1;
+
+    if (workers > GET_MAX_WORKERS)
+        workers = GET_MAX_WORKERS;
+    if ((uint32_t)workers > count)
+        workers = count;
+
+    pthread_t threads[GET_MAX_WORKERS];
+    int started = 0;
+    while (started < workers - 1)
+    {
+        if (pthread_create(&threads[started], NULL, extract_worker, &queue) != 0)
+            break;
+        started++;
+    }
+
+    // The calling thread takes jobs too, and does all of them if no
+    // worker could be started
+    extract_worker(&queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    int failed = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (jobs[i].status != EXTRACT_OK)
+            failed++;
+    }
+    return failed;
+}
+
+// Tree export. tree_collect() recreates the directory tree on the host and
+// lists every file as a job; extract_pipeline() then streams them out in
+// two stages. The calling thread reads the image in cluster order, one
+// chunk per contiguous piece, into a small pool of buffers; writer threads
+// take filled chunks from a bounded queue and pwrite() them to the host
+// files. Reads of the image and writes of the host files overlap, and
+// the pool bounds how far the reader can run ahead.
+typedef struct
+{
+    ExtractJob *job;
+    int fd;
+    uint32_t pending; // chunks queued but not yet written
+    int reading;      // the reader may still queue chunks
+} TreeFile;
+
+typedef struct
+{
+    TreeFile *file;
+    off_t offset;
+    size_t length;
+    uint8_t *data;
+} TreeChunk;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    TreeChunk ready[TREE_QUEUE_DEPTH];
+    uint32_t head;
+    uint32_t count;
+    uint8_t *free_buffers[TREE_QUEUE_DEPTH];
+    uint32_t free_count;
+    int finished;
+} TreeQueue;
+
+static int tree_walk(uint32_t dir_cluster, const char *host_dir, int depth, ExtractJob **jobs, uint32_t *count, uint32_t *capacity)
+{
+    if (depth >= MAX_PATH_DEPTH)
+        return -1;
+    if (mkdir(host_dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    // Files land under their long names where they have them
+    DirEntry *entries;
+    char **names;
+    uint32_t entry_count;
+    if (dir_read_names(dir_cluster, &entries, &names, &entry_count) != 0)
+        return -1;
+
+    int result = 0;
+    for (uint32_t i = 0; i < entry_count && result == 0; i++)
+    {
+        const char *display = names[i];
+        size_t length = strlen(host_dir) + strlen(display) + 2;
+        char *path = malloc(length);
+        if (!path)
+        {
+            result = -1;
+            break;
+        }
+        snprintf(path, length, "%s/%s", host_dir, display);
+
+        uint32_t cluster = (entries[i].DIR_FstClusHI << 16) | entries[i].DIR_FstClusLO;
+        if (entries[i].DIR_Attr & ATTRIBUTE_DIRECTORY)
+        {
+            // A zero cluster would be the root; never walk back into it
+            if (cluster >= 2)
+                result = tree_walk(cluster, path, depth + 1, jobs, count, capacity);
+            free(path);
+            continue;
+        }
+
+        if (*count == *capacity)
+        {
+            uint32_t grown_capacity = *capacity ? *capacity * 2 : 64;
+            ExtractJob *grown = realloc(*jobs, grown_capacity * sizeof(ExtractJob));
+            if (!grown)
+            {
+                free(path);
+                result = -1;
+                break;
+            }
+            *jobs = grown;
+            *capacity = grown_capacity;
+        }
+
+        ExtractJob *job = &(*jobs)[(*count)++];
+        job->output = path;
+        job->firstCluster = cluster;
+        job->size = entries[i].DIR_FileSize;
+        job->status = EXTRACT_OK;
+    }
+
+    dir_free_names(entries, names, entry_count);
+    return result;
+}
+
+int tree_collect(uint32_t dir_cluster, const char *host_dir, ExtractJob **jobs, uint32_t *count)
+{
+    uint32_t capacity = 0;
+    *jobs = NULL;
+    *count = 0;
+    return tree_walk(dir_cluster, host_dir, 0, jobs, count, &capacity);
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    uint32_t ca = ((const ExtractJob *)a)->firstCluster;
+    uint32_t cb = ((const ExtractJob *)b)->firstCluster;
+    return ca < cb ? -1 : ca > cb;
+}
+
+// Called with the queue locked. Returns 1 once the reader is done with the
+// file and every chunk of it is written, at which point it can be closed.
+static int tree_file_done(TreeFile *file)
+{
+    return !file->reading && file->pending == 0;
+}
+
+static void tree_close(TreeFile *file)
+{
+    if (close(file->fd) != 0 && file->job->status == EXTRACT_OK)
+        file->job->status = EXTRACT_CREATE_FAILED;
+    free(file);
+}
+
+static void *tree_writer(void *arg)
+{
+    TreeQueue *queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while (queue->count == 0 && !queue->finished)
+            pthread_cond_wait(&queue->filled, &queue->lock);
+        if (queue->count == 0)
+            break;
+
+        TreeChunk chunk = queue->ready[queue->head];
+        queue->head = (queue->head + 1) % TREE_QUEUE_DEPTH;
+        queue->count--;
+        pthread_mutex_unlock(&queue->lock);
+
+        const uint8_t *data = chunk.data;
+        size_t left = chunk.length;
+        off_t offset = chunk.offset;
+        int failed = 0;
+        while (left > 0)
+        {
+            ssize_t n = pwrite(chunk.file->fd, data, left, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                failed = 1;
+                break;
+            }
+            data += n;
+            left -= n;
+            offset += n;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (failed)
+            chunk.file->job->status = EXTRACT_CREATE_FAILED;
+        queue->free_buffers[queue->free_count++] = chunk.data;
+        pthread_cond_signal(&queue->drained);
+
+        chunk.file->pending--;
+        if (tree_file_done(chunk.file))
+        {
+            pthread_mutex_unlock(&queue->lock);
+            tree_close(chunk.file);
+            pthread_mutex_lock(&queue->lock);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Reader stage: queue every piece of one file, waiting for a free buffer
+// whenever the writers fall behind
+static void tree_read_file(TreeQueue *queue, ExtractJob *job)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t clusters_needed = (uint32_t)(((uint64_t)job->size + bytes_per_cluster - 1) / bytes_per_cluster);
+
+    TreeFile *file = malloc(sizeof(TreeFile));
+    if (!file)
+    {
+        job->status = EXTRACT_NO_MEMORY;
+        return;
+    }
+    file->job = job;
+    file->pending = 0;
+    file->reading = 1;
+    file->fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file->fd < 0)
+    {
+        job->status = EXTRACT_CREATE_FAILED;
+        free(file);
+        return;
+    }
+
+    Extent *extents = NULL;
+    uint32_t extent_count = 0;
+    if (fat_build_extents(job->firstCluster, clusters_needed, &extents, &extent_count) != 0)
+    {
+        job->status = EXTRACT_NO_MEMORY;
+        extent_count = 0;
+    }
+    else if (!extents_cover(extents, extent_count, clusters_needed))
+    {
+        job->status = EXTRACT_READ_FAILED;
+        extent_count = 0;
+    }
+
+    uint64_t size_remaining = job->size;
+    off_t offset = 0;
+    for (uint32_t i = 0; i < extent_count && size_remaining > 0; i++)
+    {
+        uint32_t sector = get_first_sector_of_cluster(extents[i].startCluster);
+        uint64_t run_bytes = (uint64_t)extents[i].clusterCount * bytes_per_cluster;
+
+        while (run_bytes > 0 && size_remaining > 0)
+        {
+            size_t piece = run_bytes < TREE_CHUNK ? run_bytes : TREE_CHUNK;
+            size_t length = piece < size_remaining ? piece : size_remaining;
+            uint32_t sectors = (length + bs.bytesPerSector - 1) / bs.bytesPerSector;
+
+            pthread_mutex_lock(&queue->lock);
+            while (queue->free_count == 0)
+                pthread_cond_wait(&queue->drained, &queue->lock);
+            uint8_t *buffer = queue->free_buffers[--queue->free_count];
+            pthread_mutex_unlock(&queue->lock);
+
+            int ok = read_disk_sectors(sector, sectors, buffer) == 1;
+
+            pthread_mutex_lock(&queue->lock);
+            if (ok)
+            {
+                TreeChunk *chunk = &queue->ready[(queue->head + queue->count) % TREE_QUEUE_DEPTH];
+                chunk->file = file;
+                chunk->offset = offset;
+                chunk->length = length;
+                chunk->data = buffer;
+                queue->count++;
+                file->pending++;
+                pthread_cond_signal(&queue->filled);
+            }
+            else
+            {
+                job->status = EXTRACT_READ_FAILED;
+                queue->free_buffers[queue->free_count++] = buffer;
+            }
+            pthread_mutex_unlock(&queue->lock);
+            if (!ok)
+                goto done;
+
+            sector += piece / bs.bytesPerSector;
+            offset += length;
+            run_bytes -= piece;
+            size_remaining -= length;
+        }
+    }
+
+done:
+    free(extents);
+    pthread_mutex_lock(&queue->lock);
+    file->reading = 0;
+    int close_now = tree_file_done(file);
+    pthread_mutex_unlock(&queue->lock);
+    if (close_now)
+        tree_close(file);
+}
+
+int extract_pipeline(ExtractJob *jobs, uint32_t count, int writers)
+{
+    TreeQueue queue;
+    uint8_t *pool = malloc((size_t)TREE_QUEUE_DEPTH * TREE_CHUNK);
+    if (!pool)
+        return -1;
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.filled, NULL);
+    pthread_cond_init(&queue.drained, NULL);
+    for (uint32_t i = 0; i < TREE_QUEUE_DEPTH; i++)
+        queue.free_buffers[queue.free_count++] = pool + (size_t)i * TREE_CHUNK;
+
+    if (writers > GET_MAX_WORKERS)
+        writers = GET_MAX_WORKERS;
+
+    pthread_t threads[GET_MAX_WORKERS];
+    int started = 0;
+    while (started < writers)
+    {
+        if (pthread_create(&threads[started], NULL, tree_writer, &queue) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+    {
+        free(pool);
+        return -1;
+    }
+
+    // Visit files in the order their data sits in the image
+    qsort(jobs, count, sizeof(ExtractJob), compare_jobs);
+    for (uint32_t i = 0; i < count; i++)
+        tree_read_file(&queue, &jobs[i]);
+
+    pthread_mutex_lock(&queue.lock);
+    queue.finished = 1;
+    pthread_cond_broadcast(&queue.filled);
+    pthread_mutex_unlock(&queue.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.filled);
+    pthread_cond_destroy(&queue.drained);
+    free(pool);
+
+    int failed = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (jobs[i].status != EXTRACT_OK)
+            failed++;
+    }
+    return failed;
+}
@@ -0,0 +1,712 @@
+#include "mfs.h"
+#include "struct.h"
+
+#define FAT_DIRTY_ACTIVE 0x01 // not yet written to the active FAT
+#define FAT_DIRTY_MIRROR 0x02 // not yet written to the mirror FATs
+
+// Open transaction: an entry replaced while it was open
+typedef struct
+{
+    uint32_t cluster;
+    uint32_t value;
+} FatUndo;
+
+// In-memory copy of the active FAT. It is loaded once by fat_load() and all
+// lookups are served from it. Updates only touch the table and mark the
+// containing FAT sector dirty. fat_commit() writes each touched sector to the
+// active FAT once; the mirror copies are brought up to date by fat_sync().
+//
+// Free-cluster bitmap (bit set = cluster free), built from the table on load
+// and kept in step by update_fat_entry(). The FSInfo sector free count and
+// next-free hint are maintained alongside it and written back by fat_sync().
+struct FatState
+{
+    uint32_t *fat_table;
+    uint32_t fat_entry_count;
+    uint8_t *fat_dirty; // FAT_DIRTY_* flags per FAT sector
+    uint32_t fat_dirty_count;
+
+    int fat_txn_depth; // nesting depth of the open transaction
+    FatUndo *fat_undo;
+    uint32_t fat_undo_count;
+    uint32_t fat_undo_capacity;
+    int fat_txn_failed; // a change was refused for want of undo space
+    uint32_t fat_changes; // bumped on every update so derived data can tell it is stale
+
+    uint64_t *free_bitmap;
+    uint32_t cluster_limit; // one past the highest valid cluster
+    uint32_t free_count;
+    uint32_t next_free;
+    int fsinfo_dirty;
+    uint8_t *fsinfo_sector; // raw FSInfo sector, NULL if the image has none
+};
+
+#define FAT (mfs_current->fat)
+
+FatState *fat_state_new(void)
+{
+    FatState *state = calloc(1, sizeof(FatState));
+    if (state)
+        state->next_free = 2;
+    return state;
+}
+
+// Sector (relative to the start of a FAT) that holds the given cluster entry
+static uint32_t fat_sector_of(uint32_t cluster)
+{
+    return (cluster * 4) / bs.bytesPerSector;
+}
+
+// Mirroring is off when BPB_ExtFlags bit 7 is set; only the active FAT is used
+static int fat_mirroring(void)
+{
+    return !(bs.extendedFlags & 0x80) && bs.numberOfFATs > 1;
+}
+
+// Index of the FAT that is read when mirroring is disabled (BPB_ExtFlags bit 7)
+static uint32_t active_fat_index(void)
+{
+    if (bs.extendedFlags & 0x80)
+    {
+        uint32_t active = bs.extendedFlags & 0x0F;
+        if (active < bs.numberOfFATs)
+            return active;
+    }
+    return 0;
+}
+
+// Number of clusters actually backed by the data region, plus the two reserved
+static uint32_t compute_cluster_limit(void)
+{
+    uint32_t total_sectors = bs.totalSectors32 ? bs.totalSectors32 : bs.totalSectors16;
+    uint32_t first_data_sector = bs.reservedSectorCount + bs.numberOfFATs * bs.fatSize32;
+    uint32_t limit = FAT->fat_entry_count;
+
+    if (bs.sectorsPerCluster && total_sectors > first_data_sector)
+    {
+        uint32_t data_clusters = (total_sectors - first_data_sector) / bs.sectorsPerCluster;
+        if (data_clusters + 2 < limit)
+            limit = data_clusters + 2;
+    }
+    return limit;
+}
+
+static void mark_free(uint32_t cluster, int is_free)
+{
+    uint64_t bit = 1ULL << (cluster & 63);
+    int was_free = (FAT->free_bitmap[cluster >> 6] & bit) != 0;
+
+    if (is_free == was_free)
+        return;
+
+    if (is_free)
+    {
+        FAT->free_bitmap[cluster >> 6] |= bit;
+        FAT->free_count++;
+        if (cluster < FAT->next_free)
+            FAT->next_free = cluster;
+    }
+    else
+    {
+        FAT->free_bitmap[cluster >> 6] &= ~bit;
+        FAT->free_count--;
+    }
+    FAT->fsinfo_dirty = 1;
+}
+
+static int build_free_bitmap(void)
+{
+    FAT->cluster_limit = compute_cluster_limit();
+    FAT->free_bitmap = calloc((FAT->cluster_limit + 63) / 64, sizeof(uint64_t));
+    if (!FAT->free_bitmap)
+        return -1;
+
+    FAT->free_count = 0;
+    for (uint32_t c = 2; c < FAT->cluster_limit; c++)
+    {
+        if ((FAT->fat_table[c] & 0x0FFFFFFF) == 0)
+        {
+            FAT->free_bitmap[c >> 6] |= 1ULL << (c & 63);
+            FAT->free_count++;
+        }
+    }
+
+    // Start allocating where the FSInfo hint says the free space begins
+    FAT->next_free = 2;
+    FAT->fsinfo_dirty = 0;
+
+    if (bs.fsInfoSector == 0 || bs.fsInfoSector == 0xFFFF || bs.bytesPerSector < sizeof(FSInfo))
+        return 0;
+
+    FAT->fsinfo_sector = malloc(bs.bytesPerSector);
+    if (!FAT->fsinfo_sector)
+        return -1;
+
+    FSInfo *info = (FSInfo *)FAT->fsinfo_sector;
+    if (read_disk_sector(bs.fsInfoSector, FAT->fsinfo_sector) != 1 ||
+        info->leadSignature != FSINFO_LEAD_SIGNATURE ||
+        info->structSignature != FSINFO_STRUCT_SIGNATURE)
+    {
+        // Not a valid FSInfo sector; leave it alone
+        free(FAT->fsinfo_sector);
+        FAT->fsinfo_sector = NULL;
+        return 0;
+    }
+
+    if (info->nextFree >= 2 && info->nextFree < FAT->cluster_limit)
+        FAT->next_free = info->nextFree;
+
+    // The stored count is only a hint; correct it if it disagrees
+    if (info->freeCount != FAT->free_count)
+        FAT->fsinfo_dirty = 1;
+
+    return 0;
+}
+
+static int write_fsinfo(void)
+{
+    if (!FAT->fsinfo_sector || !FAT->fsinfo_dirty)
+        return 0;
+
+    FSInfo *info = (FSInfo *)FAT->fsinfo_sector;
+    info->freeCount = FAT->free_count;
+    info->nextFree = FAT->next_free;
+
+    if (write_disk_sector(bs.fsInfoSector, FAT->fsinfo_sector) != 1)
+        return -1;
+
+    FAT->fsinfo_dirty = 0;
+    return 0;
+}
+
+int fat_load(void)
+{
+    fat_unload();
+
+    if (bs.bytesPerSector == 0 || bs.fatSize32 == 0)
+        return -1;
+
+    size_t fat_bytes = (size_t)bs.fatSize32 * bs.bytesPerSector;
+    FAT->fat_table = malloc(fat_bytes);
+    FAT->fat_dirty = calloc(bs.fatSize32, 1);
+    if (!FAT->fat_table || !FAT->fat_dirty)
+    {
+        fat_unload();
+        return -1;
+    }
+
+    // One large read instead of a seek + read per lookup
+    uint32_t first_sector = bs.reservedSectorCount + active_fat_index() * bs.fatSize32;
+    if (read_disk_sectors(first_sector, bs.fatSize32, FAT->fat_table) != 1)
+    {
+        fat_unload();
+        return -1;
+    }
+
+    FAT->fat_entry_count = fat_bytes / 4;
+    FAT->fat_dirty_count = 0;
+
+    if (build_free_bitmap() != 0)
+    {
+        fat_unload();
+        return -1;
+    }
+    return 0;
+}
+
+void fat_unload(void)
+{
+    free(FAT->fat_table);
+    free(FAT->fat_dirty);
+    free(FAT->fat_undo);
+    free(FAT->free_bitmap);
+    free(FAT->fsinfo_sector);
+    FAT->fat_table = NULL;
+    FAT->fat_dirty = NULL;
+    FAT->fat_undo = NULL;
+    FAT->fat_undo_count = FAT->fat_undo_capacity = 0;
+    FAT->fat_txn_depth = 0;
+    FAT->free_bitmap = NULL;
+    FAT->fsinfo_sector = NULL;
+    FAT->fat_entry_count = 0;
+    FAT->fat_dirty_count = 0;
+    FAT->cluster_limit = 0;
+    FAT->free_count = 0;
+    FAT->fsinfo_dirty = 0;
+}
+
+// Write every FAT sector carrying flag to the given FAT copy, one write per
+// run of consecutive sectors
+static int write_dirty_sectors(uint8_t flag, uint32_t fat_index)
+{
+    int result = 0;
+    uint32_t sector = 0;
+
+    while (sector < bs.fatSize32)
+    {
+        if (!(FAT->fat_dirty[sector] & flag))
+        {
+            sector++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (sector + run < bs.fatSize32 && (FAT->fat_dirty[sector + run] & flag))
+            run++;
+
+        const uint8_t *data = (const uint8_t *)FAT->fat_table + (size_t)sector * bs.bytesPerSector;
+        uint32_t target = bs.reservedSectorCount + fat_index * bs.fatSize32 + sector;
+        if (write_disk_sectors(target, run, data) != 1)
+            result = -1;
+
+        sector += run;
+    }
+    return result;
+}
+
+static void clear_dirty(uint8_t flag)
+{
+    FAT->fat_dirty_count = 0;
+    for (uint32_t sector = 0; sector < bs.fatSize32; sector++)
+    {
+        FAT->fat_dirty[sector] &= ~flag;
+        if (FAT->fat_dirty[sector])
+            FAT->fat_dirty_count++;
+    }
+}
+
+void fat_begin(void)
+{
+    if (FAT->fat_txn_depth++ == 0)
+    {
+        FAT->fat_undo_count = 0;
+        FAT->fat_txn_failed = 0;
+    }
+}
+
+int fat_commit(void)
+{
+    if (FAT->fat_txn_depth > 0 && --FAT->fat_txn_depth > 0)
+        return 0; // an outer transaction commits for us
+
+    // A transaction missing a change cannot be committed; the caller aborts
+    if (FAT->fat_txn_failed)
+    {
+        FAT->fat_txn_depth = 1;
+        return -1;
+    }
+
+    FAT->fat_undo_count = 0;
+    if (!FAT->fat_table || FAT->fat_dirty_count == 0)
+        return 0;
+
+    // Each touched sector goes to the active FAT once; mirrors wait for sync
+    int result = write_dirty_sectors(FAT_DIRTY_ACTIVE, active_fat_index());
+    if (result == 0)
+        clear_dirty(FAT_DIRTY_ACTIVE);
+    return result;
+}
+
+// Write the open transaction's changes to the active FAT without closing
+// it, so that fat_abort() can still take them back if what follows fails
+int fat_flush(void)
+{
+    if (FAT->fat_txn_failed)
+        return -1;
+    if (!FAT->fat_table || FAT->fat_dirty_count == 0)
+        return 0;
+
+    int result = write_dirty_sectors(FAT_DIRTY_ACTIVE, active_fat_index());
+    if (result == 0)
+        clear_dirty(FAT_DIRTY_ACTIVE);
+    return result;
+}
+
+void fat_abort(void)
+{
+    if (FAT->fat_txn_depth == 0)
+        return;
+
+    // Put every replaced entry back, newest first. The sectors stay marked
+    // dirty, which is harmless: they now hold what is on disk.
+    uint32_t count = FAT->fat_undo_count;
+    FAT->fat_undo_count = 0;
+    FAT->fat_txn_depth = 0;
+    FAT->fat_txn_failed = 0;
+    while (count > 0)
+    {
+        count--;
+        update_fat_entry(FAT->fat_undo[count].cluster, FAT->fat_undo[count].value);
+    }
+}
+
+// Have the next fat_sync() rewrite every mirror from the active FAT
+void fat_mark_mirrors_stale(void)
+{
+    if (!FAT->fat_table)
+        return;
+    FAT->fat_dirty_count = bs.fatSize32;
+    for (uint32_t sector = 0; sector < bs.fatSize32; sector++)
+        FAT->fat_dirty[sector] |= FAT_DIRTY_MIRROR;
+}
+
+// Count the sectors of the mirror FATs on disk that differ from the table,
+// reading each copy in large pieces. Sectors still waiting for fat_sync()
+// are expected to differ and are not counted. Returns -1 if a copy could
+// not be read.
+int64_t fat_check_mirrors(void)
+{
+    if (!FAT->fat_table || !fat_mirroring())
+        return 0;
+
+    uint32_t chunk = DISK_COPY_CHUNK / bs.bytesPerSector;
+    uint8_t *buffer = malloc((size_t)chunk * bs.bytesPerSector);
+    if (!buffer)
+        return -1;
+
+    int64_t differing = 0;
+    for (uint32_t i = 0; i < bs.numberOfFATs && differing >= 0; i++)
+    {
+        if (i == active_fat_index())
+            continue;
+
+        for (uint32_t sector = 0; sector < bs.fatSize32; sector += chunk)
+        {
+            uint32_t count = bs.fatSize32 - sector < chunk ? bs.fatSize32 - sector : chunk;
+            if (read_disk_sectors(bs.reservedSectorCount + i * bs.fatSize32 + sector, count, buffer) != 1)
+            {
+                differing = -1;
+                break;
+            }
+
+            const uint8_t *table = (const uint8_t *)FAT->fat_table + (size_t)sector * bs.bytesPerSector;
+            for (uint32_t s = 0; s < count; s++)
+            {
+                if (!(FAT->fat_dirty[sector + s] & FAT_DIRTY_MIRROR) &&
+                    memcmp(buffer + (size_t)s * bs.bytesPerSector, table + (size_t)s * bs.bytesPerSector,
+                           bs.bytesPerSector) != 0)
+                    differing++;
+            }
+        }
+    }
+
+    free(buffer);
+    return differing;
+}
+
+int fat_sync(void)
+{
+    if (!FAT->fat_table)
+        return 0;
+
+    int result = write_fsinfo();
+
+    if (FAT->fat_dirty_count > 0)
+    {
+        if (write_dirty_sectors(FAT_DIRTY_ACTIVE, active_fat_index()) != 0)
+            result = -1;
+
+        // With mirroring disabled the other copies are left alone
+        if (fat_mirroring())
+        {
+            for (uint32_t i = 0; i < bs.numberOfFATs; i++)
+            {
+                if (i != active_fat_index() && write_dirty_sectors(FAT_DIRTY_MIRROR, i) != 0)
+                    result = -1;
+            }
+        }
+
+        if (result == 0)
+            clear_dirty(FAT_DIRTY_ACTIVE | FAT_DIRTY_MIRROR);
+    }
+
+    return result;
+}
+
+uint32_t get_fat_entry(uint32_t cluster)
+{
+    if (!FAT->fat_table || cluster >= FAT->fat_entry_count)
+        return 0x0FFFFFFF; // Treat anything outside the table as end of chain
+
+    STATS_ADD(fatLookups, 1);
+    return FAT->fat_table[cluster] & 0x0FFFFFFF;
+}
+
+// Returns -1, leaving the entry alone, if an open transaction has no room to
+// record the old value. The transaction is then failed: fat_commit() and
+// fat_flush() refuse it, and fat_abort() takes back everything it did.
+int update_fat_entry(uint32_t cluster, uint32_t value)
+{
+    if (!FAT->fat_table || cluster >= FAT->fat_entry_count)
+        return 0;
+
+    // Remember the old value so an open transaction can be rolled back
+    if (FAT->fat_txn_depth > 0)
+    {
+        if (FAT->fat_undo_count == FAT->fat_undo_capacity)
+        {
+            uint32_t capacity = FAT->fat_undo_capacity ? FAT->fat_undo_capacity * 2 : 256;
+            FatUndo *grown = realloc(FAT->fat_undo, capacity * sizeof(FatUndo));
+            if (!grown)
+            {
+                FAT->fat_txn_failed = 1;
+                return -1;
+            }
+            FAT->fat_undo = grown;
+            FAT->fat_undo_capacity = capacity;
+        }
+        FAT->fat_undo[FAT->fat_undo_count].cluster = cluster;
+        FAT->fat_undo[FAT->fat_undo_count].value = FAT->fat_table[cluster] & 0x0FFFFFFF;
+        FAT->fat_undo_count++;
+    }
+
+    // A freed cluster must not be reused before the journal has the free
+    if (value == 0 && (FAT->fat_table[cluster] & 0x0FFFFFFF) != 0)
+        journal_note_free();
+
+    // The upper four bits are reserved and must be preserved
+    FAT->fat_table[cluster] = (FAT->fat_table[cluster] & 0xF0000000) | (value & 0x0FFFFFFF);
+    FAT->fat_changes++;
+    STATS_ADD(fatUpdates, 1);
+
+    uint32_t sector = fat_sector_of(cluster);
+    if (!FAT->fat_dirty[sector])
+        FAT->fat_dirty_count++;
+    FAT->fat_dirty[sector] |= FAT_DIRTY_ACTIVE | FAT_DIRTY_MIRROR;
+
+    if (cluster >= 2 && cluster < FAT->cluster_limit)
+        mark_free(cluster, (value & 0x0FFFFFFF) == 0);
+    return 0;
+}
+
+// Find the first free cluster at or after start, or 0 if there is none
+static uint32_t find_free_from(uint32_t start, uint32_t end)
+{
+    uint32_t c = start;
+    while (c < end)
+    {
+        uint64_t word = FAT->free_bitmap[c >> 6] >> (c & 63);
+        if (word)
+        {
+            c += __builtin_ctzll(word);
+            return c < end ? c : 0;
+        }
+        c = (c | 63) + 1;
+    }
+    return 0;
+}
+
+uint32_t fat_alloc_cluster(void)
+{
+    if (!FAT->free_bitmap || FAT->free_count == 0)
+        return 0;
+
+    uint32_t cluster = find_free_from(FAT->next_free, FAT->cluster_limit);
+    if (!cluster)
+        cluster = find_free_from(2, FAT->next_free);
+    if (!cluster)
+        return 0;
+
+    // Claim it as a one-cluster chain; the caller links it in
+    if (update_fat_entry(cluster, 0x0FFFFFFF) != 0)
+        return 0;
+    FAT->next_free = cluster + 1 < FAT->cluster_limit ? cluster + 1 : 2;
+    return cluster;
+}
+
+// Number of consecutive free clusters starting at start, stopping at end
+static uint32_t free_run_length(uint32_t start, uint32_t end)
+{
+    uint32_t c = start;
+    while (c < end)
+    {
+        uint64_t used = ~FAT->free_bitmap[c >> 6] >> (c & 63);
+        if (used)
+        {
+            c += __builtin_ctzll(used);
+            break;
+        }
+        c = (c | 63) + 1;
+    }
+    return (c < end ? c : end) - start;
+}
+
+uint32_t fat_alloc_run(uint32_t want, uint32_t *got)
+{
+    *got = 0;
+    if (!FAT->free_bitmap || FAT->free_count == 0 || want == 0)
+        return 0;
+
+    // First run of at least want clusters from the hint onwards, wrapping
+    // once; failing that, the longest run seen
+    uint32_t best_start = 0;
+    uint32_t best_length = 0;
+    uint32_t ranges[2][2] = {{FAT->next_free, FAT->cluster_limit}, {2, FAT->next_free}};
+
+    for (int r = 0; r < 2 && best_length < want; r++)
+    {
+        uint32_t c = ranges[r][0];
+        uint32_t end = ranges[r][1];
+        while (c < end && best_length < want)
+        {
+            c = find_free_from(c, end);
+            if (!c)
+                break;
+
+            uint32_t length = free_run_length(c, end);
+            if (length > best_length)
+            {
+                best_start = c;
+                best_length = length;
+            }
+            c += length;
+        }
+    }
+
+    if (best_length == 0)
+        return 0;
+    if (best_length > want)
+        best_length = want;
+
+    // Claim the run as a linked chain ending in end-of-chain
+    for (uint32_t i = 0; i < best_length; i++)
+    {
+        uint32_t cluster = best_start + i;
+        if (update_fat_entry(cluster, i + 1 < best_length ? cluster + 1 : 0x0FFFFFFF) != 0)
+            return 0; // the failed transaction is aborted by the caller
+    }
+
+    uint32_t after = best_start + best_length;
+    FAT->next_free = after < FAT->cluster_limit ? after : 2;
+    *got = best_length;
+    return best_start;
+}
+
+// Allocate clusters_needed clusters as a single chain, preferring contiguous
+// runs. The runs are returned in chain order for writing.
+int fat_alloc_chain(uint32_t clusters_needed, Extent **runs, uint32_t *run_count)
+{
+    uint32_t capacity = 4;
+    uint32_t allocated = 0;
+    uint32_t count = 0;
+    Extent *list = malloc(capacity * sizeof(Extent));
+
+    if (!list)
+        return -1;
+
+    while (allocated < clusters_needed)
+    {
+        uint32_t got;
+        uint32_t start = fat_alloc_run(clusters_needed - allocated, &got);
+        if (start == 0)
+            break;
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            Extent *grown = realloc(list, capacity * sizeof(Extent));
+            if (!grown)
+            {
+                fat_free_chain(start);
+                break;
+            }
+            list = grown;
+        }
+
+        // Link the previous run's last cluster to this one
+        if (count > 0 && update_fat_entry(list[count - 1].startCluster + list[count - 1].clusterCount - 1, start) != 0)
+        {
+            fat_free_chain(start);
+            break;
+        }
+
+        list[count].startCluster = start;
+        list[count].clusterCount = got;
+        count++;
+        allocated += got;
+    }
+
+    if (allocated < clusters_needed)
+    {
+        if (count > 0)
+            fat_free_chain(list[0].startCluster);
+        free(list);
+        return -1;
+    }
+
+    *runs = list;
+    *run_count = count;
+    return 0;
+}
+
+void fat_free_chain(uint32_t cluster)
+{
+    uint32_t steps = 0;
+    while (cluster >= 2 && cluster < FAT->cluster_limit && steps++ < FAT->cluster_limit)
+    {
+        uint32_t next = get_fat_entry(cluster);
+        if (update_fat_entry(cluster, 0) != 0)
+            break;
+        cluster = next;
+    }
+}
+
+uint32_t fat_free_cluster_count(void)
+{
+    return FAT->free_count;
+}
+
+uint32_t fat_cluster_limit(void)
+{
+    return FAT->cluster_limit;
+}
+
+uint32_t fat_generation(void)
+{
+    return FAT->fat_changes;
+}
+
+int fat_build_extents(uint32_t cluster, uint32_t max_clusters, Extent **extents, uint32_t *count)
+{
+    uint32_t capacity = 16;
+    uint32_t used = 0;
+    uint32_t walked = 0;
+    Extent *list = malloc(capacity * sizeof(Extent));
+
+    if (!list)
+        return -1;
+
+    // Walk the in-memory chain and merge neighbouring clusters into runs
+    // A chain can never be longer than the volume, which also stops loops
+    while (cluster >= 2 && cluster < FAT->cluster_limit && walked < max_clusters && walked < FAT->cluster_limit)
+    {
+        if (used > 0 && list[used - 1].startCluster + list[used - 1].clusterCount == cluster)
+        {
+            list[used - 1].clusterCount++;
+        }
+        else
+        {
+            if (used == capacity)
+            {
+                capacity *= 2;
+                Extent *grown = realloc(list, capacity * sizeof(Extent));
+                if (!grown)
+                {
+                    free(list);
+                    return -1;
+                }
+                list = grown;
+            }
+            list[used].startCluster = cluster;
+            list[used].clusterCount = 1;
+            used++;
+        }
+
+        walked++;
+        cluster = get_fat_entry(cluster);
+    }
+
+    *extents = list;
+    *count = used;
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Bulk byte formatter for the read command. Each byte value is rendered once
+// into a lookup table; formatting a block is then a run of small copies into
+// an output buffer that is handed to fwrite in large pieces instead of one
+// printf per byte.
+static char hex_text[256][5]; // "0xXX "
+static char dec_text[256][4]; // "255 "
+static uint8_t dec_length[256];
+static int tables_ready = 0;
+
+static void build_tables(void)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    for (int b = 0; b < 256; b++)
+    {
+        hex_text[b][0] = '0';
+        hex_text[b][1] = 'x';
+        hex_text[b][2] = digits[b >> 4];
+        hex_text[b][3] = digits[b & 0x0F];
+        hex_text[b][4] = ' ';
+
+        char text[8];
+        int len = snprintf(text, sizeof(text), "%d ", b);
+        memcpy(dec_text[b], text, len);
+        dec_length[b] = len;
+    }
+    tables_ready = 1;
+}
+
+void write_formatted(const uint8_t *data, size_t length, int format, FILE *out)
+{
+    static char buffer[FORMAT_OUTPUT_BUFFER];
+
+    if (format == FORMAT_ASCII || format == FORMAT_RAW)
+    {
+        // Both print the bytes as they are
+        fwrite(data, 1, length, out);
+        return;
+    }
+
+    if (!tables_ready)
+        build_tables();
+
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        // Every rendering is at most five characters
+        if (used + 5 > sizeof(buffer))
+        {
+            fwrite(buffer, 1, used, out);
+            used = 0;
+        }
+
+        uint8_t b = data[i];
+        if (format == FORMAT_HEX)
+        {
+            memcpy(buffer + used, hex_text[b], 5);
+            used += 5;
+        }
+        else
+        {
+            memcpy(buffer + used, dec_text[b], 4);
+            used += dec_length[b];
+        }
+    }
+
+    if (used)
+        fwrite(buffer, 1, used, out);
+}
@@ -0,0 +1,983 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+
+// Filesystem contexts. Everything the modules know about an open image
+// hangs off an mfs_fs; the thread working on one points mfs_current at it,
+// which is what the old global names (disk_fd, bs, ...) now resolve
+// through. The library's read calls share a context between threads under
+// its read lock; everything else holds it alone.
+__thread mfs_fs *mfs_current = NULL;
+
+mfs_fs *mfs_create(void)
+{
+    mfs_fs *fs = calloc(1, sizeof(mfs_fs));
+    if (!fs)
+        return NULL;
+
+    fs->imageFd = -1;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->errorLock, NULL);
+    fs->fat = fat_state_new();
+    fs->cache = cache_state_new();
+    fs->disk = disk_state_new();
+    fs->journal = journal_state_new();
+    fs->extents = extent_state_new();
+    fs->dirs = dir_index_state_new();
+    fs->paths = path_state_new();
+    fs->readahead = readahead_state_new();
+    fs->deleted = deleted_state_new();
+    if (!fs->fat || !fs->cache || !fs->disk || !fs->journal || !fs->extents || !fs->dirs || !fs->paths ||
+        !fs->readahead || !fs->deleted)
+    {
+        mfs_destroy(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+void mfs_destroy(mfs_fs *fs)
+{
+    if (!fs)
+        return;
+
+    mfs_fs *previous = mfs_current;
+    mfs_current = fs;
+    close_filesystem();
+    mfs_current = previous == fs ? NULL : previous;
+
+    free(fs->fat);
+    free(fs->cache);
+    free(fs->disk);
+    free(fs->journal);
+    free(fs->extents);
+    free(fs->dirs);
+    free(fs->paths);
+    free(fs->readahead);
+    free(fs->deleted);
+    pthread_rwlock_destroy(&fs->lock);
+    pthread_mutex_destroy(&fs->errorLock);
+    free(fs);
+}
+
+void mfs_use(mfs_fs *fs)
+{
+    mfs_current = fs;
+}
+
+// Report a failure on the current filesystem. The shell has the message
+// printed; library users read it back with mfs_last_error(). Readers on
+// other threads may fail at the same time, so the text is stored whole
+// under the handle's error lock.
+void print_error(const char *format, ...)
+{
+    va_list args;
+    char message[sizeof(mfs_current->lastError)];
+
+    if (!mfs_current)
+    {
+        printf("Error: ");
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    pthread_mutex_lock(&mfs_current->errorLock);
+    memcpy(mfs_current->lastError, message, sizeof(message));
+    pthread_mutex_unlock(&mfs_current->errorLock);
+    __atomic_store_n(&mfs_current->failed, 1, __ATOMIC_RELAXED);
+    if (mfs_current->echoErrors)
+        printf("Error: %s", message);
+}
+
+uint32_t get_first_sector_of_cluster(uint32_t cluster)
+{
+    uint32_t first_data_sector = bs.reservedSectorCount + (bs.numberOfFATs * bs.fatSize32);
+    return first_data_sector + ((cluster - 2) * bs.sectorsPerCluster);
+}
+
+int find_file_entry(const char *filename, uint32_t dir_cluster, DirEntry *entry)
+{
+    // Served from the directory's hash index, built on first use
+    return dir_index_lookup(dir_cluster, filename, entry, NULL, NULL) == 1;
+}
+
+// Look up a name as typed. A name that fits 8.3 is looked for as one first;
+// any other is only found as a long name.
+int dir_find_name(uint32_t dir_cluster, const char *name, DirEntry *entry, uint32_t *sector, uint32_t *slot)
+{
+    if (!lfn_needed(name))
+    {
+        char expanded_name[12];
+        convert_to_fat_filename(name, expanded_name);
+        if (dir_index_lookup(dir_cluster, expanded_name, entry, sector, slot) == 1)
+            return 1;
+    }
+    return dir_index_lookup_long(dir_cluster, name, entry, sector, slot) == 1;
+}
+
+int find_deleted_file_entry(const char *filename, uint32_t dir_cluster, DirEntry *entry, uint32_t *sector,
+                            uint32_t *slot, int include_deleted)
+{
+    char key[11];
+
+    // Deleted entries are indexed under their 0xE5-prefixed name
+    memcpy(key, filename, 11);
+    if (include_deleted)
+        key[0] = (char)0xE5;
+
+    return dir_index_lookup(dir_cluster, key, entry, sector, slot) == 1;
+}
+
+// Open an image. Returns the number of journal transactions replayed into
+// it, or -1.
+int open_filesystem(const char *filename)
+{
+    if (strlen(filename) > 100)
+    {
+        print_error("Filename too long\n");
+        return -1;
+    }
+
+    disk_fd = open(filename, O_RDWR);
+    if (disk_fd < 0)
+    {
+        return -1;
+    }
+
+    // Read boot sector
+    if (pread(disk_fd, &bs, sizeof(BootSector), 0) != sizeof(BootSector))
+    {
+        close(disk_fd);
+        disk_fd = -1;
+        return -1;
+    }
+
+    // Pick the sector I/O backend and bring the image up to date from any
+    // journal left behind, then load the FAT into memory so chain walks
+    // never touch the disk
+    if (disk_attach() != 0)
+    {
+        print_error("Could not set up image I/O\n");
+        disk_detach();
+        close(disk_fd);
+        disk_fd = -1;
+        return -1;
+    }
+    int replayed = journal_open(filename);
+    if (replayed < 0)
+    {
+        print_error("Could not open journal\n");
+        disk_detach();
+        close(disk_fd);
+        disk_fd = -1;
+        return -1;
+    }
+    if (fat_load() != 0)
+    {
+        journal_close();
+        disk_detach();
+        close(disk_fd);
+        disk_fd = -1;
+        return -1;
+    }
+    if (replayed > 0)
+    {
+        // The replay only reached the active FAT; rewrite the mirrors on sync
+        fat_mark_mirrors_stale();
+    }
+
+    strncpy(current_image_name, filename, Mx_FILENAME_LENGTH - 1);
+    current_image_name[Mx_FILENAME_LENGTH - 1] = '\0';
+    path_reset();
+
+    return replayed;
+}
+
+// Write all pending FAT changes back to the image and checkpoint the journal
+int sync_filesystem(void)
+{
+    if (disk_fd < 0)
+        return -1;
+
+    journal_begin();
+    int result = fat_sync();
+    if (journal_end() != 0 || journal_checkpoint() != 0)
+        result = -1;
+    if (disk_flush() != 0)
+        result = -1;
+    return result;
+}
+
+int save_filesystem(const char *newname)
+{
+    if (sync_filesystem() != 0)
+        return -1;
+
+    if (!newname || strcmp(newname, current_image_name) == 0)
+        return 0;
+
+    // Copy the synced image to the new file
+    FILE *out = fopen(newname, "wb");
+    if (!out)
+        return -1;
+
+    size_t chunk = 1024 * 1024;
+    uint8_t *buffer = malloc(chunk);
+    if (!buffer)
+    {
+        fclose(out);
+        return -1;
+    }
+
+    int result = 0;
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(disk_fd, buffer, chunk, offset)) > 0)
+    {
+        if (fwrite(buffer, 1, n, out) != (size_t)n)
+        {
+            result = -1;
+            break;
+        }
+        offset += n;
+    }
+    if (n < 0)
+        result = -1;
+
+    free(buffer);
+    if (fclose(out) != 0)
+        result = -1;
+    return result;
+}
+
+void close_filesystem(void)
+{
+    if (disk_fd >= 0)
+    {
+        sync_filesystem();
+        journal_close();
+        extent_cache_clear();
+        dir_index_clear();
+        deleted_index_clear();
+        dentry_cache_clear();
+        fat_unload();
+        disk_detach();
+        close(disk_fd);
+        disk_fd = -1;
+        current_image_name[0] = '\0';
+    }
+}
+
+// Sectors of a directory in chain order, so that entry n of the directory
+// is slot n % entries-per-sector of sector n / entries-per-sector. The
+// caller frees the list.
+static uint32_t *dir_sectors(uint32_t dir_cluster, uint32_t *count)
+{
+    uint32_t capacity = bs.sectorsPerCluster * 4;
+    uint32_t used = 0;
+    uint32_t *list = malloc(capacity * sizeof(uint32_t));
+    uint32_t cluster = dir_cluster;
+    uint32_t walked = 0;
+
+    while (list && cluster >= 2 && cluster < EOC && walked++ < fat_cluster_limit())
+    {
+        if (used + bs.sectorsPerCluster > capacity)
+        {
+            capacity *= 2;
+            uint32_t *grown = realloc(list, capacity * sizeof(uint32_t));
+            if (!grown)
+            {
+                free(list);
+                return NULL;
+            }
+            list = grown;
+        }
+        uint32_t first = get_first_sector_of_cluster(cluster);
+        for (uint32_t s = 0; s < bs.sectorsPerCluster; s++)
+            list[used++] = first + s;
+        cluster = get_fat_entry(cluster);
+    }
+    *count = used;
+    return list;
+}
+
+// First run of wanted consecutive free entries (never used, or deleted) in
+// the directory. Returns its entry number, -1 if there is no such run or -2
+// if a sector could not be read. *reused is set if the run takes over
+// deleted entries. Without a run, *tail is where the free entries at the
+// end of the directory start (the entry count if there are none), and
+// *reused tells whether those are deleted ones.
+static int64_t find_free_entries(const uint32_t *sectors, uint32_t sector_count, uint32_t wanted, int *reused,
+                                 uint64_t *tail)
+{
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint64_t total = (uint64_t)sector_count * entries_per_sector;
+    uint8_t buffer[SECTOR_SIZE];
+    uint32_t run = 0;
+    int run_reused = 0;
+
+    for (uint32_t s = 0; s < sector_count; s++)
+    {
+        if (read_disk_sector(sectors[s], buffer) != 1)
+            return -2;
+
+        const DirEntry *dir = (const DirEntry *)buffer;
+        for (uint32_t i = 0; i < entries_per_sector; i++)
+        {
+            STATS_ADD(dirEntriesScanned, 1);
+            uint64_t index = (uint64_t)s * entries_per_sector + i;
+            uint8_t lead = (uint8_t)dir[i].DIR_Name[0];
+            if (lead == 0x00)
+            {
+                // Everything from the end marker on is free
+                uint64_t start = index - run;
+                *reused = run_reused;
+                *tail = start;
+                return total - start >= wanted ? (int64_t)start : -1;
+            }
+            if (lead == 0xE5)
+            {
+                run_reused |= 1;
+                if (++run == wanted)
+                {
+                    *reused = 1;
+                    return index + 1 - run;
+                }
+                continue;
+            }
+            run = 0;
+            run_reused = 0;
+        }
+    }
+    *reused = run_reused;
+    *tail = total - run;
+    return -1;
+}
+
+// Write count entries into consecutive slots from entry number first, one
+// read and write per sector touched
+static int write_dir_entries(const uint32_t *sectors, uint64_t first, const DirEntry *entries, uint32_t count)
+{
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint8_t buffer[SECTOR_SIZE];
+    uint32_t done = 0;
+
+    while (done < count)
+    {
+        uint64_t index = first + done;
+        uint32_t sector = sectors[index / entries_per_sector];
+        uint32_t slot = index % entries_per_sector;
+        if (read_disk_sector(sector, buffer) != 1)
+            return -1;
+
+        DirEntry *dir = (DirEntry *)buffer;
+        while (done < count && slot < entries_per_sector)
+            dir[slot++] = entries[done++];
+        if (write_disk_sector(sector, buffer) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+int dir_find_slots(uint32_t dir_cluster, uint32_t count, DirSlots *slots)
+{
+    memset(slots, 0, sizeof(*slots));
+    slots->sectors = dir_sectors(dir_cluster, &slots->sectorCount);
+    if (!slots->sectors || slots->sectorCount == 0)
+    {
+        free(slots->sectors);
+        slots->sectors = NULL;
+        return -1;
+    }
+    slots->count = count;
+
+    uint64_t tail;
+    int64_t first = find_free_entries(slots->sectors, slots->sectorCount, count, &slots->reused, &tail);
+    if (first == -2)
+    {
+        dir_slots_release(slots);
+        return -1;
+    }
+
+    // No room: the entries start in the free tail, if any, and run on into
+    // clusters the caller adds with dir_extend()
+    slots->first = first < 0 ? tail : (uint64_t)first;
+    if (first < 0)
+    {
+        uint32_t entries_per_cluster = bs.bytesPerSector / sizeof(DirEntry) * bs.sectorsPerCluster;
+        uint64_t total = (uint64_t)slots->sectorCount * bs.bytesPerSector / sizeof(DirEntry);
+        slots->extend = (slots->first + count - total + entries_per_cluster - 1) / entries_per_cluster;
+    }
+    uint32_t first_data_sector = get_first_sector_of_cluster(2);
+    slots->lastCluster = (slots->sectors[slots->sectorCount - 1] - first_data_sector) / bs.sectorsPerCluster + 2;
+    return 0;
+}
+
+// Zero the clusters the entries still need and link them after the
+// directory's last one, in the caller's FAT transaction. Their data is
+// written in place, so the caller must have passed journal_barrier() first.
+int dir_extend(DirSlots *slots)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t *grown = realloc(slots->sectors, (slots->sectorCount + (size_t)slots->extend * bs.sectorsPerCluster) * sizeof(uint32_t));
+    if (!grown)
+        return -1;
+    slots->sectors = grown;
+
+    uint8_t *zeros = calloc(1, bytes_per_cluster);
+    if (!zeros)
+        return -1;
+    while (slots->extend > 0)
+    {
+        uint32_t cluster = fat_alloc_cluster();
+        if (!cluster || update_fat_entry(slots->lastCluster, cluster) != 0 ||
+            write_disk_sectors(get_first_sector_of_cluster(cluster), bs.sectorsPerCluster, zeros) != 1)
+            break;
+
+        uint32_t first = get_first_sector_of_cluster(cluster);
+        for (uint32_t s = 0; s < bs.sectorsPerCluster; s++)
+            slots->sectors[slots->sectorCount++] = first + s;
+        slots->lastCluster = cluster;
+        slots->extend--;
+    }
+    free(zeros);
+    return slots->extend == 0 ? 0 : -1;
+}
+
+int dir_write_slots(const DirSlots *slots, const DirEntry *entries)
+{
+    return write_dir_entries(slots->sectors, slots->first, entries, slots->count);
+}
+
+// Sector and slot of the last of the entries, which is the 8.3 one
+void dir_slots_last(const DirSlots *slots, uint32_t *sector, uint32_t *slot)
+{
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint64_t last = slots->first + slots->count - 1;
+    *sector = slots->sectors[last / entries_per_sector];
+    *slot = last % entries_per_sector;
+}
+
+void dir_slots_release(DirSlots *slots)
+{
+    free(slots->sectors);
+    slots->sectors = NULL;
+}
+
+// Mark the entry at sector/slot deleted, and with it the parts of its long
+// name, if any, that come just before it. The caller holds a journal
+// transaction open.
+int dir_mark_deleted(uint32_t dir_cluster, uint32_t sector, uint32_t slot)
+{
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint32_t sector_count;
+    uint32_t *sectors = dir_sectors(dir_cluster, &sector_count);
+    if (!sectors)
+        return -1;
+
+    uint32_t s = 0;
+    while (s < sector_count && sectors[s] != sector)
+        s++;
+
+    uint8_t buffer[SECTOR_SIZE];
+    int result = 0;
+    if (s == sector_count || read_disk_sector(sector, buffer) != 1)
+    {
+        free(sectors);
+        return -1;
+    }
+
+    DirEntry *dir = (DirEntry *)buffer;
+    uint8_t checksum = lfn_checksum(dir[slot].DIR_Name);
+    dir[slot].DIR_Name[0] = 0xE5;
+
+    // Walk back over the parts while they count up from 1 to the last one
+    uint8_t ordinal = 1;
+    int64_t index = (int64_t)s * entries_per_sector + slot - 1;
+    while (index >= 0 && result == 0)
+    {
+        uint32_t at = sectors[index / entries_per_sector];
+        if (at != sector)
+        {
+            if (write_disk_sector(sector, buffer) != 1 || read_disk_sector(at, buffer) != 1)
+            {
+                result = -1;
+                break;
+            }
+            sector = at;
+        }
+
+        LfnEntry *part = (LfnEntry *)&dir[index % entries_per_sector];
+        if (part->LDIR_Attr != ATTRIBUTE_LONG_NAME || part->LDIR_Chksum != checksum ||
+            (part->LDIR_Ord & ~LFN_LAST_ENTRY) != ordinal)
+            break;
+        int last = part->LDIR_Ord & LFN_LAST_ENTRY;
+        part->LDIR_Ord = 0xE5;
+        if (last)
+            break;
+        ordinal++;
+        index--;
+    }
+
+    if (result == 0 && write_disk_sector(sector, buffer) != 1)
+        result = -1;
+    free(sectors);
+    return result;
+}
+
+// Undo dir_mark_deleted() for the long name of the live entry at
+// sector/slot: the deleted parts just before it whose checksum matches its
+// 8.3 name get their ordinals back, counted from 1 by position since the
+// deletion overwrote them. The caller holds a journal transaction open.
+int dir_revive_long_name(uint32_t dir_cluster, uint32_t sector, uint32_t slot)
+{
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint32_t sector_count;
+    uint32_t *sectors = dir_sectors(dir_cluster, &sector_count);
+    if (!sectors)
+        return -1;
+
+    uint32_t s = 0;
+    while (s < sector_count && sectors[s] != sector)
+        s++;
+
+    uint8_t buffer[SECTOR_SIZE];
+    if (s == sector_count || read_disk_sector(sector, buffer) != 1)
+    {
+        free(sectors);
+        return -1;
+    }
+    uint8_t checksum = lfn_checksum(((DirEntry *)buffer)[slot].DIR_Name);
+    int64_t entry = (int64_t)s * entries_per_sector + slot;
+
+    // First pass: how many parts there are, at most a whole long name
+    uint32_t parts = 0;
+    int result = 0;
+    while (parts < LFN_MAX_ENTRIES && entry - parts - 1 >= 0)
+    {
+        int64_t index = entry - parts - 1;
+        uint32_t at = sectors[index / entries_per_sector];
+        if (at != sector)
+        {
+            if (read_disk_sector(at, buffer) != 1)
+            {
+                result = -1;
+                break;
+            }
+            sector = at;
+        }
+        LfnEntry *part = (LfnEntry *)&((DirEntry *)buffer)[index % entries_per_sector];
+        if (part->LDIR_Ord != 0xE5 || part->LDIR_Attr != ATTRIBUTE_LONG_NAME || part->LDIR_Chksum != checksum)
+            break;
+        parts++;
+    }
+
+    // Second pass: number them, nearest first
+    for (uint32_t ordinal = 1; ordinal <= parts && result == 0; ordinal++)
+    {
+        int64_t index = entry - ordinal;
+        uint32_t at = sectors[index / entries_per_sector];
+        if (at != sector)
+        {
+            if (write_disk_sector(sector, buffer) != 1 || read_disk_sector(at, buffer) != 1)
+            {
+                result = -1;
+                break;
+            }
+            sector = at;
+        }
+        LfnEntry *part = (LfnEntry *)&((DirEntry *)buffer)[index % entries_per_sector];
+        part->LDIR_Ord = ordinal | (ordinal == parts ? LFN_LAST_ENTRY : 0);
+    }
+
+    if (result == 0 && parts > 0 && write_disk_sector(sector, buffer) != 1)
+        result = -1;
+    free(sectors);
+    return result;
+}
+
+// Store size bytes read from src as a new file called name in the current
+// directory. A name that does not fit 8.3 is stored as a long name ahead of
+// a generated 8.3 alias; a name already in the directory is refused.
+// Returns 0, or -1 after reporting the error.
+int put_file(FILE *src_file, uint32_t file_size, const char *entry_name) {
+    // The entries to write: the parts of a long name, then the 8.3 entry
+    DirEntry entries[LFN_MAX_ENTRIES + 1];
+    uint32_t entry_count = 1;
+    char expanded_name[12];
+    int long_name = lfn_needed(entry_name);
+
+    DirEntry existing;
+    if (dir_find_name(current_dir_cluster, entry_name, &existing, NULL, NULL)) {
+        print_error("%s already exists\n", entry_name);
+        return -1;
+    }
+
+    if (long_name) {
+        int parts = lfn_entry_count(entry_name);
+        if (parts < 0) {
+            print_error("Invalid file name\n");
+            return -1;
+        }
+        if (lfn_make_alias(entry_name, current_dir_cluster, expanded_name) != 0) {
+            print_error("No free short name for %s\n", entry_name);
+            return -1;
+        }
+        lfn_make_entries(entry_name, expanded_name, entries);
+        entry_count += parts;
+    } else {
+        convert_to_fat_filename(entry_name, expanded_name);
+    }
+
+    DirEntry *new_entry = &entries[entry_count - 1];
+    memset(new_entry, 0, sizeof(DirEntry));
+    memcpy(new_entry->DIR_Name, expanded_name, 11);
+
+    // Set attributes and size
+    new_entry->DIR_Attr = ATTRIBUTE_ARCHIVE;
+    new_entry->DIR_FileSize = file_size;
+
+    // Search for enough free entries in a row in the directory; a full one
+    // gets another cluster once the file's chain is allocated
+    DirSlots slots;
+    if (dir_find_slots(current_dir_cluster, entry_count, &slots) != 0) {
+        print_error("Could not read directory sector\n");
+        return -1;
+    }
+
+    // Make sure the whole file fits before touching the FAT
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t clusters_needed = (uint32_t)(((uint64_t)file_size + bytes_per_cluster - 1) / bytes_per_cluster);
+    if ((uint64_t)clusters_needed + slots.extend > fat_free_cluster_count()) {
+        print_error("No free clusters available\n");
+        dir_slots_release(&slots);
+        return -1;
+    }
+
+    // Allocate the whole chain first, as few contiguous runs as possible. The
+    // FAT changes stay in memory until the data is down, then go out together.
+    fat_begin();
+    Extent *runs = NULL;
+    uint32_t run_count = 0;
+    uint32_t first_cluster = 0;
+    if (fat_alloc_chain(clusters_needed, &runs, &run_count) != 0) {
+        print_error("No free clusters available\n");
+        fat_abort();
+        dir_slots_release(&slots);
+        return -1;
+    }
+    if (run_count > 0) {
+        first_cluster = runs[0].startCluster;
+    }
+
+    // Stream the source into each run with large, whole-cluster writes. The
+    // clusters must not be ones whose release the journal has yet to record.
+    if (journal_barrier() != 0) {
+        print_error("Could not commit the journal\n");
+        fat_abort();
+        free(runs);
+        dir_slots_release(&slots);
+        return -1;
+    }
+    int extended = slots.extend > 0;
+    if (extended && dir_extend(&slots) != 0) {
+        print_error("Directory full\n");
+        fat_abort();
+        free(runs);
+        dir_slots_release(&slots);
+        return -1;
+    }
+    size_t stage_size = (size_t)clusters_needed * bytes_per_cluster;
+    PutStage stage;
+    if (put_stage_init(&stage, stage_size < PUT_WRITE_CHUNK ? stage_size : PUT_WRITE_CHUNK) != 0) {
+        print_error("Memory allocation failed\n");
+        fat_abort();
+        free(runs);
+        dir_slots_release(&slots);
+        return -1;
+    }
+
+    int status = put_write_runs(&stage, src_file, file_size, runs, run_count);
+    if (status == PUT_OK && put_stage_flush(&stage) != 0) {
+        status = PUT_WRITE_FAILED;
+    }
+    put_stage_release(&stage);
+    free(runs);
+
+    if (status != PUT_OK) {
+        print_error(status == PUT_READ_FAILED ? "Could not read source file\n" : "Could not write to filesystem\n");
+        fat_abort();
+        dir_slots_release(&slots);
+        return -1;
+    }
+
+    // The chain and the directory entries form one journal transaction. The
+    // FAT transaction stays open until that is committed, so a failed commit
+    // can still take the chain back.
+    journal_begin();
+    if (fat_flush() != 0) {
+        print_error("Could not update the FAT\n");
+        journal_end();
+        fat_abort();
+        dir_slots_release(&slots);
+        return -1;
+    }
+
+    // Update directory entry
+    new_entry->DIR_FstClusLO = first_cluster & 0xFFFF;
+    new_entry->DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
+
+    // Write the long name and the directory entry
+    int written = dir_write_slots(&slots, entries) == 0;
+    if (!written) {
+        print_error("Could not update directory entry\n");
+    }
+
+    uint32_t sector, entry_index;
+    dir_slots_last(&slots, &sector, &entry_index);
+    int reused_deleted = slots.reused;
+    dir_slots_release(&slots);
+
+    if (journal_end() != 0 && written) {
+        print_error("Could not commit the journal\n");
+        dir_mark_deleted(current_dir_cluster, sector, entry_index);
+        written = 0;
+    }
+    if (!written) {
+        fat_abort();
+        dir_index_invalidate(current_dir_cluster);
+        return -1;
+    }
+    fat_commit();
+
+    if (reused_deleted || extended) {
+        dir_index_invalidate(current_dir_cluster);
+    } else if (long_name) {
+        dir_index_add_long(current_dir_cluster, entry_name, new_entry->DIR_Name, sector, entry_index);
+    } else {
+        dir_index_add(current_dir_cluster, new_entry->DIR_Name, sector, entry_index);
+    }
+    return 0;
+}
+
+// Library entry points (libmfs.h). Each selects its filesystem for the
+// calling thread and reports failures through mfs_last_error(). Lookups and
+// reads hold the filesystem's lock shared, so many can run at once; the
+// rest hold it exclusively.
+static void enter(mfs_fs *fs, int exclusive)
+{
+    if (exclusive)
+        pthread_rwlock_wrlock(&fs->lock);
+    else
+        pthread_rwlock_rdlock(&fs->lock);
+    mfs_use(fs);
+}
+
+static void leave(mfs_fs *fs)
+{
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+mfs_fs *mfs_open(const char *image, int flags)
+{
+    mfs_fs *fs = mfs_create();
+    if (!fs)
+        return NULL;
+
+    mfs_use(fs);
+    disk_set_backend(flags & MFS_OPEN_PREAD ? IO_BACKEND_PREAD : IO_BACKEND_MMAP);
+    journal_set_enabled((flags & MFS_OPEN_JOURNAL) != 0);
+    if (open_filesystem(image) < 0)
+    {
+        mfs_destroy(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+void mfs_close(mfs_fs *fs)
+{
+    mfs_destroy(fs);
+}
+
+int mfs_last_error(mfs_fs *fs, char *buffer, size_t size)
+{
+    pthread_mutex_lock(&fs->errorLock);
+    int length = snprintf(buffer, size, "%s", fs->lastError);
+    pthread_mutex_unlock(&fs->errorLock);
+    return length;
+}
+
+int mfs_sync(mfs_fs *fs)
+{
+    int result = 0;
+
+    enter(fs, 1);
+    if (sync_filesystem() != 0)
+    {
+        print_error("Could not sync file system image\n");
+        result = -1;
+    }
+    leave(fs);
+    return result;
+}
+
+int mfs_chdir(mfs_fs *fs, const char *path)
+{
+    enter(fs, 1);
+    int result = path_change_dir(path);
+    if (result != 0)
+        print_error(result == PATH_NOT_DIRECTORY ? "Not a directory\n" : "Directory not found\n");
+    leave(fs);
+    return result != 0 ? -1 : 0;
+}
+
+int mfs_lookup(mfs_fs *fs, const char *path, DirEntry *entry)
+{
+    int result = 0;
+
+    enter(fs, 0);
+    if (!path_find_entry(path, entry, NULL))
+    {
+        print_error("File not found\n");
+        result = -1;
+    }
+    leave(fs);
+    return result;
+}
+
+int mfs_list(mfs_fs *fs, const char *path, DirEntry **entries, uint32_t *count)
+{
+    enter(fs, 0);
+    uint32_t cluster = current_dir_cluster;
+    int result = path ? path_resolve_dir(path, &cluster) : 0;
+    if (result != 0)
+    {
+        print_error(result == PATH_NOT_DIRECTORY ? "Not a directory\n" : "Directory not found\n");
+    }
+    else if (dir_read_entries(cluster, entries, count) != 0)
+    {
+        print_error("Could not read directory\n");
+        result = -1;
+    }
+    leave(fs);
+    return result != 0 ? -1 : 0;
+}
+
+// Copy length bytes of the file at offset through its extent map. Whole
+// sectors are read straight into the caller's buffer; only the partial ones
+// at either end go through a bounce sector.
+static uint32_t read_through_map(const ExtentMap *map, uint64_t offset, uint8_t *out, uint32_t length)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint8_t edge[SECTOR_SIZE];
+    uint32_t done = 0;
+
+    while (done < length)
+    {
+        uint64_t position = offset + done;
+        uint32_t run_left;
+        uint32_t physical = extent_map_lookup(map, position / bytes_per_cluster, &run_left);
+        if (physical == 0)
+            break;
+
+        uint32_t in_cluster = position % bytes_per_cluster;
+        uint32_t sector = get_first_sector_of_cluster(physical) + in_cluster / bs.bytesPerSector;
+        uint32_t in_sector = in_cluster % bs.bytesPerSector;
+        uint64_t run_bytes = (uint64_t)run_left * bytes_per_cluster - in_cluster;
+        uint32_t want = length - done < run_bytes ? length - done : run_bytes;
+
+        if (in_sector != 0 || want < bs.bytesPerSector)
+        {
+            uint32_t piece = bs.bytesPerSector - in_sector;
+            if (piece > want)
+                piece = want;
+            if (read_disk_sectors(sector, 1, edge) != 1)
+                break;
+            memcpy(out + done, edge + in_sector, piece);
+            done += piece;
+            continue;
+        }
+
+        uint32_t sectors = want / bs.bytesPerSector;
+        if (read_disk_sectors(sector, sectors, out + done) != 1)
+            break;
+        done += sectors * bs.bytesPerSector;
+    }
+    return done;
+}
+
+int64_t mfs_read(mfs_fs *fs, const char *path, uint64_t offset, void *buffer, uint32_t length)
+{
+    int64_t result = -1;
+    DirEntry entry;
+
+    enter(fs, 0);
+    if (!path_find_entry(path, &entry, NULL))
+    {
+        print_error("File not found\n");
+    }
+    else if (entry.DIR_Attr & ATTRIBUTE_DIRECTORY)
+    {
+        print_error("Cannot read a directory\n");
+    }
+    else if (offset >= entry.DIR_FileSize)
+    {
+        result = 0;
+    }
+    else
+    {
+        if (length > entry.DIR_FileSize - offset)
+            length = entry.DIR_FileSize - offset;
+
+        const ExtentMap *map = extent_map_get((entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO);
+        if (!map)
+        {
+            print_error("Invalid cluster chain\n");
+        }
+        else
+        {
+            if (read_through_map(map, offset, buffer, length) == length)
+                result = length;
+            else
+                print_error("Could not read cluster\n");
+            extent_map_put(map);
+        }
+    }
+    leave(fs);
+    return result;
+}
+
+int mfs_write(mfs_fs *fs, const char *name, const void *data, uint32_t size)
+{
+    int result = -1;
+
+    enter(fs, 1);
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+    }
+    else
+    {
+        // The put path streams from a FILE *; give it one over the caller's bytes
+        FILE *src = size ? fmemopen((void *)data, size, "rb") : fopen("/dev/null", "rb");
+        if (!src)
+        {
+            print_error("Memory allocation failed\n");
+        }
+        else
+        {
+            result = put_file(src, size, name);
+            fclose(src);
+        }
+    }
+    leave(fs);
+    return result;
+}
@@ -0,0 +1,764 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Writing host files into the image. Data goes through a staging buffer
+// that gathers pieces bound for consecutive sectors, so files laid out back
+// to back (as put -r allocates them) reach the image in a few large writes.
+//
+// put -r imports a host tree in three steps. A planning pass stats every
+// file and directory, converts the names (long ones get an 8.3 alias ahead
+// of their long-name entries) and checks that everything fits.
+// One allocation pass then claims the clusters of every directory and file
+// in tree order inside a single FAT transaction, and the new directories'
+// entry tables are built in memory. Finally the data and directory clusters
+// are streamed out in allocation order; only then is the FAT committed and
+// the top directory linked into the current one.
+int put_stage_init(PutStage *stage, size_t capacity)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+
+    // Whole clusters only, and at least one
+    capacity -= capacity % bytes_per_cluster;
+    if (capacity == 0)
+        capacity = bytes_per_cluster;
+
+    stage->data = malloc(capacity);
+    stage->capacity = capacity;
+    stage->sector = 0;
+    stage->length = 0;
+    return stage->data ? 0 : -1;
+}
+
+int put_stage_flush(PutStage *stage)
+{
+    if (stage->length == 0)
+        return 0;
+
+    uint32_t sectors = stage->length / bs.bytesPerSector;
+    stage->length = 0;
+    return write_disk_sectors(stage->sector, sectors, stage->data) == 1 ? 0 : -1;
+}
+
+void put_stage_release(PutStage *stage)
+{
+    free(stage->data);
+    stage->data = NULL;
+}
+
+// Room for length bytes bound for sector, flushing first if they do not
+// continue what is already staged
+static uint8_t *stage_reserve(PutStage *stage, uint32_t sector, size_t length)
+{
+    if (stage->length > 0 &&
+        (stage->sector + stage->length / bs.bytesPerSector != sector || stage->length + length > stage->capacity))
+    {
+        if (put_stage_flush(stage) != 0)
+            return NULL;
+    }
+
+    if (stage->length == 0)
+        stage->sector = sector;
+    uint8_t *space = stage->data + stage->length;
+    stage->length += length;
+    return space;
+}
+
+int put_write_runs(PutStage *stage, FILE *src, uint32_t size, const Extent *runs, uint32_t run_count)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t chunk_clusters = stage->capacity / bytes_per_cluster;
+    uint32_t bytes_remaining = size;
+
+    for (uint32_t r = 0; r < run_count; r++)
+    {
+        for (uint32_t done = 0; done < runs[r].clusterCount;)
+        {
+            uint32_t piece = runs[r].clusterCount - done;
+            if (piece > chunk_clusters)
+                piece = chunk_clusters;
+
+            size_t piece_bytes = (size_t)piece * bytes_per_cluster;
+            size_t bytes_to_read = bytes_remaining < piece_bytes ? bytes_remaining : piece_bytes;
+            uint8_t *space = stage_reserve(stage, get_first_sector_of_cluster(runs[r].startCluster + done), piece_bytes);
+            if (!space)
+                return PUT_WRITE_FAILED;
+            if (fread(space, 1, bytes_to_read, src) != bytes_to_read)
+                return PUT_READ_FAILED;
+
+            // Zero the slack after the end of the file
+            memset(space + bytes_to_read, 0, piece_bytes - bytes_to_read);
+
+            bytes_remaining -= bytes_to_read;
+            done += piece;
+        }
+    }
+    return PUT_OK;
+}
+
+typedef struct
+{
+    char *hostPath;
+    char name[11];      // 8.3 name, or the alias of a long name
+    char *longName;     // NULL if the host name fits 8.3
+    uint32_t lfnEntries; // entries the long name takes ahead of the 8.3 one
+    int isDirectory;
+    uint32_t size;
+    uint32_t parent;     // node index of the containing directory
+    uint32_t entryCount; // directories: entries including ".", ".." and long names
+    uint32_t clusters;
+    Extent *runs;
+    uint32_t runCount;
+    uint8_t *table; // directories: the entry table being built
+} ImportNode;
+
+typedef struct
+{
+    ImportNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t clusters;
+} ImportPlan;
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int plan_add(ImportPlan *plan, const char *host_path, const char *name, const struct stat *st, uint32_t parent)
+{
+    if (plan->count == plan->capacity)
+    {
+        uint32_t capacity = plan->capacity ? plan->capacity * 2 : 256;
+        ImportNode *grown = realloc(plan->nodes, capacity * sizeof(ImportNode));
+        if (!grown)
+            return -1;
+        plan->nodes = grown;
+        plan->capacity = capacity;
+    }
+
+    ImportNode *node = &plan->nodes[plan->count];
+    memset(node, 0, sizeof(*node));
+    node->hostPath = strdup(host_path);
+    if (!node->hostPath)
+    {
+        print_error("Memory allocation failed\n");
+        return -1;
+    }
+
+    // A long name keeps its 8.3 alias blank until plan_check_names()
+    if (lfn_needed(name))
+    {
+        int parts = lfn_entry_count(name);
+        if (parts < 0)
+        {
+            print_error("Invalid file name %s\n", host_path);
+            free(node->hostPath);
+            return -1;
+        }
+        node->longName = strdup(name);
+        if (!node->longName)
+        {
+            print_error("Memory allocation failed\n");
+            free(node->hostPath);
+            return -1;
+        }
+        node->lfnEntries = parts;
+    }
+    else
+    {
+        char expanded_name[12];
+        convert_to_fat_filename(name, expanded_name);
+        memcpy(node->name, expanded_name, 11);
+    }
+    node->isDirectory = S_ISDIR(st->st_mode);
+    node->size = node->isDirectory ? 0 : (uint32_t)st->st_size;
+    node->parent = parent;
+    node->entryCount = 2;
+    plan->count++;
+    return 0;
+}
+
+// Planning pass: record the directory at host_path (already added as node
+// self) and everything below it, children in name order
+static int plan_directory(ImportPlan *plan, uint32_t self, int depth)
+{
+    if (depth >= MAX_PATH_DEPTH)
+    {
+        print_error("Directory tree too deep\n");
+        return -1;
+    }
+
+    DIR *dir = opendir(plan->nodes[self].hostPath);
+    if (!dir)
+    {
+        print_error("Cannot open directory %s\n", plan->nodes[self].hostPath);
+        return -1;
+    }
+
+    char **names = NULL;
+    uint32_t name_count = 0;
+    uint32_t name_capacity = 0;
+    int result = 0;
+    struct dirent *ent;
+    while (result == 0 && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (name_count == name_capacity)
+        {
+            name_capacity = name_capacity ? name_capacity * 2 : 32;
+            char **grown = realloc(names, name_capacity * sizeof(char *));
+            if (!grown)
+            {
+                result = -1;
+                break;
+            }
+            names = grown;
+        }
+        names[name_count] = strdup(ent->d_name);
+        if (!names[name_count])
+            result = -1;
+        else
+            name_count++;
+    }
+    closedir(dir);
+    if (result != 0)
+        print_error("Memory allocation failed\n");
+    else
+        qsort(names, name_count, sizeof(char *), compare_names);
+
+    for (uint32_t i = 0; i < name_count && result == 0; i++)
+    {
+        size_t length = strlen(plan->nodes[self].hostPath) + strlen(names[i]) + 2;
+        char *path = malloc(length);
+        struct stat st;
+        if (!path)
+        {
+            print_error("Memory allocation failed\n");
+            result = -1;
+            break;
+        }
+        snprintf(path, length, "%s/%s", plan->nodes[self].hostPath, names[i]);
+
+        // Only regular files and directories are imported
+        if (stat(path, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        {
+            free(path);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX)
+        {
+            print_error("File too large: %s\n", path);
+            free(path);
+            result = -1;
+            break;
+        }
+
+        uint32_t child = plan->count;
+        if (plan_add(plan, path, names[i], &st, self) != 0)
+        {
+            result = -1;
+        }
+        else
+        {
+            plan->nodes[self].entryCount += 1 + plan->nodes[child].lfnEntries;
+            if (S_ISDIR(st.st_mode))
+                result = plan_directory(plan, child, depth + 1);
+        }
+        free(path);
+    }
+
+    for (uint32_t i = 0; i < name_count; i++)
+        free(names[i]);
+    free(names);
+    return result;
+}
+
+static void plan_release(ImportPlan *plan)
+{
+    for (uint32_t i = 0; i < plan->count; i++)
+    {
+        free(plan->nodes[i].hostPath);
+        free(plan->nodes[i].longName);
+        free(plan->nodes[i].runs);
+        free(plan->nodes[i].table);
+    }
+    free(plan->nodes);
+}
+
+static int compare_siblings(const void *a, const void *b)
+{
+    const ImportNode *na = *(const ImportNode *const *)a;
+    const ImportNode *nb = *(const ImportNode *const *)b;
+    if (na->parent != nb->parent)
+        return na->parent < nb->parent ? -1 : 1;
+    return memcmp(na->name, nb->name, 11);
+}
+
+static int compare_folded(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 8.3 names already used in one directory of the plan, kept sorted
+typedef struct
+{
+    char (*names)[11];
+    uint32_t count;
+} TakenNames;
+
+static int find_taken(const TakenNames *taken, const char *short_name, uint32_t *at)
+{
+    uint32_t low = 0, high = taken->count;
+    while (low < high)
+    {
+        uint32_t mid = (low + high) / 2;
+        int order = memcmp(taken->names[mid], short_name, 11);
+        if (order == 0)
+        {
+            *at = mid;
+            return 1;
+        }
+        if (order < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *at = low;
+    return 0;
+}
+
+static int name_taken(const char *short_name, void *context)
+{
+    uint32_t at;
+    return find_taken(context, short_name, &at);
+}
+
+// Check one directory's children, order[0..count) sorted by 8.3 name with
+// the long names (whose aliases are still blank) first, and give each long
+// name an alias no sibling has
+static int plan_check_siblings(const ImportNode **order, uint32_t count)
+{
+    uint32_t long_count = 0;
+    while (long_count < count && order[long_count]->longName)
+        long_count++;
+
+    // Distinct host names can shorten to the same 8.3 name
+    for (uint32_t i = long_count + 1; i < count; i++)
+    {
+        if (memcmp(order[i - 1]->name, order[i]->name, 11) == 0)
+        {
+            print_error("%s and %s have the same 8.3 name\n", order[i - 1]->hostPath, order[i]->hostPath);
+            return -1;
+        }
+    }
+    if (long_count == 0)
+        return 0;
+
+    // Names are looked up with case folded, so a long name may not differ
+    // from a sibling's name only in case
+    char **folded = calloc(count, sizeof(char *));
+    TakenNames taken = {malloc((size_t)count * sizeof(*taken.names)), 0};
+    int result = folded && taken.names ? 0 : -1;
+    for (uint32_t i = 0; i < count && result == 0; i++)
+    {
+        const char *name = order[i]->longName;
+        if (!name)
+        {
+            const char *slash = strrchr(order[i]->hostPath, '/');
+            name = slash ? slash + 1 : order[i]->hostPath;
+        }
+        size_t size = 2 * strlen(name) + 1;
+        folded[i] = malloc(size);
+        if (!folded[i])
+            result = -1;
+        else
+            lfn_fold(name, folded[i], size);
+    }
+    if (result != 0)
+        print_error("Memory allocation failed\n");
+
+    if (result == 0)
+    {
+        qsort(folded, count, sizeof(char *), compare_folded);
+        for (uint32_t i = 1; i < count; i++)
+        {
+            if (strcmp(folded[i - 1], folded[i]) == 0)
+            {
+                print_error("Two names in one directory differ only in case: %s\n", folded[i]);
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    // Aliases: BASIS~N with the smallest N no sibling holds yet
+    if (result == 0)
+    {
+        for (uint32_t i = long_count; i < count; i++)
+            memcpy(taken.names[taken.count++], order[i]->name, 11);
+        for (uint32_t i = 0; i < long_count && result == 0; i++)
+        {
+            ImportNode *node = (ImportNode *)order[i];
+            char alias[12];
+            uint32_t at;
+            if (lfn_pick_alias(node->longName, name_taken, &taken, alias) != 0)
+            {
+                print_error("No free short name for %s\n", node->hostPath);
+                result = -1;
+                break;
+            }
+            memcpy(node->name, alias, 11);
+            find_taken(&taken, alias, &at);
+            memmove(taken.names[at + 1], taken.names[at], (size_t)(taken.count - at) * sizeof(*taken.names));
+            memcpy(taken.names[at], alias, 11);
+            taken.count++;
+        }
+    }
+
+    for (uint32_t i = 0; folded && i < count; i++)
+        free(folded[i]);
+    free(folded);
+    free(taken.names);
+    return result;
+}
+
+// Check the names below the top directory, one directory at a time
+static int plan_check_names(ImportPlan *plan)
+{
+    if (plan->count < 2)
+        return 0;
+
+    const ImportNode **order = malloc((plan->count - 1) * sizeof(ImportNode *));
+    if (!order)
+    {
+        print_error("Memory allocation failed\n");
+        return -1;
+    }
+    for (uint32_t i = 1; i < plan->count; i++)
+        order[i - 1] = &plan->nodes[i];
+    qsort(order, plan->count - 1, sizeof(ImportNode *), compare_siblings);
+
+    int result = 0;
+    uint32_t start = 0;
+    for (uint32_t i = 1; i <= plan->count - 1 && result == 0; i++)
+    {
+        if (i == plan->count - 1 || order[i]->parent != order[start]->parent)
+        {
+            result = plan_check_siblings(order + start, i - start);
+            start = i;
+        }
+    }
+    free(order);
+    return result;
+}
+
+static uint32_t first_cluster_of(const ImportNode *node)
+{
+    return node->runCount ? node->runs[0].startCluster : 0;
+}
+
+static void set_entry(DirEntry *entry, const char *name, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    memset(entry, 0, sizeof(DirEntry));
+    memcpy(entry->DIR_Name, name, 11);
+    entry->DIR_Attr = attr;
+    entry->DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+    entry->DIR_FstClusLO = cluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+}
+
+// Fill in every new directory's entry table now that all clusters are known.
+// A ".." that points at the root is stored as cluster 0.
+static int plan_build_tables(ImportPlan *plan, uint32_t parent_cluster)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t *filled = calloc(plan->count, sizeof(uint32_t));
+    if (!filled)
+        return -1;
+
+    for (uint32_t i = 0; i < plan->count; i++)
+    {
+        ImportNode *node = &plan->nodes[i];
+        if (!node->isDirectory)
+            continue;
+
+        node->table = calloc(node->clusters, bytes_per_cluster);
+        if (!node->table)
+        {
+            free(filled);
+            return -1;
+        }
+
+        uint32_t up = i == 0 ? parent_cluster : first_cluster_of(&plan->nodes[node->parent]);
+        if (up == bs.rootCluster)
+            up = 0;
+        DirEntry *table = (DirEntry *)node->table;
+        set_entry(&table[0], ".          ", ATTRIBUTE_DIRECTORY, first_cluster_of(node), 0);
+        set_entry(&table[1], "..         ", ATTRIBUTE_DIRECTORY, up, 0);
+        filled[i] = 2;
+    }
+
+    for (uint32_t i = 1; i < plan->count; i++)
+    {
+        ImportNode *node = &plan->nodes[i];
+        DirEntry *table = (DirEntry *)plan->nodes[node->parent].table;
+        if (node->longName)
+            filled[node->parent] += lfn_make_entries(node->longName, node->name, &table[filled[node->parent]]);
+        set_entry(&table[filled[node->parent]++], node->name,
+                  node->isDirectory ? ATTRIBUTE_DIRECTORY : ATTRIBUTE_ARCHIVE, first_cluster_of(node), node->size);
+    }
+
+    free(filled);
+    return 0;
+}
+
+// Stream every file and directory table out in allocation order
+static int plan_write(ImportPlan *plan, PutStage *stage)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+
+    for (uint32_t i = 0; i < plan->count; i++)
+    {
+        ImportNode *node = &plan->nodes[i];
+
+        if (node->isDirectory)
+        {
+            size_t offset = 0;
+            for (uint32_t r = 0; r < node->runCount; r++)
+            {
+                for (uint32_t c = 0; c < node->runs[r].clusterCount; c++)
+                {
+                    uint8_t *space = stage_reserve(stage, get_first_sector_of_cluster(node->runs[r].startCluster + c), bytes_per_cluster);
+                    if (!space)
+                    {
+                        print_error("Could not write to filesystem\n");
+                        return -1;
+                    }
+                    memcpy(space, node->table + offset, bytes_per_cluster);
+                    offset += bytes_per_cluster;
+                }
+            }
+            continue;
+        }
+
+        FILE *src = fopen(node->hostPath, "rb");
+        if (!src)
+        {
+            print_error("Cannot open %s\n", node->hostPath);
+            return -1;
+        }
+        int status = put_write_runs(stage, src, node->size, node->runs, node->runCount);
+        fclose(src);
+        if (status == PUT_READ_FAILED)
+        {
+            print_error("Could not read %s\n", node->hostPath);
+            return -1;
+        }
+        if (status == PUT_WRITE_FAILED)
+        {
+            print_error("Could not write to filesystem\n");
+            return -1;
+        }
+    }
+
+    if (put_stage_flush(stage) != 0)
+    {
+        print_error("Could not write to filesystem\n");
+        return -1;
+    }
+    return 0;
+}
+
+void cmd_put_tree(const char *host_dir, const char *newname)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        print_error("Directory not found\n");
+        return;
+    }
+
+    // The tree lands in the current directory under the host directory's name
+    char top_name[Mx_FILENAME_LENGTH];
+    snprintf(top_name, sizeof(top_name), "%s", newname ? newname : host_dir);
+    size_t length = strlen(top_name);
+    while (length > 1 && top_name[length - 1] == '/')
+        top_name[--length] = '\0';
+    const char *entry_name = path_basename(top_name);
+
+    DirEntry existing;
+    if (dir_find_name(current_dir_cluster, entry_name, &existing, NULL, NULL))
+    {
+        print_error("%s already exists\n", entry_name);
+        return;
+    }
+
+    // Planning: the whole host tree, its names and its size in clusters
+    ImportPlan plan = {0};
+    if (plan_add(&plan, host_dir, entry_name, &st, 0) != 0)
+    {
+        plan_release(&plan);
+        return;
+    }
+    if (plan_directory(&plan, 0, 0) != 0 || plan_check_names(&plan) != 0)
+    {
+        plan_release(&plan);
+        return;
+    }
+    ImportNode *top_node = &plan.nodes[0];
+    if (top_node->longName)
+    {
+        char alias[12];
+        if (lfn_make_alias(top_node->longName, current_dir_cluster, alias) != 0)
+        {
+            print_error("No free short name for %s\n", entry_name);
+            plan_release(&plan);
+            return;
+        }
+        memcpy(top_node->name, alias, 11);
+    }
+
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    for (uint32_t i = 0; i < plan.count; i++)
+    {
+        ImportNode *node = &plan.nodes[i];
+        uint64_t bytes = node->isDirectory ? (uint64_t)node->entryCount * sizeof(DirEntry) : node->size;
+        node->clusters = (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
+        if (node->isDirectory && node->clusters == 0)
+            node->clusters = 1;
+        plan.clusters += node->clusters;
+    }
+
+    // A full current directory gets another cluster once the tree is allocated
+    DirSlots slots;
+    if (dir_find_slots(current_dir_cluster, 1 + top_node->lfnEntries, &slots) != 0)
+    {
+        print_error("Could not read directory sector\n");
+        plan_release(&plan);
+        return;
+    }
+    if ((uint64_t)plan.clusters + slots.extend > fat_free_cluster_count())
+    {
+        print_error("No free clusters available\n");
+        dir_slots_release(&slots);
+        plan_release(&plan);
+        return;
+    }
+
+    // Allocation: every chain in tree order, in one FAT transaction
+    fat_begin();
+    int failed = 0;
+    for (uint32_t i = 0; i < plan.count && !failed; i++)
+    {
+        ImportNode *node = &plan.nodes[i];
+        if (node->clusters > 0 && fat_alloc_chain(node->clusters, &node->runs, &node->runCount) != 0)
+            failed = 1;
+    }
+    if (failed)
+        print_error("No free clusters available\n");
+    else if (plan_build_tables(&plan, current_dir_cluster) != 0)
+    {
+        print_error("Memory allocation failed\n");
+        failed = 1;
+    }
+
+    // Data: stream the files and new directories in allocation order. None of
+    // it is reachable until the FAT and the top entry are committed below.
+    int extended = slots.extend > 0;
+    PutStage stage;
+    if (!failed && put_stage_init(&stage, PUT_WRITE_CHUNK) != 0)
+    {
+        print_error("Memory allocation failed\n");
+        failed = 1;
+    }
+    else if (!failed)
+    {
+        if (journal_barrier() != 0)
+        {
+            print_error("Could not commit the journal\n");
+            failed = 1;
+        }
+        else if (extended && dir_extend(&slots) != 0)
+        {
+            print_error("Directory full\n");
+            failed = 1;
+        }
+        else
+        {
+            failed = plan_write(&plan, &stage) != 0;
+        }
+        put_stage_release(&stage);
+    }
+
+    if (failed)
+    {
+        fat_abort();
+        dir_slots_release(&slots);
+        plan_release(&plan);
+        return;
+    }
+
+    // Metadata: the FAT and the one new entry, with its long name, in the
+    // current directory
+    DirEntry top[LFN_MAX_ENTRIES + 1];
+    uint32_t top_count = 1;
+    if (top_node->longName)
+        top_count += lfn_make_entries(top_node->longName, top_node->name, top);
+    set_entry(&top[top_count - 1], top_node->name, ATTRIBUTE_DIRECTORY, first_cluster_of(top_node), 0);
+
+    // The FAT transaction stays open until the journal has committed both
+    uint32_t entry_sector, entry_slot;
+    dir_slots_last(&slots, &entry_sector, &entry_slot);
+    journal_begin();
+    int written = 0;
+    if (fat_flush() != 0)
+    {
+        print_error("Could not update the FAT\n");
+    }
+    else if (dir_write_slots(&slots, top) != 0)
+    {
+        print_error("Could not update directory entry\n");
+    }
+    else
+    {
+        written = 1;
+    }
+    int reused_deleted = slots.reused;
+    dir_slots_release(&slots);
+
+    if (journal_end() != 0 && written)
+    {
+        print_error("Could not commit the journal\n");
+        dir_mark_deleted(current_dir_cluster, entry_sector, entry_slot);
+        written = 0;
+    }
+    if (!written)
+    {
+        fat_abort();
+        dir_index_invalidate(current_dir_cluster);
+        plan_release(&plan);
+        return;
+    }
+    fat_commit();
+
+    if (reused_deleted || extended)
+        dir_index_invalidate(current_dir_cluster);
+    else if (top_node->longName)
+        dir_index_add_long(current_dir_cluster, top_node->longName, top_node->name, entry_sector, entry_slot);
+    else
+        dir_index_add(current_dir_cluster, top_node->name, entry_sector, entry_slot);
+
+    printf("Imported %u files and directories\n", plan.count);
+    plan_release(&plan);
+}
@@ -0,0 +1,543 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <errno.h>
+
+// Optional write-ahead journal for metadata. While it is enabled, directory,
+// FAT and FSInfo sectors written between journal_begin() and journal_end()
+// are not written in place. They are kept in an overlay that reads are
+// patched from, and several commands' worth of them are appended to a
+// sidecar file (<image>.jnl) as one transaction with a single fsync. File
+// data is still written in place, and the image is flushed before each
+// transaction so data always reaches the disk before the metadata that
+// points at it. A checkpoint copies the overlay into the image and empties
+// the journal; open replays any complete transactions left behind.
+#define JOURNAL_MAGIC 0x4C4E4A4D // "MJNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BLOCK 1
+#define JOURNAL_COMMIT 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t bytesPerSector;
+    uint32_t reserved;
+} JournalHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint32_t sector;     // JOURNAL_BLOCK: sector the data belongs to
+    uint32_t count;      // JOURNAL_BLOCK: always 1; JOURNAL_COMMIT: blocks in the transaction
+    uint32_t checksum;   // JOURNAL_COMMIT: FNV-1a over the transaction's blocks
+    uint32_t reserved;
+} JournalRecord;
+
+// Overlay of sectors logged since the last checkpoint, with a linear-probing
+// table from sector number to entry index (stored plus one, 0 = empty)
+struct JournalState
+{
+    int journal_wanted;
+    FILE *journal_file;
+    char journal_path[Mx_FILENAME_LENGTH + 8];
+    int journal_depth;
+    int checkpointing;
+    uint64_t journal_sequence;
+    uint32_t pending_commands; // commands since the last transaction
+    int pending_frees;         // the uncommitted group freed clusters
+
+    uint32_t *overlay_sectors;
+    uint8_t *overlay_data;
+    uint8_t *overlay_pending; // not yet in a committed transaction
+    uint32_t overlay_count;
+    uint32_t overlay_capacity;
+    uint32_t *overlay_table;
+    uint32_t overlay_mask;
+};
+
+#define JOURNAL (mfs_current->journal)
+
+JournalState *journal_state_new(void)
+{
+    return calloc(1, sizeof(JournalState));
+}
+
+static uint32_t fnv_update(uint32_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t *table_slot(uint32_t sector)
+{
+    uint32_t i = (sector * 2654435761u) & JOURNAL->overlay_mask;
+    while (JOURNAL->overlay_table[i] && JOURNAL->overlay_sectors[JOURNAL->overlay_table[i] - 1] != sector)
+        i = (i + 1) & JOURNAL->overlay_mask;
+    return &JOURNAL->overlay_table[i];
+}
+
+static int overlay_find(uint32_t sector)
+{
+    if (JOURNAL->overlay_count == 0)
+        return -1;
+    uint32_t index = *table_slot(sector);
+    return index ? (int)index - 1 : -1;
+}
+
+static void overlay_clear(void)
+{
+    free(JOURNAL->overlay_sectors);
+    free(JOURNAL->overlay_data);
+    free(JOURNAL->overlay_pending);
+    free(JOURNAL->overlay_table);
+    JOURNAL->overlay_sectors = NULL;
+    JOURNAL->overlay_data = NULL;
+    JOURNAL->overlay_pending = NULL;
+    JOURNAL->overlay_table = NULL;
+    JOURNAL->overlay_count = JOURNAL->overlay_capacity = JOURNAL->overlay_mask = 0;
+}
+
+static int overlay_grow(void)
+{
+    uint32_t capacity = JOURNAL->overlay_capacity ? JOURNAL->overlay_capacity * 2 : 64;
+    uint32_t *sectors = realloc(JOURNAL->overlay_sectors, capacity * sizeof(uint32_t));
+    if (sectors)
+        JOURNAL->overlay_sectors = sectors;
+    uint8_t *data = realloc(JOURNAL->overlay_data, (size_t)capacity * bs.bytesPerSector);
+    if (data)
+        JOURNAL->overlay_data = data;
+    uint8_t *pending = realloc(JOURNAL->overlay_pending, capacity);
+    if (pending)
+        JOURNAL->overlay_pending = pending;
+    uint32_t *table = calloc((size_t)capacity * 2, sizeof(uint32_t));
+    if (!sectors || !data || !pending || !table)
+    {
+        free(table);
+        return -1;
+    }
+
+    free(JOURNAL->overlay_table);
+    JOURNAL->overlay_table = table;
+    JOURNAL->overlay_mask = capacity * 2 - 1;
+    JOURNAL->overlay_capacity = capacity;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+        *table_slot(JOURNAL->overlay_sectors[i]) = i + 1;
+    return 0;
+}
+
+static int overlay_store(uint32_t sector, const uint8_t *data)
+{
+    int index = overlay_find(sector);
+    if (index < 0)
+    {
+        if (JOURNAL->overlay_count == JOURNAL->overlay_capacity && overlay_grow() != 0)
+            return -1;
+        index = JOURNAL->overlay_count++;
+        JOURNAL->overlay_sectors[index] = sector;
+        *table_slot(sector) = index + 1;
+    }
+    memcpy(JOURNAL->overlay_data + (size_t)index * bs.bytesPerSector, data, bs.bytesPerSector);
+    JOURNAL->overlay_pending[index] = 1;
+    return 0;
+}
+
+static int sync_file(FILE *file)
+{
+    if (fflush(file) != 0)
+        return -1;
+    while (fsync(fileno(file)) != 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+// Make everything written in place so far durable
+static int sync_image(void)
+{
+    int result = disk_flush();
+    if (disk_backend() == IO_BACKEND_PREAD && fsync(disk_fd) != 0)
+        result = -1;
+    return result;
+}
+
+static int write_header(void)
+{
+    JournalHeader header = {JOURNAL_MAGIC, JOURNAL_VERSION, bs.bytesPerSector, 0};
+    rewind(JOURNAL->journal_file);
+    if (fwrite(&header, sizeof(header), 1, JOURNAL->journal_file) != 1)
+        return -1;
+    return sync_file(JOURNAL->journal_file);
+}
+
+// Apply every complete transaction in the journal to the image, in order.
+// Reading stops at the first torn or corrupt record.
+static int replay(FILE *file)
+{
+    JournalHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1)
+        return 0; // empty journal
+    if (header.magic != JOURNAL_MAGIC || header.version != JOURNAL_VERSION ||
+        header.bytesPerSector != bs.bytesPerSector)
+        return -1;
+
+    uint32_t capacity = 64;
+    uint32_t count = 0;
+    uint32_t *sectors = malloc(capacity * sizeof(uint32_t));
+    uint8_t *data = malloc((size_t)capacity * bs.bytesPerSector);
+    uint32_t checksum = 2166136261u;
+    uint64_t sequence = 0;
+    int applied = 0;
+    int result = 0;
+
+    JournalRecord record;
+    while (sectors && data && fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if (record.magic != JOURNAL_MAGIC)
+            break;
+
+        if (record.type == JOURNAL_BLOCK)
+        {
+            if (count == 0)
+                sequence = record.sequence;
+            if (record.sequence != sequence || record.count != 1)
+                break;
+            if (count == capacity)
+            {
+                capacity *= 2;
+                uint32_t *grown_sectors = realloc(sectors, capacity * sizeof(uint32_t));
+                if (grown_sectors)
+                    sectors = grown_sectors;
+                uint8_t *grown_data = realloc(data, (size_t)capacity * bs.bytesPerSector);
+                if (grown_data)
+                    data = grown_data;
+                if (!grown_sectors || !grown_data)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            uint8_t *block = data + (size_t)count * bs.bytesPerSector;
+            if (fread(block, bs.bytesPerSector, 1, file) != 1)
+                break;
+            checksum = fnv_update(checksum, &record.sector, sizeof(record.sector));
+            checksum = fnv_update(checksum, block, bs.bytesPerSector);
+            sectors[count++] = record.sector;
+        }
+        else if (record.type == JOURNAL_COMMIT)
+        {
+            if ((count > 0 && record.sequence != sequence) || record.count != count || record.checksum != checksum)
+                break;
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (disk_raw_write(sectors[i], 1, data + (size_t)i * bs.bytesPerSector) != 1)
+                    result = -1;
+            }
+            if (record.sequence >= JOURNAL->journal_sequence)
+                JOURNAL->journal_sequence = record.sequence + 1;
+            applied++;
+            count = 0;
+            checksum = 2166136261u;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (!sectors || !data)
+        result = -1;
+    free(sectors);
+    free(data);
+
+    if (applied > 0 && sync_image() != 0)
+        result = -1;
+    return result < 0 ? -1 : applied;
+}
+
+void journal_set_enabled(int enable)
+{
+    JOURNAL->journal_wanted = enable;
+}
+
+int journal_open(const char *image_name)
+{
+    int enable = JOURNAL->journal_wanted;
+    int replayed = 0;
+    snprintf(JOURNAL->journal_path, sizeof(JOURNAL->journal_path), "%s.jnl", image_name);
+    JOURNAL->journal_sequence = 0;
+
+    // Whatever an earlier session left behind goes into the image first
+    FILE *old = fopen(JOURNAL->journal_path, "rb");
+    if (old)
+    {
+        int applied = replay(old);
+        fclose(old);
+        if (applied < 0)
+            return -1;
+        replayed = applied;
+        if (!enable && remove(JOURNAL->journal_path) != 0)
+            return -1;
+    }
+
+    if (!enable)
+        return replayed;
+
+    JOURNAL->journal_file = fopen(JOURNAL->journal_path, "wb+");
+    if (!JOURNAL->journal_file || write_header() != 0)
+    {
+        journal_close();
+        return -1;
+    }
+    return replayed;
+}
+
+int journal_close(void)
+{
+    if (!JOURNAL->journal_file)
+        return 0;
+
+    int result = journal_checkpoint();
+    fclose(JOURNAL->journal_file);
+    JOURNAL->journal_file = NULL;
+    if (result == 0)
+        remove(JOURNAL->journal_path);
+
+    overlay_clear();
+    JOURNAL->journal_depth = 0;
+    JOURNAL->pending_commands = 0;
+    JOURNAL->pending_frees = 0;
+    return result;
+}
+
+int journal_enabled(void)
+{
+    return JOURNAL->journal_file != NULL;
+}
+
+void journal_begin(void)
+{
+    if (JOURNAL->journal_file)
+        JOURNAL->journal_depth++;
+}
+
+int journal_end(void)
+{
+    if (!JOURNAL->journal_file || JOURNAL->journal_depth == 0 || --JOURNAL->journal_depth > 0)
+        return 0;
+
+    // Group commit: one transaction and one fsync for several commands
+    int result = 0;
+    if (++JOURNAL->pending_commands >= JOURNAL_GROUP_COMMANDS)
+        result = journal_commit();
+    if (result == 0 && JOURNAL->overlay_count >= JOURNAL_CHECKPOINT_SECTORS)
+        result = journal_checkpoint();
+    return result;
+}
+
+int journal_capturing(uint32_t sector, uint32_t count)
+{
+    if (!JOURNAL->journal_file || JOURNAL->checkpointing)
+        return 0;
+    if (JOURNAL->journal_depth > 0)
+        return 1;
+
+    // A write outside a bracket must not be shadowed by an older logged copy
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (overlay_find(sector + i) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+int journal_log(uint32_t sector, uint32_t count, const void *buffer)
+{
+    const uint8_t *in = buffer;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (overlay_store(sector + i, in + (size_t)i * bs.bytesPerSector) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+int journal_overlay(uint32_t sector, uint32_t count, void *buffer)
+{
+    if (JOURNAL->overlay_count == 0)
+        return 0;
+
+    uint8_t *out = buffer;
+    int patched = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int index = overlay_find(sector + i);
+        if (index >= 0)
+        {
+            memcpy(out + (size_t)i * bs.bytesPerSector, JOURNAL->overlay_data + (size_t)index * bs.bytesPerSector, bs.bytesPerSector);
+            patched++;
+        }
+    }
+    return patched;
+}
+
+int journal_covers(uint32_t sector, uint32_t count)
+{
+    if (JOURNAL->overlay_count == 0)
+        return 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (overlay_find(sector + i) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+void journal_note_free(void)
+{
+    if (JOURNAL->journal_file)
+        JOURNAL->pending_frees = 1;
+}
+
+int journal_barrier(void)
+{
+    // Clusters freed by an uncommitted group must not be overwritten in place
+    // before that group is durable, or a crash could bring back a chain that
+    // points at someone else's data
+    if (!JOURNAL->journal_file || !JOURNAL->pending_frees)
+        return 0;
+    return journal_commit();
+}
+
+// Drop a transaction that could not be written in full, so the next one is
+// appended where it would have started
+static void discard_partial(off_t start)
+{
+    if (start < 0)
+        return;
+    fseeko(JOURNAL->journal_file, start, SEEK_SET);
+    if (ftruncate(fileno(JOURNAL->journal_file), start) == 0)
+        clearerr(JOURNAL->journal_file);
+}
+
+// The group stays pending, frees included, until its transaction is durable
+int journal_commit(void)
+{
+    if (!JOURNAL->journal_file)
+        return 0;
+
+    uint32_t blocks = 0;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+        blocks += JOURNAL->overlay_pending[i];
+    if (blocks == 0)
+    {
+        JOURNAL->pending_commands = 0;
+        JOURNAL->pending_frees = 0;
+        return 0;
+    }
+
+    // Ordered: file data written in place must be durable before the
+    // metadata that refers to it
+    if (sync_image() != 0)
+        return -1;
+
+    off_t start = ftello(JOURNAL->journal_file);
+    JournalRecord record = {JOURNAL_MAGIC, JOURNAL_BLOCK, JOURNAL->journal_sequence, 0, 1, 0, 0};
+    uint32_t checksum = 2166136261u;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+    {
+        if (!JOURNAL->overlay_pending[i])
+            continue;
+        const uint8_t *block = JOURNAL->overlay_data + (size_t)i * bs.bytesPerSector;
+        record.sector = JOURNAL->overlay_sectors[i];
+        if (fwrite(&record, sizeof(record), 1, JOURNAL->journal_file) != 1 ||
+            fwrite(block, bs.bytesPerSector, 1, JOURNAL->journal_file) != 1)
+        {
+            discard_partial(start);
+            return -1;
+        }
+        checksum = fnv_update(checksum, &record.sector, sizeof(record.sector));
+        checksum = fnv_update(checksum, block, bs.bytesPerSector);
+    }
+
+    JournalRecord commit = {JOURNAL_MAGIC, JOURNAL_COMMIT, JOURNAL->journal_sequence, 0, blocks, checksum, 0};
+    if (fwrite(&commit, sizeof(commit), 1, JOURNAL->journal_file) != 1 || sync_file(JOURNAL->journal_file) != 0)
+    {
+        discard_partial(start);
+        return -1;
+    }
+
+    JOURNAL->journal_sequence++;
+    JOURNAL->pending_commands = 0;
+    JOURNAL->pending_frees = 0;
+    memset(JOURNAL->overlay_pending, 0, JOURNAL->overlay_count);
+    return 0;
+}
+
+static int compare_sectors(const void *a, const void *b)
+{
+    uint32_t sa = JOURNAL->overlay_sectors[*(const uint32_t *)a];
+    uint32_t sb = JOURNAL->overlay_sectors[*(const uint32_t *)b];
+    return sa < sb ? -1 : sa > sb;
+}
+
+int journal_checkpoint(void)
+{
+    if (!JOURNAL->journal_file)
+        return 0;
+    if (journal_commit() != 0)
+        return -1;
+    if (JOURNAL->overlay_count == 0)
+        return 0;
+
+    uint32_t *order = malloc(JOURNAL->overlay_count * sizeof(uint32_t));
+    if (!order)
+        return -1;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+        order[i] = i;
+    qsort(order, JOURNAL->overlay_count, sizeof(uint32_t), compare_sectors);
+
+    // Copy the logged sectors home in sector order
+    int result = 0;
+    JOURNAL->checkpointing = 1;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+    {
+        uint32_t index = order[i];
+        if (write_disk_sectors(JOURNAL->overlay_sectors[index], 1, JOURNAL->overlay_data + (size_t)index * bs.bytesPerSector) != 1)
+            result = -1;
+    }
+    JOURNAL->checkpointing = 0;
+    free(order);
+
+    // Only once the image holds everything may the journal be emptied
+    if (result != 0 || sync_image() != 0)
+        return -1;
+    if (ftruncate(fileno(JOURNAL->journal_file), 0) != 0 || write_header() != 0)
+        return -1;
+
+    overlay_clear();
+    return 0;
+}
+
+void journal_get_stats(JournalStats *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->enabled = JOURNAL->journal_file != NULL;
+    out->path = JOURNAL->journal_path;
+    out->pendingCommands = JOURNAL->pending_commands;
+    out->overlaySectors = JOURNAL->overlay_count;
+    out->nextSequence = JOURNAL->journal_sequence;
+    for (uint32_t i = 0; i < JOURNAL->overlay_count; i++)
+        out->pendingSectors += JOURNAL->overlay_pending[i];
+}
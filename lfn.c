@@ -0,0 +1,448 @@
+#include "mfs.h"
+#include "struct.h"
+
+// VFAT long file names. A long name is kept in a run of entries with the
+// attribute byte 0x0F just ahead of the 8.3 entry it belongs to, last part
+// first, 13 UCS-2 characters to a part. Every part carries a checksum of the
+// 8.3 name, so a run left stale by a tool that only knows 8.3 names is not
+// taken for the name of whatever entry now follows it. In memory long names
+// are UTF-8, and they are compared folded to lower case, much as 8.3 names
+// are folded to upper case on the way in.
+
+// Characters allowed in an 8.3 name besides letters and digits
+static const char short_extra[] = "$%'-_@~`!(){}^#&";
+
+// Characters never allowed in a long name, besides controls
+static const char long_forbidden[] = "\"*/:<>?\\|";
+
+static uint8_t *part_char(LfnEntry *part, int k)
+{
+    if (k < 5)
+        return part->LDIR_Name1 + 2 * k;
+    if (k < 11)
+        return part->LDIR_Name2 + 2 * (k - 5);
+    return part->LDIR_Name3 + 2 * (k - 11);
+}
+
+static uint16_t get_char(const LfnEntry *part, int k)
+{
+    const uint8_t *p = part_char((LfnEntry *)part, k);
+    return p[0] | (p[1] << 8);
+}
+
+static void set_char(LfnEntry *part, int k, uint16_t unit)
+{
+    uint8_t *p = part_char(part, k);
+    p[0] = unit & 0xFF;
+    p[1] = unit >> 8;
+}
+
+uint8_t lfn_checksum(const char *short_name)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+    return sum;
+}
+
+static int short_char(char c)
+{
+    return (unsigned char)c < 0x80 && c != '\0' && (isalnum((unsigned char)c) || strchr(short_extra, c));
+}
+
+// A name needs a long entry unless it fits 8.3 as it is: at most eight
+// characters, one dot, up to three more, and nothing outside the 8.3 set.
+// Case does not count; 8.3 names are stored in upper case.
+int lfn_needed(const char *name)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > 8 || ext > 3 || (dot && (ext == 0 || strchr(dot + 1, '.'))))
+        return 1;
+
+    for (const char *p = name; *p; p++)
+    {
+        if (p != dot && !short_char(*p))
+            return 1;
+    }
+    return 0;
+}
+
+// UTF-8 to UCS-2, with characters beyond the first plane as surrogate
+// pairs. Returns the number of units, or -1 if the name is not valid UTF-8,
+// has a character a long name may not hold, or is too long.
+static int utf8_to_ucs2(const char *name, uint16_t *units, int max_units)
+{
+    const uint8_t *p = (const uint8_t *)name;
+    int length = 0;
+
+    while (*p)
+    {
+        uint32_t code;
+        int extra;
+        if (*p < 0x80)
+        {
+            code = *p;
+            extra = 0;
+        }
+        else if ((*p & 0xE0) == 0xC0)
+        {
+            code = *p & 0x1F;
+            extra = 1;
+        }
+        else if ((*p & 0xF0) == 0xE0)
+        {
+            code = *p & 0x0F;
+            extra = 2;
+        }
+        else if ((*p & 0xF8) == 0xF0)
+        {
+            code = *p & 0x07;
+            extra = 3;
+        }
+        else
+        {
+            return -1;
+        }
+        p++;
+        for (int i = 0; i < extra; i++, p++)
+        {
+            if ((*p & 0xC0) != 0x80)
+                return -1;
+            code = (code << 6) | (*p & 0x3F);
+        }
+
+        if (code < 0x20 || (code < 0x80 && strchr(long_forbidden, (int)code)) || code > 0x10FFFF ||
+            (code >= 0xD800 && code < 0xE000))
+            return -1;
+
+        if (code >= 0x10000)
+        {
+            if (length + 2 > max_units)
+                return -1;
+            code -= 0x10000;
+            units[length++] = 0xD800 | (code >> 10);
+            units[length++] = 0xDC00 | (code & 0x3FF);
+        }
+        else
+        {
+            if (length + 1 > max_units)
+                return -1;
+            units[length++] = code;
+        }
+    }
+    return length;
+}
+
+static int put_utf8(char *name, size_t size, size_t *used, uint32_t code)
+{
+    char bytes[4];
+    size_t count;
+    if (code < 0x80)
+    {
+        bytes[0] = code;
+        count = 1;
+    }
+    else if (code < 0x800)
+    {
+        bytes[0] = 0xC0 | (code >> 6);
+        bytes[1] = 0x80 | (code & 0x3F);
+        count = 2;
+    }
+    else if (code < 0x10000)
+    {
+        bytes[0] = 0xE0 | (code >> 12);
+        bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[2] = 0x80 | (code & 0x3F);
+        count = 3;
+    }
+    else
+    {
+        bytes[0] = 0xF0 | (code >> 18);
+        bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+        bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+        bytes[3] = 0x80 | (code & 0x3F);
+        count = 4;
+    }
+    if (*used + count >= size)
+        return -1;
+    memcpy(name + *used, bytes, count);
+    *used += count;
+    return 0;
+}
+
+// UCS-2 up to the first NUL to UTF-8. A name that a host could not take as
+// one path component is refused.
+static int ucs2_to_utf8(const uint16_t *units, uint32_t length, char *name, size_t size)
+{
+    size_t used = 0;
+    for (uint32_t i = 0; i < length && units[i] != 0; i++)
+    {
+        uint32_t code = units[i];
+        if (code >= 0xD800 && code < 0xDC00 && i + 1 < length && units[i + 1] >= 0xDC00 && units[i + 1] < 0xE000)
+        {
+            code = 0x10000 + ((code - 0xD800) << 10) + (units[i + 1] - 0xDC00);
+            i++;
+        }
+        if (code < 0x20 || code == '/' || put_utf8(name, size, &used, code) != 0)
+            return -1;
+    }
+    name[used] = '\0';
+
+    if (used == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -1;
+    return 0;
+}
+
+int lfn_entry_count(const char *name)
+{
+    uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    int length = utf8_to_ucs2(name, units, 255);
+    if (length <= 0)
+        return -1;
+    return (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+}
+
+int lfn_make_entries(const char *name, const char *short_name, DirEntry *parts)
+{
+    uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    int length = utf8_to_ucs2(name, units, 255);
+    if (length <= 0)
+        return -1;
+
+    // A short last part ends in a NUL and is padded with 0xFFFF
+    int count = (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    for (int i = length; i < count * LFN_CHARS_PER_ENTRY; i++)
+        units[i] = i == length ? 0x0000 : 0xFFFF;
+
+    uint8_t checksum = lfn_checksum(short_name);
+    for (int i = 0; i < count; i++)
+    {
+        int ordinal = count - i;
+        LfnEntry *part = (LfnEntry *)&parts[i];
+        memset(part, 0, sizeof(LfnEntry));
+        part->LDIR_Ord = ordinal | (i == 0 ? LFN_LAST_ENTRY : 0);
+        part->LDIR_Attr = ATTRIBUTE_LONG_NAME;
+        part->LDIR_Chksum = checksum;
+        for (int k = 0; k < LFN_CHARS_PER_ENTRY; k++)
+            set_char(part, k, units[(ordinal - 1) * LFN_CHARS_PER_ENTRY + k]);
+    }
+    return count;
+}
+
+void lfn_reset(LfnBuilder *builder)
+{
+    builder->count = 0;
+    builder->next = 0;
+}
+
+void lfn_feed(LfnBuilder *builder, const DirEntry *entry)
+{
+    const LfnEntry *part = (const LfnEntry *)entry;
+    uint8_t ordinal = part->LDIR_Ord & ~LFN_LAST_ENTRY;
+
+    if (part->LDIR_Ord == 0xE5 || ordinal == 0 || ordinal > LFN_MAX_ENTRIES)
+    {
+        lfn_reset(builder);
+        return;
+    }
+
+    // The part stored first starts a run; the rest must count down to 1
+    if (part->LDIR_Ord & LFN_LAST_ENTRY)
+    {
+        builder->count = ordinal;
+        builder->checksum = part->LDIR_Chksum;
+    }
+    else if (builder->count == 0 || ordinal != builder->next || part->LDIR_Chksum != builder->checksum)
+    {
+        lfn_reset(builder);
+        return;
+    }
+
+    uint16_t *units = builder->units + (ordinal - 1) * LFN_CHARS_PER_ENTRY;
+    for (int k = 0; k < LFN_CHARS_PER_ENTRY; k++)
+        units[k] = get_char(part, k);
+    builder->next = ordinal - 1;
+}
+
+int lfn_take(LfnBuilder *builder, const DirEntry *entry, char *name, size_t size)
+{
+    int whole = builder->count > 0 && builder->next == 0 && (uint8_t)entry->DIR_Name[0] != 0xE5 &&
+                builder->checksum == lfn_checksum(entry->DIR_Name);
+    uint32_t length = builder->count * LFN_CHARS_PER_ENTRY;
+    lfn_reset(builder);
+
+    return whole && ucs2_to_utf8(builder->units, length, name, size) == 0;
+}
+
+// Lower case of a character, for the alphabets whose case pairs sit at a
+// fixed distance: ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic
+static uint32_t fold_char(uint32_t code)
+{
+    if (code < 0x80)
+        return tolower((int)code);
+    if ((code >= 0xC0 && code <= 0xDE && code != 0xD7) || (code >= 0x391 && code <= 0x3AB && code != 0x3A2) ||
+        (code >= 0x410 && code <= 0x42F))
+        return code + 0x20;
+    if (code >= 0x400 && code <= 0x40F)
+        return code + 0x50;
+    // U+0130 (capital I with dot) has no partner at U+0131, which is the
+    // dotless small i, so it folds to itself
+    if ((code >= 0x100 && code <= 0x137 && code != 0x130) || (code >= 0x14A && code <= 0x177))
+        return code | 1;
+    if ((code >= 0x139 && code <= 0x148) || (code >= 0x179 && code <= 0x17E))
+        return code + (code & 1);
+    return code;
+}
+
+void lfn_fold(const char *name, char *folded, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)name;
+    size_t used = 0;
+
+    while (*p)
+    {
+        // Two-byte sequences hold every character folded here but ASCII
+        uint32_t code = *p;
+        int length = 1;
+        if ((p[0] & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80)
+        {
+            code = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            length = 2;
+        }
+
+        if (length == 2 && put_utf8(folded, size, &used, fold_char(code)) == 0)
+        {
+            p += 2;
+            continue;
+        }
+        if (used + 1 >= size)
+            break;
+        folded[used++] = length == 1 ? fold_char(code) : *p;
+        p++;
+    }
+    folded[used] = '\0';
+}
+
+// The 8.3 form of a long name's characters: upper case, with anything an
+// 8.3 name cannot hold turned into '_' and spaces and dots dropped
+static size_t basis(const char *from, const char *to, char *out, size_t max)
+{
+    size_t used = 0;
+    for (const char *p = from; p < to && used < max; p++)
+    {
+        if (*p == ' ' || *p == '.' || ((unsigned char)*p & 0xC0) == 0x80)
+            continue; // a UTF-8 character turns into one '_', from its lead byte
+        out[used++] = short_char(*p) ? toupper((unsigned char)*p) : '_';
+    }
+    return used;
+}
+
+// del overwrites the ordinal of every part with 0xE5, so a deleted run is
+// collected in on-disk order and numbered by position when it is taken
+void lfn_feed_deleted(LfnBuilder *builder, const DirEntry *entry)
+{
+    const LfnEntry *part = (const LfnEntry *)entry;
+    if (part->LDIR_Ord != 0xE5)
+    {
+        lfn_reset(builder);
+        return;
+    }
+    if (builder->count == 0 || builder->count == LFN_MAX_ENTRIES || part->LDIR_Chksum != builder->checksum)
+    {
+        builder->count = 0;
+        builder->checksum = part->LDIR_Chksum;
+    }
+
+    uint16_t *units = builder->units + builder->count * LFN_CHARS_PER_ENTRY;
+    for (int k = 0; k < LFN_CHARS_PER_ENTRY; k++)
+        units[k] = get_char(part, k);
+    builder->count++;
+}
+
+// The long name of a deleted 8.3 entry, and the first letter that makes the
+// entry's name match the long name's checksum. That letter is taken from the
+// long name the way an alias starts; a run whose checksum it does not match
+// belongs to some other entry and is not used.
+int lfn_take_deleted(LfnBuilder *builder, const DirEntry *entry, char *name, size_t size, char *lead)
+{
+    uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    uint32_t count = builder->count;
+    for (uint32_t i = 0; i < count; i++)
+        memcpy(units + (count - 1 - i) * LFN_CHARS_PER_ENTRY, builder->units + i * LFN_CHARS_PER_ENTRY,
+               LFN_CHARS_PER_ENTRY * sizeof(uint16_t));
+    uint8_t checksum = builder->checksum;
+    lfn_reset(builder);
+
+    if (count == 0 || (uint8_t)entry->DIR_Name[0] != 0xE5 ||
+        ucs2_to_utf8(units, count * LFN_CHARS_PER_ENTRY, name, size) != 0)
+        return 0;
+
+    const char *start = name;
+    while (*start == '.' || *start == ' ')
+        start++;
+    const char *dot = strrchr(start, '.');
+    char first = '_';
+    basis(start, dot ? dot : start + strlen(start), &first, 1);
+
+    char short_name[11];
+    memcpy(short_name, entry->DIR_Name, 11);
+    short_name[0] = first;
+    if (lfn_checksum(short_name) != checksum)
+        return 0;
+    *lead = first;
+    return 1;
+}
+
+// Pick a free 8.3 name for a long name, "BASIS~N.EXT" with the smallest N
+// that taken() does not claim. Returns 0, or -1 if every N is taken.
+int lfn_pick_alias(const char *name, int (*taken)(const char *short_name, void *context), void *context,
+                   char *short_name)
+{
+    const char *start = name;
+    while (*start == '.' || *start == ' ')
+        start++;
+    const char *dot = strrchr(start, '.');
+    const char *end = dot ? dot : start + strlen(start);
+
+    char base[8];
+    size_t base_length = basis(start, end, base, sizeof(base));
+    if (base_length == 0)
+        base[base_length++] = '_';
+
+    memset(short_name, ' ', 11);
+    short_name[11] = '\0';
+    if (dot)
+        basis(dot + 1, dot + strlen(dot), short_name + 8, 3);
+
+    for (uint32_t n = 1; n < 1000000; n++)
+    {
+        char tail[8];
+        size_t tail_length = snprintf(tail, sizeof(tail), "~%u", n);
+        size_t keep = base_length + tail_length > 8 ? 8 - tail_length : base_length;
+
+        memset(short_name, ' ', 8);
+        memcpy(short_name, base, keep);
+        memcpy(short_name + keep, tail, tail_length);
+
+        if (!taken(short_name, context))
+            return 0;
+    }
+    return -1;
+}
+
+static int taken_in_dir(const char *short_name, void *context)
+{
+    DirEntry existing;
+    return find_file_entry(short_name, *(uint32_t *)context, &existing);
+}
+
+// The same for a name going into a directory on the image
+int lfn_make_alias(const char *name, uint32_t dir_cluster, char *short_name)
+{
+    return lfn_pick_alias(name, taken_in_dir, &dir_cluster, short_name);
+}
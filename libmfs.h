@@ -0,0 +1,62 @@
+#ifndef LIBMFS_H
+#define LIBMFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libmfs: the FAT32 engine behind the mfs shell, usable on its own. Every
+// open image is an mfs_fs handle. Any number of threads may call
+// mfs_lookup(), mfs_list() and mfs_read() on one handle at once; the other
+// calls wait for them and then run alone. A handle must not be closed while
+// other threads are still using it. Calls return 0 (or a count) on success
+// and -1 on failure, with the reason in mfs_last_error().
+#define MFS_OPEN_PREAD 0x01   // pread/pwrite on the image instead of a mapping
+#define MFS_OPEN_JOURNAL 0x02 // journal metadata updates
+
+typedef struct mfs_fs mfs_fs;
+
+// A directory entry as stored on the image
+typedef struct
+{
+    char DIR_Name[11];
+    uint8_t DIR_Attr;
+    uint8_t DIR_NTRes;
+    uint8_t DIR_CrtTimeTenth;
+    uint16_t DIR_CrtTime;
+    uint16_t DIR_CrtDate;
+    uint16_t DIR_LstAccDate;
+    uint16_t DIR_FstClusHI;
+    uint16_t DIR_WrtTime;
+    uint16_t DIR_WrtDate;
+    uint16_t DIR_FstClusLO;
+    uint32_t DIR_FileSize;
+} __attribute__((packed)) DirEntry;
+
+mfs_fs *mfs_open(const char *image, int flags);
+void mfs_close(mfs_fs *fs); // syncs, then frees the handle
+int mfs_sync(mfs_fs *fs);
+
+// Copies the handle's latest failure into buffer, cut to size; returns the
+// message's full length
+int mfs_last_error(mfs_fs *fs, char *buffer, size_t size);
+
+// Paths are relative to the handle's working directory unless they start
+// with a slash
+int mfs_chdir(mfs_fs *fs, const char *path);
+int mfs_lookup(mfs_fs *fs, const char *path, DirEntry *entry);
+int mfs_list(mfs_fs *fs, const char *path, DirEntry **entries, uint32_t *count); // caller frees *entries
+
+// Bytes read (short only at end of file), or -1
+int64_t mfs_read(mfs_fs *fs, const char *path, uint64_t offset, void *buffer, uint32_t length);
+
+// Create a file in the working directory from a buffer
+int mfs_write(mfs_fs *fs, const char *name, const void *data, uint32_t size);
+
+// Lower level: a handle with no image, for front ends that open and close
+// images themselves through open_filesystem() and friends once mfs_use() has
+// made it the calling thread's current filesystem
+mfs_fs *mfs_create(void);
+void mfs_destroy(mfs_fs *fs);
+void mfs_use(mfs_fs *fs);
+
+#endif // LIBMFS_H
@@ -1,13 +1,15 @@
 #include "mfs.h"
 #include "struct.h"
 
-// Add these global variables
-uint32_t current_dir_cluster;
+#include <fnmatch.h>
+#include <getopt.h>
 
-// Global variables
-FILE *disk_img = NULL;
-BootSector bs;
-char current_image_name[Mx_FILENAME_LENGTH];
+// The shell: a front end over libmfs working on one filesystem context.
+// Commands report errors through print_error(), which marks the context
+// failed; batch mode checks that after each command.
+
+// Set when quit or exit is entered
+static int quit_requested = 0;
 
 //------------------------------------------------------------------------------------------------
 
@@ -16,554 +18,225 @@ int open_filesystem(const char *imageFilename);
 void close_filesystem(void);
 void display_filesystem_info(void);
 void execute_command(char *commandLine);
+void print_cache_stats(void);
+void print_journal_status(void);
+void print_stats(void);
+void print_stats_json(FILE *out);
+void set_cache_size(int blocks);
 
 // Additional function prototypes for file and directory management
-uint32_t get_first_sector_of_cluster(uint32_t clusterNumber);
-uint32_t get_fat_entry(uint32_t clusterNumber);
-void convert_to_fat_filename(const char *input, char *output);
-DirEntry *find_file_entry_entry(const char *filename, uint32_t directoryCluster);
 void list_directory_entries(uint32_t clusterNumber);
-int read_disk_sector(uint32_t sector, void *buffer);
-int write_disk_sector(uint32_t sector, const void *buffer);
 void upload_file(const char *sourceFile, const char *newFilename);
 
-// Additional functions for FAT management
-void update_fat_entry(uint32_t clusterNumber, uint32_t value);
+// Additional functions for file content management
 void read_file_content(const char *filename, uint32_t startPosition, uint32_t byteCount, int format);
 void delete_file(const char *filename);
-void restore_deleted_file(const char *filename);
-DirEntry* find_deleted_file_entry(const char* filename, uint32_t clusterNumber, uint32_t* sectorNum, int* entryIdx, int includeDeleted);
-
-
-// Implementation of new utility functions
-
-// Add this implementation with your other utility functions
-void update_fat_entry(uint32_t cluster, uint32_t value)
-{
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = bs.reservedSectorCount + (fat_offset / bs.bytesPerSector);
-    uint32_t ent_offset = fat_offset % bs.bytesPerSector;
-
-    uint8_t buffer[SECTOR_SIZE];
-
-    // Read the FAT sector
-    if (read_disk_sector(fat_sector, buffer) != 1)
-    {
-        return;
-    }
-
-    // Update the entry
-    uint32_t *fat_entry = (uint32_t *)(&buffer[ent_offset]);
-    *fat_entry = (*fat_entry & 0xF0000000) | (value & 0x0FFFFFFF);
-
-    // Write the sector back to all FATs
-    for (int i = 0; i < bs.numberOfFATs; i++)
-    {
-        uint32_t current_fat_sector = fat_sector + (i * bs.fatSize32);
-        write_disk_sector(current_fat_sector, buffer);
-    }
-}
 
-uint32_t get_first_sector_of_cluster(uint32_t cluster)
-{
-    uint32_t first_data_sector = bs.reservedSectorCount + (bs.numberOfFATs * bs.fatSize32);
-    return first_data_sector + ((cluster - 2) * bs.sectorsPerCluster);
-}
-
-uint32_t get_fat_entry(uint32_t cluster)
-{
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = bs.reservedSectorCount + (fat_offset / bs.bytesPerSector);
-    uint32_t ent_offset = fat_offset % bs.bytesPerSector;
-
-    uint8_t buffer[SECTOR_SIZE];
-    read_disk_sector(fat_sector, buffer);
-
-    uint32_t entry = *(uint32_t *)(&buffer[ent_offset]);
-    return entry & 0x0FFFFFFF;
-}
-
-void convert_to_fat_filename(const char *input, char *expanded)
-{
-    memset(expanded, ' ', 11);
-    expanded[11] = '\0';
-
-    char *token = strtok((char *)input, ".");
-    if (token)
-    {
-        int len = strlen(token);
-        if (len > 8)
-            len = 8;
-        memcpy(expanded, token, len);
-
-        token = strtok(NULL, ".");
-        if (token)
-        {
-            len = strlen(token);
-            if (len > 3)
-                len = 3;
-            memcpy(expanded + 8, token, len);
-        }
-    }
-
-    for (int i = 0; i < 11; i++)
-    {
-        expanded[i] = toupper(expanded[i]);
-    }
-}
-
-// Implementation of read_disk_sector
-int read_disk_sector(uint32_t sector, void *buffer)
-{
-    if (!disk_img)
-        return -1;
-    fseek(disk_img, sector * bs.bytesPerSector, SEEK_SET);
-    return fread(buffer, bs.bytesPerSector, 1, disk_img);
-}
-
-// Implementation of write_disk_sector
-int write_disk_sector(uint32_t sector, const void *buffer)
-{
-    if (!disk_img)
-        return -1;
-    fseek(disk_img, sector * bs.bytesPerSector, SEEK_SET);
-    return fwrite(buffer, bs.bytesPerSector, 1, disk_img);
-}
-
-DirEntry *find_file_entry(const char *filename, uint32_t dir_cluster)
-{
-    static DirEntry dir_entry;
-    static uint8_t buffer[SECTOR_SIZE];
-
-    uint32_t sector = get_first_sector_of_cluster(dir_cluster);
-
-    while (1)
-    {
-        read_disk_sector(sector, buffer);
-        DirEntry *dir = (DirEntry *)buffer;
-
-        for (int i = 0; i < bs.bytesPerSector / sizeof(DirEntry); i++)
-        {
-            if (dir[i].DIR_Name[0] == 0x00)
-                return NULL; // End of directory
-            if (dir[i].DIR_Name[0] == 0xE5)
-                continue; // Deleted entry
-
-            if (strncmp((char *)dir[i].DIR_Name, filename, 11) == 0)
-            {
-                memcpy(&dir_entry, &dir[i], sizeof(DirEntry));
-                return &dir_entry;
-            }
-        }
-
-        uint32_t next_cluster = get_fat_entry(dir_cluster);
-        if (next_cluster >= EOC)
-            break;
-
-        dir_cluster = next_cluster;
-        sector = get_first_sector_of_cluster(dir_cluster);
-    }
-
-    return NULL;
-}
-// Implementation of new command functions
-
-DirEntry* find_deleted_file_entry(const char* filename, uint32_t cluster, uint32_t* sector_num, int* entry_index, int include_deleted) {
-    static DirEntry dir_entry;
-    static uint8_t buffer[SECTOR_SIZE];
-    
-    while (1) {
-        uint32_t sector = get_first_sector_of_cluster(cluster);
-        for (uint32_t i = 0; i < bs.sectorsPerCluster; i++) {
-            if (read_disk_sector(sector + i, buffer) != 1) {
-                return NULL;
-            }
-
-            DirEntry* dir = (DirEntry*)buffer;
-            for (int j = 0; j < bs.bytesPerSector / sizeof(DirEntry); j++) {
-                // Check for end of directory
-                if (dir[j].DIR_Name[0] == 0x00) {
-                    return NULL;
-                }
-
-                // For deleted files
-                if (dir[j].DIR_Name[0] == 0xE5 && include_deleted) {
-                    // Compare the rest of the name (skip first character)
-                    if (memcmp(dir[j].DIR_Name + 1, filename + 1, 10) == 0) {
-                        if (sector_num) *sector_num = sector + i;
-                        if (entry_index) *entry_index = j;
-                        memcpy(&dir_entry, &dir[j], sizeof(DirEntry));
-                        return &dir_entry;
-                    }
-                }
-                // For normal files
-                else if (dir[j].DIR_Name[0] != 0xE5 && !include_deleted) {
-                    if (strncmp((char*)dir[j].DIR_Name, filename, 11) == 0) {
-                        if (sector_num) *sector_num = sector + i;
-                        if (entry_index) *entry_index = j;
-                        memcpy(&dir_entry, &dir[j], sizeof(DirEntry));
-                        return &dir_entry;
-                    }
-                }
-            }
-        }
-
-        // Move to next cluster
-        uint32_t next_cluster = get_fat_entry(cluster);
-        if (next_cluster >= EOC) break;
-        cluster = next_cluster;
-    }
-    
-    return NULL;
-}
 
 void delete_file(const char* filename) {
-    if (!disk_img) {
-        printf("Error: File system not open\n");
+    if (disk_fd < 0) {
+        print_error("File system not open\n");
         return;
     }
 
-    char expanded_name[12];
-    convert_to_fat_filename(filename, expanded_name);
-
     uint32_t sector_num;
-    int entry_index;
-    DirEntry* entry = find_deleted_file_entry(expanded_name, current_dir_cluster, &sector_num, &entry_index, 0);
-
-    if (!entry) {
-        printf("Error: File not found\n");
+    uint32_t entry_index;
+    DirEntry entry;
+    if (!dir_find_name(current_dir_cluster, filename, &entry, &sector_num, &entry_index)) {
+        print_error("File not found\n");
         return;
     }
 
-    if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY) {
-        printf("Error: Cannot delete a directory\n");
+    if (entry.DIR_Attr & ATTRIBUTE_DIRECTORY) {
+        print_error("Cannot delete a directory\n");
         return;
     }
 
-    // Read sector containing the entry
-    uint8_t buffer[SECTOR_SIZE];
-    if (read_disk_sector(sector_num, buffer) != 1) {
-        printf("Error: Could not read sector\n");
+    // Mark file as deleted, along with its long name
+    journal_begin();
+    int marked = dir_mark_deleted(current_dir_cluster, sector_num, entry_index);
+    journal_end();
+    if (marked != 0) {
+        print_error("Could not write sector\n");
         return;
     }
 
-    // Mark file as deleted
-    DirEntry* dir = (DirEntry*)buffer;
-    dir[entry_index].DIR_Name[0] = 0xE5;
-
-    // Write back the modified sector
-    if (write_disk_sector(sector_num, buffer) != 1) {
-        printf("Error: Could not write sector\n");
-        return;
-    }
+    // The live name is gone and a deleted entry took its place
+    dir_index_remove(current_dir_cluster, entry.DIR_Name);
+    entry.DIR_Name[0] = 0xE5;
+    dir_index_add(current_dir_cluster, entry.DIR_Name, sector_num, entry_index);
 
     printf("File deleted successfully\n");
 }
 
-void restore_deleted_file(const char* filename) {
-    if (!disk_img) {
-        printf("Error: File system not open\n");
-        return;
-    }
-
-    char expanded_name[12];
-    convert_to_fat_filename(filename, expanded_name);
-
-    uint32_t sector_num;
-    int entry_index;
-    DirEntry* entry = find_deleted_file_entry(expanded_name, current_dir_cluster, &sector_num, &entry_index, 1);
-
-    if (!entry) {
-        printf("Error: Deleted file not found\n");
-        return;
-    }
-
-    // Read sector containing the entry
-    uint8_t buffer[SECTOR_SIZE];
-    if (read_disk_sector(sector_num, buffer) != 1) {
-        printf("Error: Could not read sector\n");
-        return;
-    }
-
-    // Restore the file by setting the first character of the filename
-    DirEntry* dir = (DirEntry*)buffer;
-    dir[entry_index].DIR_Name[0] = expanded_name[0];
-
-    // Write back the modified sector
-    if (write_disk_sector(sector_num, buffer) != 1) {
-        printf("Error: Could not write sector\n");
-        return;
-    }
-
-    printf("File restored successfully\n");
-}
-
 
 void read_file_content(const char *filename, uint32_t position, uint32_t num_bytes, int format)
 {
-    if (!disk_img)
+    if (disk_fd < 0)
     {
-        printf("Error: File system not open\n");
+        print_error("File system not open\n");
         return;
     }
 
-    char expanded_name[12];
-    convert_to_fat_filename(filename, expanded_name);
-
-    DirEntry *entry = find_file_entry(expanded_name, current_dir_cluster);
-    if (!entry)
+    DirEntry found;
+    DirEntry *entry = &found;
+    if (!path_find_entry(filename, entry, NULL))
     {
-        printf("Error: File not found\n");
+        print_error("File not found\n");
         return;
     }
 
     if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
     {
-        printf("Error: Cannot read a directory\n");
+        print_error("Cannot read a directory\n");
         return;
     }
 
     if (position >= entry->DIR_FileSize)
     {
-        printf("Error: Position outside file bounds\n");
+        print_error("Position outside file bounds\n");
         return;
     }
 
     // Adjust num_bytes if it would read past end of file
-    if (position + num_bytes > entry->DIR_FileSize)
+    if (num_bytes > entry->DIR_FileSize - position)
     {
         num_bytes = entry->DIR_FileSize - position;
     }
 
     uint32_t cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
     uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
-    uint32_t clusters_to_skip = position / bytes_per_cluster;
 
-    // Skip to the correct cluster
-    for (uint32_t i = 0; i < clusters_to_skip && cluster < EOC; i++)
+    // Seek through the cached extent map rather than walking the chain
+    const ExtentMap *map = extent_map_get(cluster);
+    if (!map || extent_map_lookup(map, position / bytes_per_cluster, NULL) == 0)
     {
-        cluster = get_fat_entry(cluster);
+        print_error("Invalid cluster chain\n");
+        extent_map_put(map);
+        return;
     }
 
-    if (cluster >= EOC)
+    // A fragmented file is read ahead along its runs, so the next reads are
+    // in flight while each piece is formatted
+    uint32_t run_count;
+    const Extent *runs = extent_map_runs(map, &run_count);
+    ReadAhead *ra = NULL;
+    if (run_count > 1 && readahead_depth() > 0 && disk_prepare_fd_io() == 0)
+        ra = readahead_open(runs, run_count, position, num_bytes);
+    if (ra)
     {
-        printf("Error: Invalid cluster chain\n");
+        const uint8_t *data;
+        uint32_t length;
+        int more;
+        while ((more = readahead_next(ra, &data, &length)) == 1)
+            write_formatted(data, length, format, stdout);
+        readahead_close(ra);
+        extent_map_put(map);
+
+        if (format != FORMAT_RAW)
+            printf("\n");
+        if (more < 0)
+            print_error("Could not read cluster\n");
         return;
     }
 
-    uint8_t *buffer = malloc(num_bytes);
-    if (!buffer)
+    uint32_t chunk_limit = num_bytes < DISK_COPY_CHUNK ? num_bytes : DISK_COPY_CHUNK;
+    uint8_t *scratch = malloc(chunk_limit + 2 * bs.bytesPerSector);
+    if (!scratch)
     {
-        printf("Error: Memory allocation failed\n");
+        print_error("Memory allocation failed\n");
+        extent_map_put(map);
         return;
     }
 
     uint32_t bytes_read = 0;
-    uint32_t position_in_cluster = position % bytes_per_cluster;
 
-    while (bytes_read < num_bytes && cluster < EOC)
+    while (bytes_read < num_bytes)
     {
-        uint32_t sector = get_first_sector_of_cluster(cluster);
-        uint32_t sector_offset = position_in_cluster / bs.bytesPerSector;
-        uint32_t byte_offset = position_in_cluster % bs.bytesPerSector;
-
-        uint8_t sector_buffer[SECTOR_SIZE];
-        read_disk_sector(sector + sector_offset, sector_buffer);
-
-        uint32_t bytes_to_read = bs.bytesPerSector - byte_offset;
-        if (bytes_to_read > (num_bytes - bytes_read))
+        uint32_t offset = position + bytes_read;
+        uint32_t run_left;
+        uint32_t physical = extent_map_lookup(map, offset / bytes_per_cluster, &run_left);
+        if (physical == 0)
         {
-            bytes_to_read = num_bytes - bytes_read;
+            break;
         }
 
-        memcpy(buffer + bytes_read, sector_buffer + byte_offset, bytes_to_read);
-        bytes_read += bytes_to_read;
-        position_in_cluster = 0; // Reset for next cluster
-
-        if (bytes_read < num_bytes)
+        // Read as much of this contiguous run as is wanted, in one request
+        uint32_t offset_in_cluster = offset % bytes_per_cluster;
+        uint64_t run_bytes = (uint64_t)run_left * bytes_per_cluster - offset_in_cluster;
+        uint32_t bytes_to_read = num_bytes - bytes_read;
+        if (bytes_to_read > run_bytes)
+            bytes_to_read = run_bytes;
+        if (bytes_to_read > chunk_limit)
+            bytes_to_read = chunk_limit;
+
+        uint32_t sector = get_first_sector_of_cluster(physical) + offset_in_cluster / bs.bytesPerSector;
+        uint32_t byte_offset = offset_in_cluster % bs.bytesPerSector;
+        uint32_t sector_count = (byte_offset + bytes_to_read + bs.bytesPerSector - 1) / bs.bytesPerSector;
+
+        const uint8_t *data = disk_view_sectors(sector, sector_count, scratch);
+        if (!data)
         {
-            cluster = get_fat_entry(cluster);
+            break;
         }
+
+        // Format each chunk as it arrives instead of collecting the whole range
+        write_formatted(data + byte_offset, bytes_to_read, format, stdout);
+        bytes_read += bytes_to_read;
     }
+    free(scratch);
+    extent_map_put(map);
 
-    // Output the bytes in the specified format
-    for (uint32_t i = 0; i < bytes_read; i++)
+    if (format != FORMAT_RAW)
     {
-        switch (format)
-        {
-        case FORMAT_HEX:
-            printf("0x%02X ", buffer[i]);
-            break;
-        case FORMAT_ASCII:
-            printf("%c", buffer[i]);
-            break;
-        case FORMAT_DEC:
-            printf("%d ", buffer[i]);
-            break;
-        }
+        printf("\n");
     }
-    printf("\n");
-
-    free(buffer);
 }
 
 void upload_file(const char *filename, const char *newname) {
-    if (!disk_img) {
-        printf("Error: File system not open\n");
+    if (disk_fd < 0) {
+        print_error("File system not open\n");
         return;
     }
 
     // Open the source file from local directory
     FILE *src_file = fopen(filename, "rb");
     if (!src_file) {
-        printf("Error: File not found\n");
+        print_error("File not found\n");
         return;
     }
 
-    // Get file size
-    fseek(src_file, 0, SEEK_END);
-    uint32_t file_size = ftell(src_file);
-    fseek(src_file, 0, SEEK_SET);
-
-    // Prepare directory entry
-    DirEntry new_entry;
-    memset(&new_entry, 0, sizeof(DirEntry));
-    const char *entry_name = newname ? newname : filename;
-
-    // Expand the filename to FAT format
-    char expanded_name[12];
-    convert_to_fat_filename(entry_name, expanded_name);
-    memcpy(new_entry.DIR_Name, expanded_name, 11);
-
-    // Set attributes and size
-    new_entry.DIR_Attr = ATTRIBUTE_ARCHIVE;
-    new_entry.DIR_FileSize = file_size;
-
-    // Search for free entry in directory
-    uint32_t cluster = current_dir_cluster;
-    uint32_t sector;
-    uint8_t sector_buffer[SECTOR_SIZE];
-    int entry_found = 0;
-    int entry_index = 0;
-
-    while (!entry_found) {
-        sector = get_first_sector_of_cluster(cluster);
-        
-        // Search all sectors in current cluster
-        for (int sec = 0; sec < bs.sectorsPerCluster; sec++) {
-            if (read_disk_sector(sector + sec, sector_buffer) != 1) {
-                printf("Error: Could not read directory sector\n");
-                fclose(src_file);
-                return;
-            }
-
-            DirEntry *dir = (DirEntry *)sector_buffer;
-            for (int i = 0; i < bs.bytesPerSector / sizeof(DirEntry); i++) {
-                if (dir[i].DIR_Name[0] == 0x00 || dir[i].DIR_Name[0] == 0xE5) {
-                    entry_found = 1;
-                    entry_index = i;
-                    sector += sec;  // Update sector number
-                    break;
-                }
-            }
-            if (entry_found) break;
-        }
-
-        if (!entry_found) {
-            // Try next cluster
-            uint32_t next_cluster = get_fat_entry(cluster);
-            if (next_cluster >= EOC) {
-                // TODO: Allocate new cluster for directory
-                printf("Error: Directory full\n");
-                fclose(src_file);
-                return;
-            }
-            cluster = next_cluster;
-        }
-    }
-
-    // Rest of your existing code for copying file contents
-    uint8_t buffer[SECTOR_SIZE];
-    uint32_t bytes_remaining = file_size;
-    uint32_t current_cluster = 0;
-    uint32_t first_cluster = 0;
-
-    while (bytes_remaining > 0) {
-        size_t bytes_to_read = bytes_remaining < SECTOR_SIZE ? bytes_remaining : SECTOR_SIZE;
-        if (fread(buffer, 1, bytes_to_read, src_file) != bytes_to_read) {
-            printf("Error: Could not read source file\n");
-            fclose(src_file);
-            return;
-        }
-
-        if (current_cluster == 0) {
-            uint32_t fat_size = bs.fatSize32 * bs.bytesPerSector;
-            for (uint32_t i = 2; i < fat_size / 4; i++) {
-                if (get_fat_entry(i) == 0) {
-                    current_cluster = i;
-                    if (first_cluster == 0) {
-                        first_cluster = i;
-                    }
-                    break;
-                }
-            }
-        }
-
-        if (current_cluster == 0) {
-            printf("Error: No free clusters available\n");
-            fclose(src_file);
-            return;
-        }
-
-        uint32_t data_sector = get_first_sector_of_cluster(current_cluster);
-        if (write_disk_sector(data_sector, buffer) != 1) {
-            printf("Error: Could not write to filesystem\n");
-            fclose(src_file);
-            return;
-        }
-
-        bytes_remaining -= bytes_to_read;
-
-        if (bytes_remaining > 0) {
-            uint32_t next_cluster = current_cluster + 1;
-            update_fat_entry(current_cluster, bytes_remaining > 0 ? next_cluster : EOC);
-            current_cluster = next_cluster;
-        } else {
-            // Mark the last cluster as end of chain
-            update_fat_entry(current_cluster, EOC);
-        }
+    // Get file size; a FAT32 file holds at most 4 GiB - 1 bytes
+    fseeko(src_file, 0, SEEK_END);
+    off_t host_size = ftello(src_file);
+    fseeko(src_file, 0, SEEK_SET);
+    if (host_size < 0 || host_size > UINT32_MAX) {
+        print_error(host_size < 0 ? "Could not read source file\n" : "File too large: %s\n", filename);
+        fclose(src_file);
+        return;
     }
+    uint32_t file_size = host_size;
 
-    // Update directory entry
-    new_entry.DIR_FstClusLO = first_cluster & 0xFFFF;
-    new_entry.DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
-
-    // Write directory entry
-    memcpy(&((DirEntry *)sector_buffer)[entry_index], &new_entry, sizeof(DirEntry));
-    if (write_disk_sector(sector, sector_buffer) != 1) {
-        printf("Error: Could not update directory entry\n");
+    if (put_file(src_file, file_size, newname ? newname : path_basename(filename)) == 0) {
+        printf("File copied successfully\n");
     }
-
     fclose(src_file);
-    printf("File copied successfully\n");
 }
 
 
 void cmd_stat(const char *filename)
 {
-    if (!disk_img)
+    if (disk_fd < 0)
     {
-        printf("Error: File system not open\n");
+        print_error("File system not open\n");
         return;
     }
 
-    char expanded_name[12];
-    convert_to_fat_filename(filename, expanded_name);
-
-    DirEntry *entry = find_file_entry(expanded_name, current_dir_cluster);
-    if (!entry)
+    DirEntry found;
+    DirEntry *entry = &found;
+    if (!path_find_entry(filename, entry, NULL))
     {
-        printf("Error: File not found\n");
+        print_error("File not found\n");
         return;
     }
 
@@ -592,105 +265,337 @@ void cmd_stat(const char *filename)
     }
 }
 
-void cmd_get(const char *filename, const char *newname)
+// With several files, say which one each failure belongs to
+static void report_extract_failures(const ExtractJob *jobs, uint32_t count)
 {
-    if (!disk_img)
+    const char *separator = count > 1 ? ": " : "";
+    for (uint32_t i = 0; i < count; i++)
     {
-        printf("Error: File system not open\n");
-        return;
+        const char *name = count > 1 ? jobs[i].output : "";
+        switch (jobs[i].status)
+        {
+        case EXTRACT_CREATE_FAILED:
+            print_error("Cannot create output file%s%s\n", separator, name);
+            break;
+        case EXTRACT_READ_FAILED:
+            print_error("Could not read cluster%s%s\n", separator, name);
+            break;
+        case EXTRACT_NO_MEMORY:
+            print_error("Memory allocation failed%s%s\n", separator, name);
+            break;
+        }
     }
+}
 
-    char expanded_name[12];
-    convert_to_fat_filename(filename, expanded_name);
+static void free_extract_jobs(ExtractJob *jobs, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        free(jobs[i].output);
+    free(jobs);
+}
+
+static int has_wildcard(const char *name)
+{
+    return strpbrk(path_basename(name), "*?[") != NULL;
+}
 
-    DirEntry *entry = find_file_entry(expanded_name, current_dir_cluster);
-    if (!entry)
+static int add_get_job(ExtractJob **jobs, uint32_t *count, uint32_t *capacity, const DirEntry *entry, const char *output)
+{
+    if (*count == *capacity)
     {
-        printf("Error: File not found\n");
-        return;
+        uint32_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        ExtractJob *grown = realloc(*jobs, grown_capacity * sizeof(ExtractJob));
+        if (!grown)
+            return -1;
+        *jobs = grown;
+        *capacity = grown_capacity;
     }
 
-    if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
+    ExtractJob *job = &(*jobs)[*count];
+    job->output = strdup(output);
+    if (!job->output)
+        return -1;
+    job->firstCluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    job->size = entry->DIR_FileSize;
+    job->status = EXTRACT_OK;
+    (*count)++;
+    return 0;
+}
+
+// Queue every file in the pattern's directory whose name, long or 8.3,
+// matches it. The directory is read once, and reused for further patterns
+// naming it.
+static int queue_matches(const char *pattern, ExtractJob **jobs, uint32_t *count, uint32_t *capacity,
+                         uint32_t *listed_cluster, DirEntry **listed, char ***listed_names, uint32_t *listed_count)
+{
+    const char *base = path_basename(pattern);
+    uint32_t dir_cluster = current_dir_cluster;
+
+    if (base != pattern)
     {
-        printf("Error: Cannot get a directory\n");
-        return;
+        char dir_path[Mx_COMMAND_LENGTH];
+        size_t len = base - pattern;
+        memcpy(dir_path, pattern, len);
+        dir_path[len] = '\0';
+        if (path_resolve_dir(dir_path, &dir_cluster) != 0)
+        {
+            print_error("Directory not found\n");
+            return 0;
+        }
     }
 
-    const char *output_name = newname ? newname : filename;
-    FILE *outfile = fopen(output_name, "wb");
-    if (!outfile)
+    if (!*listed || *listed_cluster != dir_cluster)
     {
-        printf("Error: Cannot create output file\n");
-        return;
+        dir_free_names(*listed, *listed_names, *listed_count);
+        *listed = NULL;
+        *listed_names = NULL;
+        *listed_count = 0;
+        if (dir_read_names(dir_cluster, listed, listed_names, listed_count) != 0)
+        {
+            print_error("Could not read directory\n");
+            return 0;
+        }
+        *listed_cluster = dir_cluster;
     }
 
-    uint32_t cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-    uint32_t size_remaining = entry->DIR_FileSize;
-    uint8_t buffer[SECTOR_SIZE];
+    // Names are matched with case folded, as they are looked up
+    char folded_pattern[Mx_FILENAME_LENGTH];
+    lfn_fold(base, folded_pattern, sizeof(folded_pattern));
 
-    while (size_remaining > 0 && cluster < EOC)
+    int matched = 0;
+    for (uint32_t i = 0; i < *listed_count; i++)
     {
-        uint32_t sector = get_first_sector_of_cluster(cluster);
+        const DirEntry *entry = &(*listed)[i];
+        const char *name = (*listed_names)[i];
+        char folded[LFN_NAME_BYTES];
+
+        if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
+            continue;
+        lfn_fold(name, folded, sizeof(folded));
+        if (fnmatch(folded_pattern, folded, 0) != 0)
+            continue;
+        if (add_get_job(jobs, count, capacity, entry, name) != 0)
+            return -1;
+        matched++;
+    }
 
-        for (int i = 0; i < bs.sectorsPerCluster && size_remaining > 0; i++)
+    if (matched == 0)
+        print_error("No files match %s\n", pattern);
+    return 0;
+}
+
+static int compare_outputs(const void *a, const void *b)
+{
+    return strcmp(((const ExtractJob *)a)->output, ((const ExtractJob *)b)->output);
+}
+
+// Two jobs writing the same host file would truncate and write it at the
+// same time. A file named twice (say, by a name and by a pattern) is copied
+// once; different files with one output name are refused. Returns the jobs
+// left, in output name order.
+static uint32_t drop_duplicate_outputs(ExtractJob *jobs, uint32_t count)
+{
+    uint32_t kept = 0;
+
+    qsort(jobs, count, sizeof(ExtractJob), compare_outputs);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (kept > 0 && strcmp(jobs[kept - 1].output, jobs[i].output) == 0)
         {
-            read_disk_sector(sector + i, buffer);
-            uint32_t bytes_to_write = size_remaining < bs.bytesPerSector ? size_remaining : bs.bytesPerSector;
-            fwrite(buffer, 1, bytes_to_write, outfile);
-            size_remaining -= bytes_to_write;
+            if (jobs[kept - 1].firstCluster != jobs[i].firstCluster || jobs[kept - 1].size != jobs[i].size)
+            {
+                print_error("Several files would be written to %s\n", jobs[i].output);
+                jobs[kept - 1].status = EXTRACT_DUPLICATE;
+            }
+            free(jobs[i].output);
+            continue;
         }
-
-        cluster = get_fat_entry(cluster);
+        jobs[kept++] = jobs[i];
     }
 
-    fclose(outfile);
+    // Refused names are not written at all
+    uint32_t left = 0;
+    for (uint32_t i = 0; i < kept; i++)
+    {
+        if (jobs[i].status == EXTRACT_DUPLICATE)
+            free(jobs[i].output);
+        else
+            jobs[left++] = jobs[i];
+    }
+    return left;
 }
 
-void cmd_cd(const char *dirname)
+// get NAME [NEWNAME] copies one file out, under NEWNAME if given. get
+// PATTERN, or get -m with any number of names and patterns, copies every
+// named or matching file under its own name on a pool of workers.
+void cmd_get(char **names, int name_count, int workers, int many)
 {
-    if (!disk_img)
+    if (disk_fd < 0)
     {
-        printf("Error: File system not open\n");
+        print_error("File system not open\n");
         return;
     }
 
-    if (strcmp(dirname, "..") == 0)
+    const char *rename_to = NULL;
+    if (!many)
     {
-        if (current_dir_cluster != bs.rootCluster)
+        if (name_count > 2 || (name_count == 2 && has_wildcard(names[0])))
         {
-            // TODO: Implement getting parent directory
-            // This requires maintaining a directory stack or reading parent directory entries
+            print_error("Use get -m to copy several files\n");
+            return;
         }
-        return;
+        if (name_count == 2)
+        {
+            if (has_wildcard(names[1]))
+            {
+                print_error("Invalid file name %s\n", names[1]);
+                return;
+            }
+            rename_to = names[1];
+            name_count = 1;
+        }
+    }
+
+    ExtractJob *jobs = NULL;
+    uint32_t job_count = 0;
+    uint32_t job_capacity = 0;
+    DirEntry *listed = NULL;
+    char **listed_names = NULL;
+    uint32_t listed_count = 0;
+    uint32_t listed_cluster = 0;
+    int out_of_memory = 0;
+
+    for (int i = 0; i < name_count && !out_of_memory; i++)
+    {
+        if (has_wildcard(names[i]))
+        {
+            if (queue_matches(names[i], &jobs, &job_count, &job_capacity, &listed_cluster, &listed, &listed_names,
+                              &listed_count) != 0)
+                out_of_memory = 1;
+            continue;
+        }
+
+        DirEntry found;
+        DirEntry *entry = &found;
+        if (!path_find_entry(names[i], entry, NULL))
+        {
+            print_error(name_count > 1 ? "File not found: %s\n" : "File not found\n", names[i]);
+            continue;
+        }
+        if (entry->DIR_Attr & ATTRIBUTE_DIRECTORY)
+        {
+            print_error(name_count > 1 ? "Cannot get a directory: %s\n" : "Cannot get a directory\n", names[i]);
+            continue;
+        }
+
+        // Without a new name the file lands under its own name, not its path
+        const char *output_name = rename_to ? rename_to : path_basename(names[i]);
+        if (add_get_job(&jobs, &job_count, &job_capacity, entry, output_name) != 0)
+            out_of_memory = 1;
+    }
+    dir_free_names(listed, listed_names, listed_count);
+
+    if (out_of_memory)
+    {
+        print_error("Memory allocation failed\n");
+    }
+    else if ((job_count = drop_duplicate_outputs(jobs, job_count)) > 0)
+    {
+        if (extract_files(jobs, job_count, workers) < 0)
+            print_error("Could not flush file system image\n");
+
+        report_extract_failures(jobs, job_count);
     }
 
-    char expanded_name[12];
-    convert_to_fat_filename(dirname, expanded_name);
+    free_extract_jobs(jobs, job_count);
+}
 
-    DirEntry *entry = find_file_entry(expanded_name, current_dir_cluster);
-    if (!entry)
+// get -r DIR HOSTDIR: recreate DIR and everything below it under HOSTDIR
+void cmd_get_tree(const char *dirname, const char *host_dir, int workers)
+{
+    if (disk_fd < 0)
     {
-        printf("Error: Directory not found\n");
+        print_error("File system not open\n");
         return;
     }
 
+    DirEntry found;
+    DirEntry *entry = &found;
+    if (!path_find_entry(dirname, entry, NULL))
+    {
+        print_error("Directory not found\n");
+        return;
+    }
     if (!(entry->DIR_Attr & ATTRIBUTE_DIRECTORY))
     {
-        printf("Error: Not a directory\n");
+        print_error("Not a directory\n");
         return;
     }
 
-    current_dir_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    uint32_t cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    if (cluster == 0)
+        cluster = bs.rootCluster;
+
+    ExtractJob *jobs;
+    uint32_t job_count;
+    if (tree_collect(cluster, host_dir, &jobs, &job_count) != 0)
+    {
+        print_error("Could not create the directory tree under %s\n", host_dir);
+    }
+    else if (job_count > 0)
+    {
+        if (extract_pipeline(jobs, job_count, workers) < 0)
+            print_error("Could not start writer threads\n");
+        else
+            report_extract_failures(jobs, job_count);
+    }
+
+    free_extract_jobs(jobs, job_count);
 }
 
-void cmd_ls(void)
+void cmd_cd(const char *dirname)
 {
-    if (!disk_img)
+    if (disk_fd < 0)
     {
-        printf("Error: File system not open\n");
+        print_error("File system not open\n");
         return;
     }
-    list_directory_entries(current_dir_cluster);
+
+    int result = path_change_dir(dirname);
+    if (result == PATH_NOT_FOUND)
+    {
+        print_error("Directory not found\n");
+    }
+    else if (result == PATH_NOT_DIRECTORY)
+    {
+        print_error("Not a directory\n");
+    }
+}
+
+void cmd_ls(const char *dirname)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+
+    uint32_t cluster = current_dir_cluster;
+    if (dirname)
+    {
+        int result = path_resolve_dir(dirname, &cluster);
+        if (result == PATH_NOT_FOUND)
+        {
+            print_error("Directory not found\n");
+            return;
+        }
+        if (result == PATH_NOT_DIRECTORY)
+        {
+            print_error("Not a directory\n");
+            return;
+        }
+    }
+    list_directory_entries(cluster);
 }
 
 void list_directory_entries(uint32_t cluster) {
@@ -700,22 +605,25 @@ void list_directory_entries(uint32_t cluster) {
     uint8_t* cluster_buffer = malloc(bytes_per_cluster);
 
     if (!cluster_buffer) {
-        printf("Error: Memory allocation failed\n");
+        print_error("Memory allocation failed\n");
         return;
     }
 
+    LfnBuilder lfn;
+    lfn_reset(&lfn);
     while (1) {
-        // Read entire cluster
-        fseek(disk_img, sector * bytes_per_sector, SEEK_SET);
-        if (fread(cluster_buffer, bytes_per_cluster, 1, disk_img) != 1) {
-            printf("Error: Could not read cluster\n");
+        // View entire cluster
+        const uint8_t* data = disk_view_sectors(sector, bs.sectorsPerCluster, cluster_buffer);
+        if (!data) {
+            print_error("Could not read cluster\n");
             free(cluster_buffer);
             return;
         }
 
         // Process each directory entry in the cluster
         for (uint32_t i = 0; i < bytes_per_cluster; i += sizeof(DirEntry)) {
-            DirEntry* dir = (DirEntry*)(cluster_buffer + i);
+            const DirEntry* dir = (const DirEntry*)(data + i);
+            STATS_ADD(dirEntriesScanned, 1);
 
             // Check for end of directory
             if (dir->DIR_Name[0] == 0x00) {
@@ -723,6 +631,14 @@ void list_directory_entries(uint32_t cluster) {
                 return;  // End of directory, exit function
             }
 
+            // The parts of a long name come just before the entry they name
+            if (dir->DIR_Attr == ATTRIBUTE_LONG_NAME) {
+                lfn_feed(&lfn, dir);
+                continue;
+            }
+            char long_name[LFN_NAME_BYTES];
+            int has_long = lfn_take(&lfn, dir, long_name, sizeof(long_name));
+
             // Skip deleted entries, volume labels, and special entries
             if (dir->DIR_Name[0] == 0xE5 ||              // Deleted entry
                 (dir->DIR_Attr & ATTRIBUTE_VOLUME_ID) ||      // Volume ID
@@ -753,7 +669,7 @@ void list_directory_entries(uint32_t cluster) {
 
             // Only print if name is not empty and not deleted
             if (len > 0) {
-                printf("%s", name);
+                printf("%s", has_long ? long_name : name);
                 if (dir->DIR_Attr & ATTRIBUTE_DIRECTORY)
                     printf("/");
                 printf("\n");
@@ -774,62 +690,172 @@ void list_directory_entries(uint32_t cluster) {
 
 
 
-// Implementation of filesystem operations
-int open_filesystem(const char *filename)
+void display_filesystem_info(void)
+{
+    printf("bytesPerSector: 0x%X (%d)\n", bs.bytesPerSector, bs.bytesPerSector);
+    printf("sectorsPerCluster: 0x%X (%d)\n", bs.sectorsPerCluster, bs.sectorsPerCluster);
+    printf("reservedSectorCount: 0x%X (%d)\n", bs.reservedSectorCount, bs.reservedSectorCount);
+    printf("numberOfFATs: 0x%X (%d)\n", bs.numberOfFATs, bs.numberOfFATs);
+    printf("fatSize32: 0x%X (%d)\n", bs.fatSize32, bs.fatSize32);
+    printf("extendedFlags: 0x%X (%d)\n", bs.extendedFlags, bs.extendedFlags);
+    printf("rootCluster: 0x%X (%d)\n", bs.rootCluster, bs.rootCluster);
+    printf("fsInfoSector: 0x%X (%d)\n", bs.fsInfoSector, bs.fsInfoSector);
+}
+
+void print_cache_stats(void)
+{
+    CacheStats cs;
+    cache_get_stats(&cs);
+
+    uint64_t lookups = cs.hits + cs.misses;
+    printf("Backend: %s\n", disk_backend() == IO_BACKEND_MMAP ? "mmap" : "pread");
+    printf("Cache: %s, %u/%u blocks\n", cache_enabled() ? "enabled" : "disabled", cs.used, cs.capacity);
+    printf("Hits: %llu\n", (unsigned long long)cs.hits);
+    printf("Misses: %llu\n", (unsigned long long)cs.misses);
+    printf("Hit rate: %.1f%%\n", lookups ? 100.0 * cs.hits / lookups : 0.0);
+    printf("Evictions: %llu\n", (unsigned long long)cs.evictions);
+    printf("Write-backs: %llu\n", (unsigned long long)cs.writebacks);
+}
+
+void print_journal_status(void)
 {
-    if (strlen(filename) > 100)
+    JournalStats js;
+    journal_get_stats(&js);
+
+    if (!js.enabled)
     {
-        printf("Error: Filename too long\n");
-        return -1;
+        printf("Journal: disabled\n");
+        return;
     }
+    printf("Journal: %s\n", js.path);
+    printf("Uncommitted commands: %u\n", js.pendingCommands);
+    printf("Uncommitted sectors: %u\n", js.pendingSectors);
+    printf("Sectors awaiting checkpoint: %u\n", js.overlaySectors);
+    printf("Next transaction: %llu\n", (unsigned long long)js.nextSequence);
+}
 
-    disk_img = fopen(filename, "rb+");
-    if (!disk_img)
+void print_stats(void)
+{
+    IoStats io;
+    CacheStats cs;
+    const CommandTiming *timings;
+    uint32_t timing_count = stats_command_timings(&timings);
+    stats_get(&io);
+    cache_get_stats(&cs);
+
+    printf("Sectors read: %llu\n", (unsigned long long)io.sectorsRead);
+    printf("Sectors written: %llu\n", (unsigned long long)io.sectorsWritten);
+    printf("Bytes read: %llu\n", (unsigned long long)io.bytesRead);
+    printf("Bytes written: %llu\n", (unsigned long long)io.bytesWritten);
+    printf("Seeks: %llu\n", (unsigned long long)io.seeks);
+    printf("FAT lookups: %llu\n", (unsigned long long)io.fatLookups);
+    printf("FAT updates: %llu\n", (unsigned long long)io.fatUpdates);
+    printf("Directory entries scanned: %llu\n", (unsigned long long)io.dirEntriesScanned);
+    printf("Cache hits: %llu\n", (unsigned long long)cs.hits);
+    printf("Cache misses: %llu\n", (unsigned long long)cs.misses);
+
+    if (timing_count == 0)
+        return;
+    printf("%-10s %8s %12s %12s %12s\n", "Command", "Count", "Total ms", "Mean ms", "Max ms");
+    for (uint32_t i = 0; i < timing_count; i++)
     {
-        return -1;
+        const CommandTiming *t = &timings[i];
+        printf("%-10s %8llu %12.3f %12.3f %12.3f\n", t->name, (unsigned long long)t->count, t->totalSeconds * 1e3,
+               t->totalSeconds * 1e3 / t->count, t->maxSeconds * 1e3);
     }
+}
 
-    // Read boot sector
-    fseek(disk_img, 0, SEEK_SET);
-    if (fread(&bs, sizeof(BootSector), 1, disk_img) != 1)
+// The same figures as one JSON object, for scripts that collect them
+void print_stats_json(FILE *out)
+{
+    IoStats io;
+    CacheStats cs;
+    const CommandTiming *timings;
+    uint32_t timing_count = stats_command_timings(&timings);
+    stats_get(&io);
+    cache_get_stats(&cs);
+
+    fprintf(out, "{\"sectorsRead\": %llu, \"sectorsWritten\": %llu, ", (unsigned long long)io.sectorsRead,
+            (unsigned long long)io.sectorsWritten);
+    fprintf(out, "\"bytesRead\": %llu, \"bytesWritten\": %llu, \"seeks\": %llu, ", (unsigned long long)io.bytesRead,
+            (unsigned long long)io.bytesWritten, (unsigned long long)io.seeks);
+    fprintf(out, "\"fatLookups\": %llu, \"fatUpdates\": %llu, \"dirEntriesScanned\": %llu, ",
+            (unsigned long long)io.fatLookups, (unsigned long long)io.fatUpdates,
+            (unsigned long long)io.dirEntriesScanned);
+    fprintf(out, "\"cacheHits\": %llu, \"cacheMisses\": %llu, \"commands\": {", (unsigned long long)cs.hits,
+            (unsigned long long)cs.misses);
+    for (uint32_t i = 0; i < timing_count; i++)
     {
-        fclose(disk_img);
-        disk_img = NULL;
-        return -1;
+        const CommandTiming *t = &timings[i];
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"totalSeconds\": %.6f, \"maxSeconds\": %.6f}", i ? ", " : "",
+                t->name, (unsigned long long)t->count, t->totalSeconds, t->maxSeconds);
     }
-
-    strncpy(current_image_name, filename, Mx_FILENAME_LENGTH - 1);
-    current_image_name[Mx_FILENAME_LENGTH - 1] = '\0';
-    current_dir_cluster = bs.rootCluster;
-
-    return 0;
+    fprintf(out, "}}\n");
 }
 
-void close_filesystem(void)
+void set_cache_size(int blocks)
 {
-    if (disk_img)
+    if (blocks < 0)
+    {
+        print_error("Invalid cache size\n");
+        return;
+    }
+
+    // Write back what is cached before rebuilding at the new size
+    if (cache_enabled() && cache_flush() != 0)
+    {
+        print_error("Could not write back cache\n");
+        return;
+    }
+    cache_set_capacity(blocks);
+    if (disk_fd >= 0 && disk_backend() == IO_BACKEND_PREAD && cache_init() != 0)
     {
-        fclose(disk_img);
-        disk_img = NULL;
-        current_image_name[0] = '\0';
+        print_error("Could not allocate cache\n");
     }
 }
 
-void display_filesystem_info(void)
+// Next argument of a command line, split on whitespace like strtok(),
+// except that double quotes and backslash escapes let an argument hold
+// spaces: "Sub Dir" and Sub\ Dir are both one argument. The quotes and
+// backslashes are taken out in place.
+static char *next_token(char *line)
 {
-    printf("bytesPerSector: 0x%X (%d)\n", bs.bytesPerSector, bs.bytesPerSector);
-    printf("sectorsPerCluster: 0x%X (%d)\n", bs.sectorsPerCluster, bs.sectorsPerCluster);
-    printf("reservedSectorCount: 0x%X (%d)\n", bs.reservedSectorCount, bs.reservedSectorCount);
-    printf("numberOfFATs: 0x%X (%d)\n", bs.numberOfFATs, bs.numberOfFATs);
-    printf("fatSize32: 0x%X (%d)\n", bs.fatSize32, bs.fatSize32);
-    printf("extendedFlags: 0x%X (%d)\n", bs.extendedFlags, bs.extendedFlags);
-    printf("rootCluster: 0x%X (%d)\n", bs.rootCluster, bs.rootCluster);
-    printf("fsInfoSector: 0x%X (%d)\n", bs.fsInfoSector, bs.fsInfoSector);
+    static char *rest;
+    if (line)
+        rest = line;
+    if (!rest)
+        return NULL;
+
+    while (*rest == ' ' || *rest == '\t' || *rest == '\n')
+        rest++;
+    if (!*rest)
+    {
+        rest = NULL;
+        return NULL;
+    }
+
+    char *token = rest;
+    char *out = rest;
+    int quoted = 0;
+    while (*rest && (quoted || (*rest != ' ' && *rest != '\t' && *rest != '\n')))
+    {
+        if (*rest == '"')
+            quoted = !quoted;
+        else if (*rest == '\\' && rest[1])
+            *out++ = *++rest;
+        else
+            *out++ = *rest;
+        rest++;
+    }
+    if (*rest)
+        rest++;
+    *out = '\0';
+    return token;
 }
 
 void execute_command(char *cmd)
 {
-    char *token = strtok(cmd, " \t\n");
+    char *token = next_token(cmd);
     if (!token)
         return;
 
@@ -843,144 +869,383 @@ void execute_command(char *cmd)
 
     if (strcmp(command, "open") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No filename specified\n");
+            print_error("No filename specified\n");
             return;
         }
-        if (disk_img)
+        if (disk_fd >= 0)
         {
-            printf("Error: File system image already open\n");
+            print_error("File system image already open\n");
             return;
         }
-        if (open_filesystem(token) != 0)
+        char *image_name = token;
+
+        // Optional I/O backend selection, mmap by default, and journalling
+        disk_set_backend(IO_BACKEND_MMAP);
+        journal_set_enabled(0);
+        while ((token = next_token(NULL)) != NULL)
+        {
+            if (strcmp(token, "-mmap") == 0)
+            {
+                disk_set_backend(IO_BACKEND_MMAP);
+            }
+            else if (strcmp(token, "-pread") == 0 || strcmp(token, "-stdio") == 0)
+            {
+                disk_set_backend(IO_BACKEND_PREAD);
+            }
+            else if (strcmp(token, "-journal") == 0)
+            {
+                journal_set_enabled(1);
+            }
+            else
+            {
+                print_error("Unknown open option %s\n", token);
+                return;
+            }
+        }
+
+        int replayed = open_filesystem(image_name);
+        if (replayed < 0)
+        {
+            print_error("File system image not found\n");
+        }
+        else if (replayed > 0)
         {
-            printf("Error: File system image not found\n");
+            printf("Replayed %d journal transaction%s\n", replayed, replayed == 1 ? "" : "s");
         }
     }
     else if (strcmp(command, "close") == 0)
     {
-        if (!disk_img)
+        if (disk_fd < 0)
         {
-            printf("Error: File system not open\n");
+            print_error("File system not open\n");
             return;
         }
         close_filesystem();
     }
+    else if (strcmp(command, "save") == 0)
+    {
+        if (disk_fd < 0)
+        {
+            print_error("File system not open\n");
+            return;
+        }
+        token = next_token(NULL);
+        if (save_filesystem(token) != 0)
+        {
+            print_error("Could not save file system image\n");
+        }
+    }
+    else if (strcmp(command, "sync") == 0)
+    {
+        if (disk_fd < 0)
+        {
+            print_error("File system not open\n");
+            return;
+        }
+        if (sync_filesystem() != 0)
+        {
+            print_error("Could not sync file system image\n");
+        }
+    }
+    else if (strcmp(command, "cache") == 0)
+    {
+        token = next_token(NULL);
+        if (!token)
+        {
+            print_cache_stats();
+        }
+        else if (strcmp(token, "reset") == 0)
+        {
+            cache_reset_stats();
+        }
+        else if (strcmp(token, "size") == 0)
+        {
+            token = next_token(NULL);
+            if (!token)
+            {
+                print_error("No cache size specified\n");
+                return;
+            }
+            set_cache_size(atoi(token));
+        }
+        else
+        {
+            print_error("Unknown cache option\n");
+        }
+    }
+    else if (strcmp(command, "readahead") == 0)
+    {
+        // readahead [depth] [-uring|-threads]; a depth of 0 turns it off
+        uint32_t depth = readahead_depth();
+        int engine = readahead_engine();
+        int changed = 0;
+        while ((token = next_token(NULL)) != NULL)
+        {
+            if (strcmp(token, "-uring") == 0)
+            {
+                engine = READAHEAD_URING;
+            }
+            else if (strcmp(token, "-threads") == 0)
+            {
+                engine = READAHEAD_THREADS;
+            }
+            else if (isdigit((unsigned char)token[0]) && atoi(token) <= READAHEAD_MAX_DEPTH)
+            {
+                depth = atoi(token);
+            }
+            else
+            {
+                print_error("Unknown readahead option %s\n", token);
+                return;
+            }
+            changed = 1;
+        }
+
+        if (changed)
+            readahead_configure(depth, engine);
+        else if (depth == 0)
+            printf("Read-ahead: off\n");
+        else
+            printf("Read-ahead: %u reads in flight, %s\n", depth, engine == READAHEAD_URING ? "io_uring" : "threads");
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        token = next_token(NULL);
+        if (!token)
+        {
+            print_stats();
+        }
+        else if (strcmp(token, "reset") == 0)
+        {
+            stats_reset();
+        }
+        else if (strcmp(token, "-json") == 0)
+        {
+            print_stats_json(stdout);
+        }
+        else
+        {
+            print_error("Unknown stats option\n");
+        }
+    }
+    else if (strcmp(command, "journal") == 0)
+    {
+        if (disk_fd < 0)
+        {
+            print_error("File system not open\n");
+            return;
+        }
+        token = next_token(NULL);
+        if (!token)
+        {
+            print_journal_status();
+        }
+        else if (strcmp(token, "commit") == 0)
+        {
+            if (journal_commit() != 0)
+                print_error("Could not commit journal\n");
+        }
+        else if (strcmp(token, "checkpoint") == 0)
+        {
+            if (journal_checkpoint() != 0)
+                print_error("Could not checkpoint journal\n");
+        }
+        else
+        {
+            print_error("Unknown journal option\n");
+        }
+    }
     else if (strcmp(command, "info") == 0)
     {
-        if (!disk_img)
+        if (disk_fd < 0)
         {
-            printf("Error: File system not open\n");
+            print_error("File system not open\n");
             return;
         }
         display_filesystem_info();
     }
     else if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0)
     {
-        if (disk_img)
-        {
-            close_filesystem();
-        }
-        exit(0);
+        quit_requested = 1;
     }
     else if (strcmp(command, "stat") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No filename specified\n");
+            print_error("No filename specified\n");
             return;
         }
         cmd_stat(token);
     }
     else if (strcmp(command, "get") == 0)
     {
-        token = strtok(NULL, " \t\n");
-        if (!token)
+        // get [-j workers] name [newname], get [-j workers] pattern,
+        // get -m [-j workers] name|pattern..., or get -r [-j workers] dir hostdir
+        char *names[Mx_COMMAND_LENGTH / 2];
+        int name_count = 0;
+        int workers = GET_DEFAULT_WORKERS;
+        int recursive = 0;
+        int many = 0;
+        while ((token = next_token(NULL)) != NULL)
+        {
+            if (strcmp(token, "-r") == 0)
+            {
+                recursive = 1;
+            }
+            else if (strcmp(token, "-m") == 0)
+            {
+                many = 1;
+            }
+            else if (strcmp(token, "-j") == 0)
+            {
+                token = next_token(NULL);
+                workers = token ? atoi(token) : 0;
+                if (workers < 1)
+                {
+                    print_error("Invalid worker count\n");
+                    return;
+                }
+            }
+            else
+            {
+                names[name_count++] = token;
+            }
+        }
+        if (name_count == 0)
         {
-            printf("Error: No filename specified\n");
+            print_error("No filename specified\n");
             return;
         }
-        char *src_name = token;
-        token = strtok(NULL, " \t\n");
-        cmd_get(src_name, token);
+        if (recursive)
+        {
+            if (name_count != 2)
+            {
+                print_error("get -r needs a directory and a host directory\n");
+                return;
+            }
+            cmd_get_tree(names[0], names[1], workers);
+            return;
+        }
+        cmd_get(names, name_count, workers, many);
     }
     else if (strcmp(command, "cd") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No directory specified\n");
+            print_error("No directory specified\n");
             return;
         }
         cmd_cd(token);
     }
     else if (strcmp(command, "ls") == 0)
     {
-        cmd_ls();
+        token = next_token(NULL);
+        cmd_ls(token);
     }
     else if (strcmp(command, "put") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
+        int recursive = token && strcmp(token, "-r") == 0;
+        if (recursive)
+            token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No filename specified\n");
+            print_error(recursive ? "No directory specified\n" : "No filename specified\n");
             return;
         }
         char *src_name = token;
-        token = strtok(NULL, " \t\n");
-        upload_file(src_name, token);
+        token = next_token(NULL);
+        if (recursive)
+            cmd_put_tree(src_name, token);
+        else
+            upload_file(src_name, token);
     }
     else if (strcmp(command, "del") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No filename specified\n");
+            print_error("No filename specified\n");
             return;
         }
         delete_file(token);
     }
     else if (strcmp(command, "undel") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        // undel name..., or undel -all
+        char *names[Mx_COMMAND_LENGTH / 2];
+        int name_count = 0;
+        while ((token = next_token(NULL)) != NULL)
+            names[name_count++] = token;
+        if (name_count == 0)
+        {
+            print_error("No filename specified\n");
+            return;
+        }
+        cmd_undel(names, name_count);
+    }
+    else if (strcmp(command, "lsdel") == 0)
+    {
+        cmd_lsdel();
+    }
+    else if (strcmp(command, "frag") == 0)
+    {
+        token = next_token(NULL);
+        cmd_frag(token);
+    }
+    else if (strcmp(command, "defrag") == 0)
+    {
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: No filename specified\n");
+            print_error("No filename specified\n");
             return;
         }
-        restore_deleted_file(token);
+        cmd_defrag(token);
+    }
+    else if (strcmp(command, "check") == 0)
+    {
+        token = next_token(NULL);
+        if (token && strcmp(token, "-repair") != 0)
+        {
+            print_error("Unknown check option %s\n", token);
+            return;
+        }
+        cmd_check(token != NULL);
     }
     else if (strcmp(command, "read") == 0)
     {
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: Missing parameters\n");
+            print_error("Missing parameters\n");
             return;
         }
         char *filename = token;
 
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: Missing position\n");
+            print_error("Missing position\n");
             return;
         }
         uint32_t position = atoi(token);
 
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         if (!token)
         {
-            printf("Error: Missing number of bytes\n");
+            print_error("Missing number of bytes\n");
             return;
         }
         uint32_t num_bytes = atoi(token);
 
         // Check for optional format flag
-        token = strtok(NULL, " \t\n");
+        token = next_token(NULL);
         int format = FORMAT_HEX; // Default format
         if (token)
         {
@@ -992,43 +1257,188 @@ void execute_command(char *cmd)
             {
                 format = FORMAT_DEC;
             }
+            else if (strcmp(token, "-raw") == 0)
+            {
+                format = FORMAT_RAW;
+            }
         }
 
         read_file_content(filename, position, num_bytes, format);
     }
     else
     {
-        if (!disk_img)
+        if (disk_fd < 0)
         {
-            printf("Error: File system image must be opened first\n");
+            print_error("File system image must be opened first\n");
             return;
         }
-        printf("Error: Unknown command\n");
+        print_error("Unknown command\n");
     }
 }
 
-int main()
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-b] [-k] [-s file] [script]\n", program);
+    fprintf(stderr, "       %s --check [--repair] image\n", program);
+    fprintf(stderr, "  -b  batch mode: no prompt, fully buffered output\n");
+    fprintf(stderr, "  -k  keep going after a command fails\n");
+    fprintf(stderr, "  -s  write the stats counters to file as JSON at exit (- for stderr)\n");
+    fprintf(stderr, "Commands are read from script, or from stdin. Batch mode is\n");
+    fprintf(stderr, "used automatically when they do not come from a terminal.\n");
+    fprintf(stderr, "--check checks the image and exits with 0 if it is clean, 1 if\n");
+    fprintf(stderr, "problems are left, 2 if it could not be checked.\n");
+}
+
+int main(int argc, char *argv[])
 {
     char cmd_line[Mx_COMMAND_LENGTH];
+    FILE *input = stdin;
+    int batch = !isatty(STDIN_FILENO);
+    int keep_going = 0;
+    int failures = 0;
+    const char *stats_file = NULL;
+    int check = 0;
+    int opt;
+
+    static const struct option long_options[] = {
+        {"check", no_argument, NULL, 'C'},
+        {"repair", no_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "bks:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'C':
+            check |= 1;
+            break;
+        case 'R':
+            check |= 2;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'k':
+            keep_going = 1;
+            break;
+        case 's':
+            stats_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (check && (check == 2 || optind != argc - 1))
+    {
+        usage(argv[0]);
+        return 2;
+    }
 
-    while (1)
+    if (optind < argc && !check)
     {
-        printf("mfs> ");
-        if (!fgets(cmd_line, sizeof(cmd_line), stdin))
+        input = fopen(argv[optind], "r");
+        if (!input)
+        {
+            fprintf(stderr, "Error: Cannot open script %s\n", argv[optind]);
+            return 2;
+        }
+        batch = 1;
+    }
+
+    // Every command works on this one context; its errors are printed
+    mfs_fs *fs = mfs_create();
+    if (!fs)
+    {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 2;
+    }
+    fs->echoErrors = 1;
+    mfs_use(fs);
+
+    // --check: open the image, check it and exit with the outcome
+    if (check)
+    {
+        disk_set_backend(IO_BACKEND_MMAP);
+        int left = 2;
+        int replayed = open_filesystem(argv[optind]);
+        if (replayed < 0)
+        {
+            print_error("File system image not found\n");
+        }
+        else
+        {
+            if (replayed > 0)
+                printf("Replayed %d journal transaction%s\n", replayed, replayed == 1 ? "" : "s");
+            int result = cmd_check(check & 2);
+            left = result < 0 ? 2 : result > 0;
+            close_filesystem();
+        }
+        mfs_destroy(fs);
+        return left;
+    }
+
+    // Scripts produce a lot of output; don't flush it line by line
+    if (batch)
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+
+    while (!quit_requested)
+    {
+        if (!batch)
+            printf("mfs> ");
+        if (!fgets(cmd_line, sizeof(cmd_line), input))
             break;
 
-        // Skip empty lines
-        if (cmd_line[0] == '\n')
+        // Skip empty lines and script comments
+        if (cmd_line[0] == '\n' || cmd_line[0] == '#')
             continue;
 
         // Remove trailing newline
         cmd_line[strcspn(cmd_line, "\n")] = 0;
 
-        // Process command
+        // Process command, timing it under its name
+        char name[16];
+        size_t name_length = strcspn(cmd_line + strspn(cmd_line, " \t"), " \t");
+        snprintf(name, sizeof(name), "%.*s", (int)name_length, cmd_line + strspn(cmd_line, " \t"));
+
+        fs->failed = 0;
+        double started = stats_now();
         execute_command(cmd_line);
+        if (name[0])
+            stats_record_command(name, stats_now() - started);
+
+        if (fs->failed && batch)
+        {
+            failures++;
+            if (!keep_going)
+                break;
+        }
     }
 
-    if (disk_img)
+    if (disk_fd >= 0)
         close_filesystem();
-    return 0;
-}
\ No newline at end of file
+    if (input != stdin)
+        fclose(input);
+
+    int status = failures ? 1 : 0;
+    if (stats_file)
+    {
+        fflush(stdout);
+        FILE *out = strcmp(stats_file, "-") == 0 ? stderr : fopen(stats_file, "w");
+        if (!out)
+        {
+            fprintf(stderr, "Error: Cannot write stats to %s\n", stats_file);
+            status = 2;
+        }
+        else
+        {
+            print_stats_json(out);
+            if (out != stderr)
+                fclose(out);
+        }
+    }
+    mfs_destroy(fs);
+    return status;
+}
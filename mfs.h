@@ -11,6 +11,7 @@
 #define Mx_FILENAME_LENGTH 256
 #define SECTOR_SIZE 512
 #define Mx_COMMAND_LENGTH 1024
+#define BATCH_OUTPUT_BUFFER (1024 * 1024)
 
 // File attributes
 #define ATTRIBUTE_SYSTEM 0x04
@@ -19,17 +20,203 @@
 #define ATTRIBUTE_READ_ONLY 0x01
 #define ATTRIBUTE_HIDDEN 0x02
 #define ATTRIBUTE_ARCHIVE 0x20
+#define ATTRIBUTE_LONG_NAME 0x0F
 #define EOC 0x0FFFFFF8
 
 #define FORMAT_HEX 0
 #define FORMAT_ASCII 1
 #define FORMAT_DEC 2
+#define FORMAT_RAW 3
+#define FORMAT_OUTPUT_BUFFER (256 * 1024)
+
+#define IO_BACKEND_PREAD 0
+#define IO_BACKEND_MMAP 1
+
+#define CACHE_DEFAULT_BLOCKS 1024
+#define CACHE_MAX_RUN 128 // larger requests bypass the cache
+#define DISK_COPY_CHUNK (1024 * 1024)
+#define PUT_WRITE_CHUNK (4 * 1024 * 1024)
+#define JOURNAL_GROUP_COMMANDS 8 // commands per journal transaction
+#define JOURNAL_CHECKPOINT_SECTORS 4096
+#define GET_DEFAULT_WORKERS 4
+#define GET_MAX_WORKERS 64
+#define TREE_CHUNK (1024 * 1024) // get -r reads the image in pieces this large
+#define TREE_QUEUE_DEPTH 16
+#define EXTENT_CACHE_SLOTS 16
+#define DIR_INDEX_SLOTS 8
+#define MAX_PATH_DEPTH 64
+#define STATS_MAX_COMMANDS 32 // distinct command names timed
+#define DENTRY_CACHE_SIZE 256
+#define READAHEAD_DEFAULT_DEPTH 16 // reads kept in flight along a fragmented file
+#define READAHEAD_MAX_DEPTH 256
+#define READAHEAD_REQUEST (256 * 1024) // longer runs are read in pieces this large
+#define READAHEAD_MAX_THREADS 8 // pool size when io_uring is unavailable
+#define CHECK_THREADS 8 // directory walkers used by check
+#define LFN_MAX_ENTRIES 20 // a long name of 255 characters takes 20 entries
+#define LFN_NAME_BYTES (255 * 3 + 1) // longest long name in UTF-8, terminated
+
+// Read-ahead engines
+#define READAHEAD_URING 0
+#define READAHEAD_THREADS 1
+
+// Path resolution results
+#define PATH_NOT_FOUND -1
+#define PATH_NOT_DIRECTORY -2
+
+// Results of writing one host file into the image
+#define PUT_OK 0
+#define PUT_READ_FAILED 1
+#define PUT_WRITE_FAILED 2
+
+// What became of a deleted file's data (undelete.c)
+#define DELETED_EMPTY 0    // no clusters
+#define DELETED_HELD 1     // chain still allocated to it
+#define DELETED_FREE 2     // clusters freed but not reused
+#define DELETED_REUSED 3   // clusters now belong to something else
+#define DELETED_RESTORED 4 // undeleted since the index was built
+
+// Results of undeleting one file
+#define UNDEL_OK 0
+#define UNDEL_NOT_FOUND 1
+#define UNDEL_EXISTS 2
+#define UNDEL_REUSED 3
+#define UNDEL_FAILED 4
+
+// Results of extracting one file
+#define EXTRACT_OK 0
+#define EXTRACT_CREATE_FAILED 1
+#define EXTRACT_READ_FAILED 2
+#define EXTRACT_NO_MEMORY 3
+#define EXTRACT_DUPLICATE 4 // another job writes the same host file
 
 // Function prototypes
-int open_filesystem(const char *filename);
+int open_filesystem(const char *filename); // journal transactions replayed, or -1
 void close_filesystem(void);
 int save_filesystem(const char *newname);
+int sync_filesystem(void);
 void print_info(void);
 void process_command(char *cmd);
+void print_error(const char *format, ...);
+int put_file(FILE *src, uint32_t size, const char *name);
+int dir_mark_deleted(uint32_t dir_cluster, uint32_t sector, uint32_t slot);
+int dir_revive_long_name(uint32_t dir_cluster, uint32_t sector, uint32_t slot);
+
+uint32_t get_first_sector_of_cluster(uint32_t cluster);
+
+// Sector I/O (disk.c)
+void disk_set_backend(int backend);
+int disk_backend(void);
+int disk_attach(void);
+void disk_detach(void);
+int disk_flush(void);
+const uint8_t *disk_view_sectors(uint32_t sector, uint32_t count, void *scratch);
+int disk_raw_read(uint32_t sector, uint32_t count, void *buffer);
+int disk_raw_write(uint32_t sector, uint32_t count, const void *buffer);
+int disk_prepare_fd_io(void);
+int disk_copy_to_fd(uint32_t sector, uint64_t length, int out_fd);
+int write_all(int fd, const void *data, size_t length);
+void readahead_configure(uint32_t depth, int engine);
+uint32_t readahead_depth(void);
+int readahead_engine(void);
+int read_disk_sector(uint32_t sector, void *buffer);
+int write_disk_sector(uint32_t sector, const void *buffer);
+int read_disk_sectors(uint32_t sector, uint32_t count, void *buffer);
+int write_disk_sectors(uint32_t sector, uint32_t count, const void *buffer);
+
+// Sector cache (cache.c)
+int cache_init(void);
+void cache_release(void);
+int cache_enabled(void);
+void cache_set_capacity(uint32_t blocks);
+int cache_read(uint32_t sector, uint32_t count, void *buffer, int insert);
+int cache_write(uint32_t sector, uint32_t count, const void *buffer, int insert);
+int cache_flush(void);
+void cache_reset_stats(void);
+
+// Counters behind the stats command (stats.c)
+void stats_count_io(uint64_t offset, uint64_t length, int write);
+double stats_now(void);
+void stats_record_command(const char *name, double seconds);
+void stats_reset(void);
+
+// Metadata journal (journal.c); journal_open() returns the transactions replayed
+void journal_set_enabled(int enable);
+int journal_open(const char *image_name);
+int journal_close(void);
+int journal_enabled(void);
+void journal_begin(void);
+int journal_end(void);
+int journal_capturing(uint32_t sector, uint32_t count);
+int journal_log(uint32_t sector, uint32_t count, const void *buffer);
+int journal_overlay(uint32_t sector, uint32_t count, void *buffer);
+int journal_covers(uint32_t sector, uint32_t count);
+void journal_note_free(void);
+int journal_barrier(void);
+int journal_commit(void);
+int journal_checkpoint(void);
+
+// In-memory FAT (fat.c)
+int fat_load(void);
+void fat_unload(void);
+int fat_sync(void);
+void fat_mark_mirrors_stale(void);
+void fat_begin(void);
+int fat_commit(void);
+int fat_flush(void);
+void fat_abort(void);
+uint32_t get_fat_entry(uint32_t cluster);
+int update_fat_entry(uint32_t cluster, uint32_t value);
+uint32_t fat_alloc_cluster(void);
+uint32_t fat_alloc_run(uint32_t want, uint32_t *got);
+void fat_free_chain(uint32_t cluster);
+uint32_t fat_free_cluster_count(void);
+uint32_t fat_generation(void);
+uint32_t fat_cluster_limit(void);
+int64_t fat_check_mirrors(void);
+
+// Recursive import (import.c)
+void cmd_put_tree(const char *host_dir, const char *newname);
+
+// Fragmentation report and defragmentation (defrag.c)
+void cmd_frag(const char *path);
+void cmd_defrag(const char *target);
+
+// Consistency check (check.c); returns the problems left, -1 on failure
+int cmd_check(int repair);
+
+// Deleted-file index, lsdel and undel (undelete.c)
+void cmd_lsdel(void);
+void cmd_undel(char **names, int count);
+void deleted_index_clear(void);
+
+// Output formatting (format.c)
+void write_formatted(const uint8_t *data, size_t length, int format, FILE *out);
+
+// Paths and names (path.c)
+void convert_to_fat_filename(const char *input, char *expanded);
+void path_display_name(const char *fat_name, char *display);
+const char *path_basename(const char *path);
+int path_resolve_dir(const char *path, uint32_t *cluster);
+int path_change_dir(const char *path);
+void path_reset(void);
+void dentry_cache_clear(void);
+
+// VFAT long names (lfn.c)
+int lfn_needed(const char *name);
+int lfn_entry_count(const char *name);
+uint8_t lfn_checksum(const char *short_name);
+void lfn_fold(const char *name, char *folded, size_t size);
+int lfn_make_alias(const char *name, uint32_t dir_cluster, char *short_name);
+int lfn_pick_alias(const char *name, int (*taken)(const char *short_name, void *context), void *context,
+                   char *short_name);
+
+// Directory hash index (dirindex.c)
+void dir_index_add(uint32_t dir_cluster, const char *name, uint32_t sector, uint32_t slot);
+void dir_index_add_long(uint32_t dir_cluster, const char *long_name, const char *name, uint32_t sector,
+                        uint32_t slot);
+void dir_index_remove(uint32_t dir_cluster, const char *name);
+void dir_index_invalidate(uint32_t dir_cluster);
+void dir_index_clear(void);
+uint32_t dir_index_generation(void);
 
 #endif // MFS_H
\ No newline at end of file
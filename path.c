@@ -0,0 +1,360 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Path resolution. The working directory is kept as a stack of 8.3 names with
+// the cluster of each level, so ".." is a pop rather than a lookup. Paths are
+// normalised against that stack (or the root for absolute paths) and any
+// level whose cluster is not already known is found through the dentry cache,
+// which maps a chain of names from the root to the directory's cluster. A
+// component that is not an 8.3 name is looked up as a long name and then
+// stands in the stack under the 8.3 name of the entry it found.
+// Readers on several threads share the dentry cache under its mutex; the
+// working directory only changes when a caller holds the filesystem alone.
+typedef struct
+{
+    char name[11];
+    uint32_t cluster; // 0 until resolved
+    const char *longName; // the component as given, while name is only a guess
+    uint32_t longLength;
+} PathLevel;
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t length;
+    char *key;
+    uint32_t cluster;
+} DentrySlot;
+
+struct PathState
+{
+    PathLevel cwd_stack[MAX_PATH_DEPTH];
+    int cwd_depth;
+    DentrySlot dentry_cache[DENTRY_CACHE_SIZE];
+    pthread_mutex_t dentry_lock;
+};
+
+#define PATHS (mfs_current->paths)
+
+PathState *path_state_new(void)
+{
+    PathState *state = calloc(1, sizeof(PathState));
+    if (state)
+        pthread_mutex_init(&state->dentry_lock, NULL);
+    return state;
+}
+
+void convert_to_fat_filename(const char *input, char *expanded)
+{
+    memset(expanded, ' ', 11);
+    expanded[11] = '\0';
+
+    // The dot entries are stored literally
+    if (strcmp(input, ".") == 0 || strcmp(input, "..") == 0)
+    {
+        memcpy(expanded, input, strlen(input));
+        return;
+    }
+
+    while (*input == '.')
+        input++;
+
+    const char *dot = strchr(input, '.');
+    size_t len = dot ? (size_t)(dot - input) : strlen(input);
+    if (len > 8)
+        len = 8;
+    memcpy(expanded, input, len);
+
+    if (dot)
+    {
+        const char *ext = dot + 1;
+        const char *end = strchr(ext, '.');
+        len = end ? (size_t)(end - ext) : strlen(ext);
+        if (len > 3)
+            len = 3;
+        memcpy(expanded + 8, ext, len);
+    }
+
+    for (int i = 0; i < 11; i++)
+    {
+        expanded[i] = toupper((unsigned char)expanded[i]);
+    }
+}
+
+// The reverse of convert_to_fat_filename: "FILE    TXT" becomes "FILE.TXT"
+void path_display_name(const char *fat_name, char *display)
+{
+    int len = 8;
+    while (len > 0 && fat_name[len - 1] == ' ')
+        len--;
+    memcpy(display, fat_name, len);
+
+    int ext = 3;
+    while (ext > 0 && fat_name[8 + ext - 1] == ' ')
+        ext--;
+    if (ext > 0)
+    {
+        display[len++] = '.';
+        memcpy(display + len, fat_name + 8, ext);
+        len += ext;
+    }
+    display[len] = '\0';
+}
+
+const char *path_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static uint32_t hash_levels(const PathLevel *stack, int depth)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++)
+    {
+        for (int j = 0; j < 11; j++)
+        {
+            hash ^= (uint8_t)stack[i].name[j];
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+static int key_matches(const DentrySlot *slot, const PathLevel *stack, int depth)
+{
+    if (!slot->key || slot->length != (uint32_t)depth * 11)
+        return 0;
+    for (int i = 0; i < depth; i++)
+    {
+        if (memcmp(slot->key + i * 11, stack[i].name, 11) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static uint32_t dentry_lookup(const PathLevel *stack, int depth)
+{
+    uint32_t hash = hash_levels(stack, depth);
+    DentrySlot *slot = &PATHS->dentry_cache[hash % DENTRY_CACHE_SIZE];
+    uint32_t cluster = 0;
+
+    pthread_mutex_lock(&PATHS->dentry_lock);
+    if (slot->hash == hash && key_matches(slot, stack, depth))
+        cluster = slot->cluster;
+    pthread_mutex_unlock(&PATHS->dentry_lock);
+    return cluster;
+}
+
+// Direct-mapped: a colliding path simply replaces the older one
+static void dentry_insert(const PathLevel *stack, int depth, uint32_t cluster)
+{
+    uint32_t hash = hash_levels(stack, depth);
+    DentrySlot *slot = &PATHS->dentry_cache[hash % DENTRY_CACHE_SIZE];
+    char *key = malloc((size_t)depth * 11 + 1);
+
+    if (!key)
+        return;
+    for (int i = 0; i < depth; i++)
+        memcpy(key + i * 11, stack[i].name, 11);
+
+    pthread_mutex_lock(&PATHS->dentry_lock);
+    char *old_key = slot->key;
+    slot->hash = hash;
+    slot->length = depth * 11;
+    slot->key = key;
+    slot->cluster = cluster;
+    pthread_mutex_unlock(&PATHS->dentry_lock);
+    free(old_key);
+}
+
+void dentry_cache_clear(void)
+{
+    pthread_mutex_lock(&PATHS->dentry_lock);
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+    {
+        free(PATHS->dentry_cache[i].key);
+        memset(&PATHS->dentry_cache[i], 0, sizeof(DentrySlot));
+    }
+    pthread_mutex_unlock(&PATHS->dentry_lock);
+}
+
+void path_reset(void)
+{
+    PATHS->cwd_depth = 0;
+    current_dir_cluster = bs.rootCluster;
+    dentry_cache_clear();
+}
+
+// Apply a path to the working directory stack (or an empty one for absolute
+// paths), handling "." and ".." lexically
+static int build_stack(const char *path, PathLevel *stack, int *depth)
+{
+    int d = 0;
+
+    if (path[0] != '/')
+    {
+        memcpy(stack, PATHS->cwd_stack, PATHS->cwd_depth * sizeof(PathLevel));
+        d = PATHS->cwd_depth;
+    }
+
+    const char *p = path;
+    while (*p)
+    {
+        while (*p == '/')
+            p++;
+        if (!*p)
+            break;
+
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char component[Mx_FILENAME_LENGTH];
+        if (len >= sizeof(component))
+            return -1;
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+
+        if (strcmp(component, ".") == 0)
+            continue;
+        if (strcmp(component, "..") == 0)
+        {
+            if (d > 0)
+                d--;
+            continue;
+        }
+        if (d == MAX_PATH_DEPTH)
+            return -1;
+
+        char expanded_name[12];
+        convert_to_fat_filename(component, expanded_name);
+        memcpy(stack[d].name, expanded_name, 11);
+        stack[d].cluster = 0;
+        stack[d].longName = lfn_needed(component) ? p - len : NULL;
+        stack[d].longLength = len;
+        d++;
+    }
+
+    *depth = d;
+    return 0;
+}
+
+static int find_level(const PathLevel *level, uint32_t parent, DirEntry *entry)
+{
+    if (!level->longName)
+        return find_file_entry(level->name, parent, entry);
+
+    char component[Mx_FILENAME_LENGTH];
+    snprintf(component, sizeof(component), "%.*s", (int)level->longLength, level->longName);
+    return dir_find_name(parent, component, entry, NULL, NULL);
+}
+
+// Fill in the cluster of every level, caching what had to be looked up. A
+// level given by long name is only keyed in the dentry cache once its 8.3
+// name is known.
+static int resolve_stack(PathLevel *stack, int depth)
+{
+    uint32_t parent = bs.rootCluster;
+
+    for (int i = 0; i < depth; i++)
+    {
+        if (!stack[i].cluster && !stack[i].longName)
+            stack[i].cluster = dentry_lookup(stack, i + 1);
+
+        if (!stack[i].cluster)
+        {
+            DirEntry entry;
+            if (!find_level(&stack[i], parent, &entry))
+                return PATH_NOT_FOUND;
+            if (!(entry.DIR_Attr & ATTRIBUTE_DIRECTORY))
+                return PATH_NOT_DIRECTORY;
+            memcpy(stack[i].name, entry.DIR_Name, 11);
+            stack[i].longName = NULL;
+
+            uint32_t cluster = (entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+            stack[i].cluster = cluster ? cluster : bs.rootCluster;
+            dentry_insert(stack, i + 1, stack[i].cluster);
+        }
+        parent = stack[i].cluster;
+    }
+    return 0;
+}
+
+int path_resolve_dir(const char *path, uint32_t *cluster)
+{
+    PathLevel stack[MAX_PATH_DEPTH];
+    int depth;
+
+    if (build_stack(path, stack, &depth) != 0)
+        return PATH_NOT_FOUND;
+
+    int result = resolve_stack(stack, depth);
+    if (result != 0)
+        return result;
+
+    *cluster = depth ? stack[depth - 1].cluster : bs.rootCluster;
+    return 0;
+}
+
+int path_change_dir(const char *path)
+{
+    PathLevel stack[MAX_PATH_DEPTH];
+    int depth;
+
+    if (build_stack(path, stack, &depth) != 0)
+        return PATH_NOT_FOUND;
+
+    int result = resolve_stack(stack, depth);
+    if (result != 0)
+        return result;
+
+    memcpy(PATHS->cwd_stack, stack, depth * sizeof(PathLevel));
+    PATHS->cwd_depth = depth;
+    current_dir_cluster = depth ? stack[depth - 1].cluster : bs.rootCluster;
+    return 0;
+}
+
+int path_find_entry(const char *path, DirEntry *entry, uint32_t *dir_cluster)
+{
+    const char *name = path_basename(path);
+
+    // A path ending in a directory reference names the directory itself
+    if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        uint32_t cluster;
+        if (path_resolve_dir(path, &cluster) != 0)
+            return 0;
+
+        char expanded_name[12];
+        convert_to_fat_filename(*name ? name : ".", expanded_name);
+
+        memset(entry, 0, sizeof(DirEntry));
+        memcpy(entry->DIR_Name, expanded_name, 11);
+        entry->DIR_Attr = ATTRIBUTE_DIRECTORY;
+        entry->DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+        entry->DIR_FstClusLO = cluster & 0xFFFF;
+        if (dir_cluster)
+            *dir_cluster = cluster;
+        return 1;
+    }
+
+    // Resolve everything up to the last slash, then look the name up there
+    uint32_t parent = current_dir_cluster;
+    if (name != path)
+    {
+        char parent_path[Mx_COMMAND_LENGTH];
+        size_t len = name - path;
+        if (len >= sizeof(parent_path))
+            return 0;
+        memcpy(parent_path, path, len);
+        parent_path[len] = '\0';
+        if (path_resolve_dir(parent_path, &parent) != 0)
+            return 0;
+    }
+
+    if (!dir_find_name(parent, name, entry, NULL, NULL))
+        return 0;
+    if (dir_cluster)
+        *dir_cluster = parent;
+    return 1;
+}
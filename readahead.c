@@ -0,0 +1,496 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Read-ahead along a file's runs. A stream walks the extents of a chain and
+// keeps up to depth reads in flight, in a ring of buffers, while the caller
+// consumes earlier ones in order. Reads go to the image descriptor through
+// io_uring when the kernel offers it, or else through a few threads doing
+// pread. Each request is one run, or a READAHEAD_REQUEST sized piece of a
+// long one, widened to whole sectors so journalled sectors can be patched in.
+struct ReadAheadState
+{
+    uint32_t depth;
+    int engine; // preferred engine
+};
+
+#define READAHEAD (mfs_current->readahead)
+
+ReadAheadState *readahead_state_new(void)
+{
+    ReadAheadState *state = calloc(1, sizeof(ReadAheadState));
+    if (state)
+    {
+        state->depth = READAHEAD_DEFAULT_DEPTH;
+        state->engine = READAHEAD_URING;
+    }
+    return state;
+}
+
+void readahead_configure(uint32_t depth, int engine)
+{
+    READAHEAD->depth = depth < READAHEAD_MAX_DEPTH ? depth : READAHEAD_MAX_DEPTH;
+    READAHEAD->engine = engine;
+}
+
+uint32_t readahead_depth(void)
+{
+    return READAHEAD->depth;
+}
+
+int readahead_engine(void)
+{
+    return READAHEAD->engine;
+}
+
+#define SLOT_FREE 0
+#define SLOT_QUEUED 1   // waiting for a pool thread
+#define SLOT_READING 2
+#define SLOT_DONE 3
+
+typedef struct
+{
+    uint64_t offset; // byte offset in the image, sector aligned
+    uint32_t length; // whole sectors
+    uint32_t skip;   // bytes at the front the caller did not ask for
+    uint32_t useful; // bytes handed to the caller
+    uint8_t *data;
+    int32_t result; // bytes read, or -errno
+    int state;
+} ReadSlot;
+
+struct ReadAhead
+{
+    mfs_fs *fs;
+    int engine;
+
+    // Where the next request starts
+    const Extent *extents;
+    uint32_t extent_count;
+    uint32_t extent;
+    uint64_t in_run;
+    uint64_t remaining;
+
+    ReadSlot *slots;
+    uint32_t depth;
+    uint64_t submitted; // requests handed to the engine
+    uint64_t consumed;  // requests returned to the caller
+    int holding;        // the caller still has the data of request consumed - 1
+
+    // io_uring
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t in_flight;
+
+    // Thread pool
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    pthread_t threads[READAHEAD_MAX_THREADS];
+    int thread_count;
+    uint64_t claimed;
+    int stopping;
+};
+
+static uint64_t image_offset(uint32_t cluster)
+{
+    return (uint64_t)get_first_sector_of_cluster(cluster) * bs.bytesPerSector;
+}
+
+// Cut the next request off the runs; returns 0 when there is none left
+static int next_request(ReadAhead *ra, ReadSlot *slot)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+
+    while (ra->remaining > 0 && ra->extent < ra->extent_count)
+    {
+        const Extent *run = &ra->extents[ra->extent];
+        uint64_t run_bytes = (uint64_t)run->clusterCount * bytes_per_cluster;
+        if (ra->in_run >= run_bytes)
+        {
+            ra->in_run -= run_bytes;
+            ra->extent++;
+            continue;
+        }
+
+        uint32_t front = ra->in_run % bs.bytesPerSector;
+        uint64_t useful = run_bytes - ra->in_run;
+        if (useful > ra->remaining)
+            useful = ra->remaining;
+        if (useful > READAHEAD_REQUEST - front)
+            useful = READAHEAD_REQUEST - front;
+
+        slot->offset = image_offset(run->startCluster) + ra->in_run - front;
+        slot->skip = front;
+        slot->useful = useful;
+        slot->length = (front + useful + bs.bytesPerSector - 1) / bs.bytesPerSector * bs.bytesPerSector;
+        ra->in_run += useful;
+        ra->remaining -= useful;
+        return 1;
+    }
+    return 0;
+}
+
+// Finish a read the engine left short, or failed, with plain pread
+static int complete_read(ReadSlot *slot)
+{
+    uint32_t done = slot->result > 0 ? slot->result : 0;
+    while (done < slot->length)
+    {
+        ssize_t n = pread(disk_fd, slot->data + done, slot->length - done, slot->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// io_uring engine, driven through the raw system calls
+static int uring_setup(ReadAhead *ra)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ra->ring_fd = syscall(__NR_io_uring_setup, ra->depth, &params);
+    if (ra->ring_fd < 0)
+        return -1;
+
+    ra->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ra->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ra->cq_ring_size > ra->sq_ring_size)
+            ra->sq_ring_size = ra->cq_ring_size;
+        ra->cq_ring_size = ra->sq_ring_size;
+    }
+    ra->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ra->sq_ring = mmap(NULL, ra->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+                       IORING_OFF_SQ_RING);
+    if (ra->sq_ring == MAP_FAILED)
+        return -1;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ra->cq_ring = ra->sq_ring;
+    else
+        ra->cq_ring = mmap(NULL, ra->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+                           IORING_OFF_CQ_RING);
+    ra->sqes = mmap(NULL, ra->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+                    IORING_OFF_SQES);
+    if (ra->cq_ring == MAP_FAILED || ra->sqes == MAP_FAILED)
+        return -1;
+
+    uint8_t *sq = ra->sq_ring;
+    uint8_t *cq = ra->cq_ring;
+    ra->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ra->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ra->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+    ra->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ra->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ra->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ra->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+    ra->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(ReadAhead *ra)
+{
+    if (ra->sqes && ra->sqes != MAP_FAILED)
+        munmap(ra->sqes, ra->sqes_size);
+    if (ra->cq_ring && ra->cq_ring != MAP_FAILED && ra->cq_ring != ra->sq_ring)
+        munmap(ra->cq_ring, ra->cq_ring_size);
+    if (ra->sq_ring && ra->sq_ring != MAP_FAILED)
+        munmap(ra->sq_ring, ra->sq_ring_size);
+    if (ra->ring_fd >= 0)
+        close(ra->ring_fd);
+    ra->sqes = NULL;
+    ra->cq_ring = ra->sq_ring = NULL;
+    ra->ring_fd = -1;
+}
+
+static void uring_queue(ReadAhead *ra, uint32_t index)
+{
+    ReadSlot *slot = &ra->slots[index];
+    uint32_t tail = *ra->sq_tail;
+    uint32_t at = tail & *ra->sq_mask;
+    struct io_uring_sqe *sqe = &ra->sqes[at];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = disk_fd;
+    sqe->addr = (uintptr_t)slot->data;
+    sqe->len = slot->length;
+    sqe->off = slot->offset;
+    sqe->user_data = index;
+    ra->sq_array[at] = at;
+    __atomic_store_n(ra->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    slot->state = SLOT_READING;
+}
+
+// Submit everything queued and, if wait is set, block for at least one
+// completion; then collect every completion that has arrived
+static int uring_reap(ReadAhead *ra, int wait)
+{
+    for (;;)
+    {
+        uint32_t pending = *ra->sq_tail - __atomic_load_n(ra->sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0 && !wait)
+            break;
+        int n = syscall(__NR_io_uring_enter, ra->ring_fd, pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                        NULL, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        break;
+    }
+
+    uint32_t head = *ra->cq_head;
+    while (head != __atomic_load_n(ra->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ra->cqes[head & *ra->cq_mask];
+        ReadSlot *slot = &ra->slots[cqe->user_data];
+        slot->result = cqe->res;
+        slot->state = SLOT_DONE;
+        ra->in_flight--;
+        head++;
+    }
+    __atomic_store_n(ra->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Thread pool engine
+static void *pool_thread(void *arg)
+{
+    ReadAhead *ra = arg;
+
+    mfs_current = ra->fs;
+    pthread_mutex_lock(&ra->lock);
+    for (;;)
+    {
+        while (!ra->stopping && ra->claimed == ra->submitted)
+            pthread_cond_wait(&ra->queued, &ra->lock);
+        if (ra->stopping)
+            break;
+
+        ReadSlot *slot = &ra->slots[ra->claimed++ % ra->depth];
+        slot->state = SLOT_READING;
+        pthread_mutex_unlock(&ra->lock);
+
+        ssize_t n;
+        do
+            n = pread(disk_fd, slot->data, slot->length, slot->offset);
+        while (n < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&ra->lock);
+        slot->result = n < 0 ? -errno : n;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&ra->finished);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+// Hand requests to the engine until depth of them are outstanding
+static int fill(ReadAhead *ra)
+{
+    uint32_t queued = 0;
+
+    if (ra->engine == READAHEAD_THREADS)
+        pthread_mutex_lock(&ra->lock);
+    while (ra->submitted < ra->consumed + ra->depth)
+    {
+        uint32_t index = ra->submitted % ra->depth;
+        ReadSlot *slot = &ra->slots[index];
+        if (!next_request(ra, slot))
+            break;
+
+        stats_count_io(slot->offset, slot->length, 0);
+        slot->result = 0;
+        slot->state = SLOT_QUEUED;
+        if (ra->engine == READAHEAD_URING)
+        {
+            uring_queue(ra, index);
+            ra->in_flight++;
+        }
+        ra->submitted++;
+        queued++;
+    }
+    if (ra->engine == READAHEAD_THREADS)
+    {
+        if (queued)
+            pthread_cond_broadcast(&ra->queued);
+        pthread_mutex_unlock(&ra->lock);
+        return 0;
+    }
+    return queued ? uring_reap(ra, 0) : 0;
+}
+
+static int wait_for(ReadAhead *ra, ReadSlot *slot)
+{
+    if (ra->engine == READAHEAD_URING)
+    {
+        while (slot->state != SLOT_DONE)
+        {
+            if (uring_reap(ra, 1) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    while (slot->state != SLOT_DONE && ra->thread_count > 0)
+        pthread_cond_wait(&ra->finished, &ra->lock);
+    pthread_mutex_unlock(&ra->lock);
+
+    // Without any pool thread the reads happen here, one at a time
+    if (slot->state != SLOT_DONE)
+    {
+        ra->claimed++;
+        slot->result = 0;
+        slot->state = SLOT_DONE;
+    }
+    return 0;
+}
+
+ReadAhead *readahead_open(const Extent *extents, uint32_t extent_count, uint64_t skip, uint64_t length)
+{
+    ReadAhead *ra = calloc(1, sizeof(ReadAhead));
+    if (!ra)
+        return NULL;
+
+    ra->fs = mfs_current;
+    ra->extents = extents;
+    ra->extent_count = extent_count;
+    ra->in_run = skip;
+    ra->remaining = length;
+    ra->ring_fd = -1;
+
+    // No more slots, or larger ones, than the file can use
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint64_t largest = 0;
+    uint64_t requests = 0;
+    for (uint32_t i = 0; i < extent_count; i++)
+    {
+        uint64_t run_bytes = (uint64_t)extents[i].clusterCount * bytes_per_cluster;
+        requests += (run_bytes + READAHEAD_REQUEST - 1) / READAHEAD_REQUEST;
+        if (run_bytes > largest)
+            largest = run_bytes;
+    }
+    ra->depth = READAHEAD->depth;
+    if (ra->depth > requests)
+        ra->depth = requests;
+    if (ra->depth == 0)
+        ra->depth = 1;
+    size_t slot_size = largest + bs.bytesPerSector;
+    if (slot_size > READAHEAD_REQUEST)
+        slot_size = READAHEAD_REQUEST;
+
+    ra->slots = calloc(ra->depth, sizeof(ReadSlot));
+    uint8_t *buffers = ra->slots ? malloc((size_t)ra->depth * slot_size) : NULL;
+    if (!buffers)
+    {
+        free(ra->slots);
+        free(ra);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < ra->depth; i++)
+        ra->slots[i].data = buffers + (size_t)i * slot_size;
+
+    ra->engine = READAHEAD->engine;
+    if (ra->engine == READAHEAD_URING && uring_setup(ra) != 0)
+    {
+        uring_teardown(ra);
+        ra->engine = READAHEAD_THREADS;
+    }
+    if (ra->engine == READAHEAD_THREADS)
+    {
+        pthread_mutex_init(&ra->lock, NULL);
+        pthread_cond_init(&ra->queued, NULL);
+        pthread_cond_init(&ra->finished, NULL);
+        int wanted = ra->depth < READAHEAD_MAX_THREADS ? ra->depth : READAHEAD_MAX_THREADS;
+        while (ra->thread_count < wanted &&
+               pthread_create(&ra->threads[ra->thread_count], NULL, pool_thread, ra) == 0)
+            ra->thread_count++;
+    }
+
+    if (fill(ra) != 0)
+    {
+        readahead_close(ra);
+        return NULL;
+    }
+    return ra;
+}
+
+int readahead_next(ReadAhead *ra, const uint8_t **data, uint32_t *length)
+{
+    // The caller is done with the previous buffer; reuse it
+    if (ra->holding)
+    {
+        ra->holding = 0;
+        ra->consumed++;
+        if (fill(ra) != 0)
+            return -1;
+    }
+    if (ra->consumed == ra->submitted)
+        return 0;
+
+    ReadSlot *slot = &ra->slots[ra->consumed % ra->depth];
+    if (wait_for(ra, slot) != 0)
+        return -1;
+    if ((slot->result < 0 || (uint32_t)slot->result < slot->length) && complete_read(slot) != 0)
+        return -1;
+
+    uint32_t sector = slot->offset / bs.bytesPerSector;
+    uint32_t sectors = slot->length / bs.bytesPerSector;
+    if (journal_covers(sector, sectors))
+        journal_overlay(sector, sectors, slot->data);
+
+    ra->holding = 1;
+    *data = slot->data + slot->skip;
+    *length = slot->useful;
+    return 1;
+}
+
+void readahead_close(ReadAhead *ra)
+{
+    if (!ra)
+        return;
+
+    if (ra->engine == READAHEAD_URING)
+    {
+        // The kernel may still be writing into the buffers
+        while (ra->in_flight > 0 && uring_reap(ra, 1) == 0)
+            ;
+        uring_teardown(ra);
+    }
+    else
+    {
+        pthread_mutex_lock(&ra->lock);
+        ra->stopping = 1;
+        pthread_cond_broadcast(&ra->queued);
+        pthread_mutex_unlock(&ra->lock);
+        for (int i = 0; i < ra->thread_count; i++)
+            pthread_join(ra->threads[i], NULL);
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->queued);
+        pthread_cond_destroy(&ra->finished);
+    }
+
+    free(ra->slots[0].data);
+    free(ra->slots);
+    free(ra);
+}
@@ -0,0 +1,86 @@
+#include "mfs.h"
+#include "struct.h"
+
+#include <time.h>
+
+// Counters for the stats command, kept per filesystem. Get workers and
+// concurrent library readers bump them from several threads, so every
+// counter is updated atomically (STATS_ADD). Command timings belong to the
+// shell.
+static CommandTiming timings[STATS_MAX_COMMANDS];
+static uint32_t timing_count = 0;
+
+void stats_count_io(uint64_t offset, uint64_t length, int write)
+{
+    // An access that does not start where the last one ended is a seek
+    uint64_t previous = __atomic_exchange_n(&mfs_current->nextOffset, offset + length, __ATOMIC_RELAXED);
+    if (previous != offset)
+        STATS_ADD(seeks, 1);
+
+    uint64_t sectors = (length + bs.bytesPerSector - 1) / bs.bytesPerSector;
+    if (write)
+    {
+        STATS_ADD(sectorsWritten, sectors);
+        STATS_ADD(bytesWritten, length);
+    }
+    else
+    {
+        STATS_ADD(sectorsRead, sectors);
+        STATS_ADD(bytesRead, length);
+    }
+}
+
+double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Commands beyond the table's capacity are not timed
+void stats_record_command(const char *name, double seconds)
+{
+    CommandTiming *timing = NULL;
+
+    for (uint32_t i = 0; i < timing_count; i++)
+    {
+        if (strcmp(timings[i].name, name) == 0)
+        {
+            timing = &timings[i];
+            break;
+        }
+    }
+    if (!timing)
+    {
+        if (timing_count == STATS_MAX_COMMANDS)
+            return;
+        timing = &timings[timing_count++];
+        snprintf(timing->name, sizeof(timing->name), "%s", name);
+    }
+
+    timing->count++;
+    timing->totalSeconds += seconds;
+    if (seconds > timing->maxSeconds)
+        timing->maxSeconds = seconds;
+}
+
+void stats_get(IoStats *out)
+{
+    for (size_t i = 0; i < sizeof(IoStats) / sizeof(uint64_t); i++)
+        ((uint64_t *)out)[i] = __atomic_load_n(&((uint64_t *)&io_stats)[i], __ATOMIC_RELAXED);
+}
+
+uint32_t stats_command_timings(const CommandTiming **out)
+{
+    *out = timings;
+    return timing_count;
+}
+
+void stats_reset(void)
+{
+    for (size_t i = 0; i < sizeof(IoStats) / sizeof(uint64_t); i++)
+        __atomic_store_n(&((uint64_t *)&io_stats)[i], 0, __ATOMIC_RELAXED);
+    memset(timings, 0, sizeof(timings));
+    timing_count = 0;
+    cache_reset_stats();
+}
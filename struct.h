@@ -1,23 +1,26 @@
 #ifndef STRUCTURES_H
 #define STRUCTURES_H
 
+#include "libmfs.h"
+
+#include <pthread.h>
 #include <stdint.h>
 
-typedef struct
-{
-    char DIR_Name[11];
-    uint8_t DIR_Attr;
-    uint8_t DIR_NTRes;
-    uint8_t DIR_CrtTimeTenth;
-    uint16_t DIR_CrtTime;
-    uint16_t DIR_CrtDate;
-    uint16_t DIR_LstAccDate;
-    uint16_t DIR_FstClusHI;
-    uint16_t DIR_WrtTime;
-    uint16_t DIR_WrtDate;
-    uint16_t DIR_FstClusLO;
-    uint32_t DIR_FileSize;
-} __attribute__((packed)) DirEntry;
+// One part of a VFAT long name: 13 UCS-2 characters, little endian, split
+// over three fields. Kept as bytes so nothing in it is misaligned.
+typedef struct {
+   uint8_t LDIR_Ord;
+   uint8_t LDIR_Name1[10];
+   uint8_t LDIR_Attr;
+   uint8_t LDIR_Type;
+   uint8_t LDIR_Chksum;
+   uint8_t LDIR_Name2[12];
+   uint8_t LDIR_FstClusLO[2];
+   uint8_t LDIR_Name3[4];
+} __attribute__((packed)) LfnEntry;
+
+#define LFN_LAST_ENTRY 0x40 // ordinal flag of the part stored first
+#define LFN_CHARS_PER_ENTRY 13
 
 typedef struct {
    uint8_t jumpInstruction[3];
@@ -44,10 +47,261 @@ typedef struct {
    uint8_t driveNumber;
 } __attribute__((packed)) BootSector;
 
-// External declarations for global variables
-extern FILE *disk_img;
-extern BootSector bs;
-extern char current_image_name[Mx_FILENAME_LENGTH];
-extern uint32_t current_dir_cluster;
+typedef struct {
+   uint32_t leadSignature;
+   uint8_t reserved1[480];
+   uint32_t structSignature;
+   uint32_t freeCount;
+   uint32_t nextFree;
+   uint8_t reserved2[12];
+   uint32_t trailSignature;
+} __attribute__((packed)) FSInfo;
+
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE 0xAA550000
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+// A run of physically contiguous clusters in a chain
+typedef struct {
+   uint32_t startCluster;
+   uint32_t clusterCount;
+} Extent;
+
+typedef struct {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   uint64_t writebacks;
+   uint32_t capacity;
+   uint32_t used;
+} CacheStats;
+
+void cache_get_stats(CacheStats *out);
+
+typedef struct {
+   int enabled;
+   const char *path;
+   uint32_t pendingCommands;
+   uint32_t pendingSectors;
+   uint32_t overlaySectors;
+   uint64_t nextSequence;
+} JournalStats;
+
+void journal_get_stats(JournalStats *out);
+
+// Image I/O and hot-path counters (stats.c). All fields are uint64_t.
+typedef struct {
+   uint64_t sectorsRead;
+   uint64_t sectorsWritten;
+   uint64_t bytesRead;
+   uint64_t bytesWritten;
+   uint64_t seeks;
+   uint64_t fatLookups;
+   uint64_t fatUpdates;
+   uint64_t dirEntriesScanned;
+} IoStats;
+
+// Wall-clock time spent in one shell command
+typedef struct {
+   char name[16];
+   uint64_t count;
+   double totalSeconds;
+   double maxSeconds;
+} CommandTiming;
+
+void stats_get(IoStats *out);
+uint32_t stats_command_timings(const CommandTiming **out);
+int fat_build_extents(uint32_t cluster, uint32_t max_clusters, Extent **extents, uint32_t *count);
+int fat_alloc_chain(uint32_t clusters_needed, Extent **runs, uint32_t *run_count);
+
+// Lookups copy the entry into *entry and return 1, or return 0 if not found
+int find_file_entry(const char *filename, uint32_t dir_cluster, DirEntry *entry);
+int find_deleted_file_entry(const char *filename, uint32_t dir_cluster, DirEntry *entry, uint32_t *sector,
+                            uint32_t *slot, int include_deleted);
+int path_find_entry(const char *path, DirEntry *entry, uint32_t *dir_cluster);
+int dir_index_lookup(uint32_t dir_cluster, const char *name, DirEntry *entry, uint32_t *sector, uint32_t *slot);
+int dir_index_lookup_long(uint32_t dir_cluster, const char *long_name, DirEntry *entry, uint32_t *sector,
+                          uint32_t *slot);
+int dir_find_name(uint32_t dir_cluster, const char *name, DirEntry *entry, uint32_t *sector, uint32_t *slot);
+
+// Live entries of a directory in order, without dot, deleted, long-name or
+// volume entries; the caller frees *entries
+int dir_read_entries(uint32_t dir_cluster, DirEntry **entries, uint32_t *count);
+
+// The same with the name of each entry to show: its long name if it has one,
+// else the 8.3 name. The caller frees both lists with dir_free_names().
+int dir_read_names(uint32_t dir_cluster, DirEntry **entries, char ***names, uint32_t *count);
+void dir_free_names(DirEntry *entries, char **names, uint32_t count);
+
+// Room for count new entries in a row in a directory (fs.c). When the
+// directory is full, extend is the number of clusters dir_extend() must add,
+// in the caller's FAT transaction, before the entries are written.
+typedef struct {
+   uint32_t *sectors; // the directory's sectors in chain order
+   uint32_t sectorCount;
+   uint64_t first;    // entry number of the first slot
+   uint32_t count;
+   uint32_t lastCluster;
+   uint32_t extend;
+   int reused;        // takes over deleted entries
+} DirSlots;
+
+int dir_find_slots(uint32_t dir_cluster, uint32_t count, DirSlots *slots);
+int dir_extend(DirSlots *slots);
+int dir_write_slots(const DirSlots *slots, const DirEntry *entries);
+void dir_slots_last(const DirSlots *slots, uint32_t *sector, uint32_t *slot);
+void dir_slots_release(DirSlots *slots);
+
+// Collects the parts of a long name as a directory is read in order (lfn.c).
+// Feed it every long-name entry; lfn_take() then gives the long name of the
+// 8.3 entry that follows, if the parts are whole and their checksum matches.
+typedef struct {
+   uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+   uint8_t count;    // parts in the run being collected, 0 if none
+   uint8_t next;     // ordinal expected next, 0 once the run is whole
+   uint8_t checksum;
+} LfnBuilder;
+
+void lfn_reset(LfnBuilder *builder);
+void lfn_feed(LfnBuilder *builder, const DirEntry *entry);
+int lfn_take(LfnBuilder *builder, const DirEntry *entry, char *name, size_t size);
+
+// The same for the parts del left ahead of a deleted 8.3 entry (undelete.c);
+// lead gets the first letter the parts' checksum calls for
+void lfn_feed_deleted(LfnBuilder *builder, const DirEntry *entry);
+int lfn_take_deleted(LfnBuilder *builder, const DirEntry *entry, char *name, size_t size, char *lead);
+
+// The parts of a long name for the given 8.3 name, in on-disk order
+int lfn_make_entries(const char *name, const char *short_name, DirEntry *parts);
+
+// One file to copy out of the image to a host path (extract.c)
+typedef struct {
+   char *output;
+   uint32_t firstCluster;
+   uint32_t size;
+   int status; // EXTRACT_*
+} ExtractJob;
+
+// Run the jobs on up to workers threads; returns how many failed
+int extract_files(ExtractJob *jobs, uint32_t count, int workers);
+
+// Recreate a directory tree under host_dir and list its files as jobs, then
+// stream them out with a reader stage feeding writer threads
+int tree_collect(uint32_t dir_cluster, const char *host_dir, ExtractJob **jobs, uint32_t *count);
+int extract_pipeline(ExtractJob *jobs, uint32_t count, int writers);
+
+// Staging buffer that merges writes to consecutive sectors (import.c)
+typedef struct {
+   uint8_t *data;
+   size_t capacity;
+   uint32_t sector; // where the staged bytes go
+   size_t length;
+} PutStage;
+
+int put_stage_init(PutStage *stage, size_t capacity);
+int put_stage_flush(PutStage *stage);
+void put_stage_release(PutStage *stage);
+int put_write_runs(PutStage *stage, FILE *src, uint32_t size, const Extent *runs, uint32_t run_count);
+
+// Read-ahead over a file's runs (readahead.c). The stream reads length
+// bytes starting skip bytes into the runs, keeping several reads in flight.
+// readahead_next() returns 1 with the next piece, which stays valid until
+// the following call, 0 at the end, or -1 on a read error. The extents must
+// outlive the stream.
+typedef struct ReadAhead ReadAhead;
+ReadAhead *readahead_open(const Extent *extents, uint32_t extent_count, uint64_t skip, uint64_t length);
+int readahead_next(ReadAhead *ra, const uint8_t **data, uint32_t *length);
+void readahead_close(ReadAhead *ra);
+
+// A deleted file found by the image-wide scan (undelete.c)
+typedef struct {
+   char *path; // by long name, else with the 8.3 first letter shown as '?'
+   char *longName; // NULL if del left none that matches
+   char lead;      // first letter the long name's checksum calls for
+   uint32_t dirCluster;
+   uint32_t sector;
+   uint32_t slot;
+   char name[11]; // as on disk, 0xE5 first
+   uint32_t firstCluster;
+   uint32_t size;
+   int state; // DELETED_*
+} DeletedFile;
+
+// Every deleted file in walk order, from the index or a fresh scan
+int deleted_index_get(const DeletedFile **files, uint32_t *count);
+
+// Cached per-file extent maps (extent.c)
+typedef struct ExtentMap ExtentMap;
+const ExtentMap *extent_map_get(uint32_t first_cluster);
+void extent_map_put(const ExtentMap *map);
+uint32_t extent_map_lookup(const ExtentMap *map, uint32_t logical_cluster, uint32_t *run_left);
+const Extent *extent_map_runs(const ExtentMap *map, uint32_t *count);
+void extent_cache_clear(void);
+
+// One filesystem: the open image and everything derived from it, behind
+// the library's opaque mfs_fs. Each module keeps its state in its own part,
+// defined privately in its source file and allocated by its *_state_new().
+typedef struct FatState FatState;
+typedef struct CacheState CacheState;
+typedef struct DiskState DiskState;
+typedef struct JournalState JournalState;
+typedef struct ExtentState ExtentState;
+typedef struct DirIndexState DirIndexState;
+typedef struct PathState PathState;
+typedef struct ReadAheadState ReadAheadState;
+typedef struct DeletedState DeletedState;
+
+struct mfs_fs {
+   int imageFd; // -1 when no image is open
+   BootSector boot;
+   char imageName[Mx_FILENAME_LENGTH];
+   uint32_t cwdCluster;
+
+   IoStats ioStats;
+   uint64_t nextOffset; // byte after the previous image access, for seek counting
+
+   int failed;      // set by print_error
+   int echoErrors;  // print_error also prints the message
+   char lastError[256]; // message of the latest failure, for mfs_last_error()
+   pthread_mutex_t errorLock;
+
+   // Held shared by the library's read calls and exclusively by the calls
+   // that change the image or the working directory
+   pthread_rwlock_t lock;
+
+   FatState *fat;
+   CacheState *cache;
+   DiskState *disk;
+   JournalState *journal;
+   ExtentState *extents;
+   DirIndexState *dirs;
+   PathState *paths;
+   ReadAheadState *readahead;
+   DeletedState *deleted;
+};
+
+FatState *fat_state_new(void);
+CacheState *cache_state_new(void);
+DiskState *disk_state_new(void);
+JournalState *journal_state_new(void);
+ExtentState *extent_state_new(void);
+DirIndexState *dir_index_state_new(void);
+PathState *path_state_new(void);
+ReadAheadState *readahead_state_new(void);
+DeletedState *deleted_state_new(void);
+
+// The filesystem the calling thread is working on (fs.c). The library entry
+// points in libmfs.h select it; the names below, once globals, are its fields.
+extern __thread mfs_fs *mfs_current;
+
+#define disk_fd (mfs_current->imageFd)
+#define bs (mfs_current->boot)
+#define current_image_name (mfs_current->imageName)
+#define current_dir_cluster (mfs_current->cwdCluster)
+#define io_stats (mfs_current->ioStats)
+
+// Readers on other threads may be counting at the same time
+#define STATS_ADD(counter, n) __atomic_fetch_add(&io_stats.counter, (n), __ATOMIC_RELAXED)
 
 #endif // STRUCTURES_H
\ No newline at end of file
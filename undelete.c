@@ -0,0 +1,618 @@
+#include "mfs.h"
+#include "struct.h"
+
+// Image-wide index of deleted files for lsdel and bulk undel. One walk of
+// the directory tree lists every 0xE5 file entry and marks the clusters of
+// every live chain; each deleted file is then classed by what became of its
+// data. del leaves the chain allocated, so such a file is restored by
+// putting its first letter back. Other tools free the chain on deletion;
+// if the clusters from the first one on are still free, the file is given
+// them back as a contiguous chain, which is how they were most likely laid
+// out. A file whose long-name parts del left behind is listed and found by
+// that name, and the checksum of the parts tells which first letter to put
+// back. The index is kept until the FAT or a directory changes.
+struct DeletedState
+{
+    DeletedFile *files; // in directory walk order
+    uint32_t count;
+    uint32_t *by_name; // indexes into files, by directory, name and order
+    int valid;
+    uint32_t fat_generation;
+    uint32_t dir_generation;
+};
+
+#define DELETED (mfs_current->deleted)
+
+typedef struct
+{
+    uint32_t cluster;
+    char name[LFN_NAME_BYTES];
+} ChildDir;
+
+typedef struct
+{
+    DeletedFile *files;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t *live; // clusters of live chains
+    uint32_t limit;
+} DeletedScan;
+
+DeletedState *deleted_state_new(void)
+{
+    return calloc(1, sizeof(DeletedState));
+}
+
+void deleted_index_clear(void)
+{
+    for (uint32_t i = 0; i < DELETED->count; i++)
+    {
+        free(DELETED->files[i].path);
+        free(DELETED->files[i].longName);
+    }
+    free(DELETED->files);
+    free(DELETED->by_name);
+    memset(DELETED, 0, sizeof(DeletedState));
+}
+
+static int is_live(const DeletedScan *scan, uint32_t cluster)
+{
+    return (scan->live[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+static void mark_chain(DeletedScan *scan, uint32_t cluster)
+{
+    uint32_t walked = 0;
+    while (cluster >= 2 && cluster < scan->limit && !is_live(scan, cluster) && walked++ < scan->limit)
+    {
+        scan->live[cluster >> 6] |= 1ULL << (cluster & 63);
+        cluster = get_fat_entry(cluster);
+    }
+}
+
+static char *child_path(const char *parent, const char *name)
+{
+    size_t length = strlen(parent) + strlen(name) + 2;
+    char *path = malloc(length);
+    if (path)
+        snprintf(path, length, "%s%s%s", parent, strcmp(parent, "/") == 0 ? "" : "/", name);
+    return path;
+}
+
+static int add_deleted(DeletedScan *scan, const DirEntry *entry, const char *long_name, char lead,
+                       uint32_t dir_cluster, const char *dir_path, uint32_t sector, uint32_t slot)
+{
+    if (scan->count == scan->capacity)
+    {
+        uint32_t capacity = scan->capacity ? scan->capacity * 2 : 64;
+        DeletedFile *grown = realloc(scan->files, capacity * sizeof(DeletedFile));
+        if (!grown)
+            return -1;
+        scan->files = grown;
+        scan->capacity = capacity;
+    }
+
+    // The first letter is gone; show it as '?'
+    char name[11];
+    char display[13];
+    memcpy(name, entry->DIR_Name, 11);
+    name[0] = '?';
+    path_display_name(name, display);
+
+    DeletedFile *file = &scan->files[scan->count];
+    file->path = child_path(dir_path, long_name ? long_name : display);
+    file->longName = long_name ? strdup(long_name) : NULL;
+    if (!file->path || (long_name && !file->longName))
+    {
+        free(file->path);
+        free(file->longName);
+        return -1;
+    }
+    file->lead = long_name ? lead : 0;
+    file->dirCluster = dir_cluster;
+    file->sector = sector;
+    file->slot = slot;
+    memcpy(file->name, entry->DIR_Name, 11);
+    file->firstCluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    file->size = entry->DIR_FileSize;
+    file->state = DELETED_EMPTY;
+    scan->count++;
+    return 0;
+}
+
+static int scan_dir(DeletedScan *scan, uint32_t dir_cluster, const char *dir_path, int depth)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t entries_per_sector = bs.bytesPerSector / sizeof(DirEntry);
+    uint8_t *scratch = malloc(bytes_per_cluster);
+    ChildDir *children = NULL;
+    uint32_t child_count = 0, child_capacity = 0;
+    int result = 0;
+
+    if (!scratch || depth >= MAX_PATH_DEPTH)
+    {
+        free(scratch);
+        return -1;
+    }
+    mark_chain(scan, dir_cluster);
+
+    // Live long names name the subdirectories in paths; deleted ones are
+    // kept with the files they belonged to
+    LfnBuilder lfn, deleted_lfn;
+    lfn_reset(&lfn);
+    lfn_reset(&deleted_lfn);
+    uint32_t cluster = dir_cluster;
+    uint32_t walked = 0;
+    int done = 0;
+    while (!done && result == 0 && cluster >= 2 && cluster < EOC && walked++ < scan->limit)
+    {
+        uint32_t sector = get_first_sector_of_cluster(cluster);
+        const uint8_t *data = disk_view_sectors(sector, bs.sectorsPerCluster, scratch);
+        if (!data)
+        {
+            result = -1;
+            break;
+        }
+
+        const DirEntry *dir = (const DirEntry *)data;
+        for (uint32_t i = 0; i < bytes_per_cluster / sizeof(DirEntry) && result == 0; i++)
+        {
+            STATS_ADD(dirEntriesScanned, 1);
+            uint8_t lead = (uint8_t)dir[i].DIR_Name[0];
+            if (lead == 0x00)
+            {
+                done = 1;
+                break;
+            }
+            if (dir[i].DIR_Attr == ATTRIBUTE_LONG_NAME)
+            {
+                lfn_feed(&lfn, &dir[i]);
+                lfn_feed_deleted(&deleted_lfn, &dir[i]);
+                continue;
+            }
+
+            char long_name[LFN_NAME_BYTES];
+            char long_lead = 0;
+            int has_long = lead == 0xE5
+                               ? lfn_take_deleted(&deleted_lfn, &dir[i], long_name, sizeof(long_name), &long_lead)
+                               : lfn_take(&lfn, &dir[i], long_name, sizeof(long_name));
+            lfn_reset(&lfn);
+            lfn_reset(&deleted_lfn);
+            if ((dir[i].DIR_Attr & ATTRIBUTE_VOLUME_ID) || lead == '.')
+                continue;
+
+            uint32_t first = ((uint32_t)dir[i].DIR_FstClusHI << 16) | dir[i].DIR_FstClusLO;
+            if (lead == 0xE5)
+            {
+                // Deleted directories are left alone
+                if (!(dir[i].DIR_Attr & ATTRIBUTE_DIRECTORY))
+                    result = add_deleted(scan, &dir[i], has_long ? long_name : NULL, long_lead, dir_cluster, dir_path,
+                                         sector + i / entries_per_sector, i % entries_per_sector);
+                continue;
+            }
+            if (!(dir[i].DIR_Attr & ATTRIBUTE_DIRECTORY))
+            {
+                mark_chain(scan, first);
+                continue;
+            }
+
+            // Subdirectories are walked once this one is done
+            if (first < 2 || first >= scan->limit || is_live(scan, first))
+                continue;
+            if (child_count == child_capacity)
+            {
+                uint32_t capacity = child_capacity ? child_capacity * 2 : 16;
+                ChildDir *grown = realloc(children, capacity * sizeof(ChildDir));
+                if (!grown)
+                {
+                    result = -1;
+                    break;
+                }
+                children = grown;
+                child_capacity = capacity;
+            }
+            children[child_count].cluster = first;
+            if (has_long)
+                strcpy(children[child_count].name, long_name);
+            else
+                path_display_name(dir[i].DIR_Name, children[child_count].name);
+            child_count++;
+        }
+
+        cluster = get_fat_entry(cluster);
+    }
+    free(scratch);
+
+    for (uint32_t i = 0; i < child_count && result == 0; i++)
+    {
+        if (is_live(scan, children[i].cluster))
+            continue;
+        char *path = child_path(dir_path, children[i].name);
+        result = path ? scan_dir(scan, children[i].cluster, path, depth + 1) : -1;
+        free(path);
+    }
+    free(children);
+    return result;
+}
+
+static void classify(DeletedScan *scan, DeletedFile *file)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    uint32_t needed = (uint32_t)(((uint64_t)file->size + bytes_per_cluster - 1) / bytes_per_cluster);
+    uint32_t first = file->firstCluster;
+
+    if (first == 0 || needed == 0)
+    {
+        file->state = DELETED_EMPTY;
+    }
+    else if (first < 2 || first >= scan->limit || is_live(scan, first))
+    {
+        file->state = DELETED_REUSED;
+    }
+    else if (get_fat_entry(first) != 0)
+    {
+        // Still allocated and nobody else's. The first deleted file to
+        // hold a chain gets it.
+        file->state = DELETED_HELD;
+        mark_chain(scan, first);
+    }
+    else
+    {
+        file->state = DELETED_FREE;
+        for (uint32_t i = 0; i < needed; i++)
+        {
+            if (first + i >= scan->limit || get_fat_entry(first + i) != 0)
+            {
+                file->state = DELETED_REUSED;
+                break;
+            }
+        }
+    }
+}
+
+static int compare_by_name(const void *a, const void *b)
+{
+    const DeletedFile *x = &DELETED->files[*(const uint32_t *)a];
+    const DeletedFile *y = &DELETED->files[*(const uint32_t *)b];
+    if (x->dirCluster != y->dirCluster)
+        return x->dirCluster < y->dirCluster ? -1 : 1;
+    int names = memcmp(x->name + 1, y->name + 1, 10);
+    if (names != 0)
+        return names;
+    return x < y ? -1 : x > y; // walk order breaks ties
+}
+
+static int build_index(void)
+{
+    deleted_index_clear();
+
+    DeletedScan scan = {0};
+    scan.limit = fat_cluster_limit();
+    scan.live = calloc((scan.limit + 63) / 64, sizeof(uint64_t));
+    if (!scan.live)
+        return -1;
+
+    int result = scan_dir(&scan, bs.rootCluster, "/", 0);
+    for (uint32_t i = 0; i < scan.count && result == 0; i++)
+        classify(&scan, &scan.files[i]);
+    free(scan.live);
+
+    DELETED->files = scan.files;
+    DELETED->count = scan.count;
+    DELETED->by_name = malloc((scan.count + 1) * sizeof(uint32_t));
+    if (result != 0 || !DELETED->by_name)
+    {
+        deleted_index_clear();
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < scan.count; i++)
+        DELETED->by_name[i] = i;
+    qsort(DELETED->by_name, scan.count, sizeof(uint32_t), compare_by_name);
+
+    DELETED->valid = 1;
+    DELETED->fat_generation = fat_generation();
+    DELETED->dir_generation = dir_index_generation();
+    return 0;
+}
+
+static int current_index(void)
+{
+    if (DELETED->valid && DELETED->fat_generation == fat_generation() &&
+        DELETED->dir_generation == dir_index_generation())
+        return 0;
+    return build_index();
+}
+
+int deleted_index_get(const DeletedFile **files, uint32_t *count)
+{
+    if (current_index() != 0)
+        return -1;
+    *files = DELETED->files;
+    *count = DELETED->count;
+    return 0;
+}
+
+static int recoverable(const DeletedFile *file)
+{
+    return file->state == DELETED_EMPTY || file->state == DELETED_HELD || file->state == DELETED_FREE;
+}
+
+// First recoverable deleted file in the directory whose name matches apart
+// from the lost first letter, else the first match of any kind
+static DeletedFile *find_deleted(uint32_t dir_cluster, const char *name)
+{
+    uint32_t lo = 0, hi = DELETED->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const DeletedFile *file = &DELETED->files[DELETED->by_name[mid]];
+        int order = file->dirCluster != dir_cluster ? (file->dirCluster < dir_cluster ? -1 : 1)
+                                                     : memcmp(file->name + 1, name + 1, 10);
+        if (order < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    DeletedFile *match = NULL;
+    for (; lo < DELETED->count; lo++)
+    {
+        DeletedFile *file = &DELETED->files[DELETED->by_name[lo]];
+        if (file->dirCluster != dir_cluster || memcmp(file->name + 1, name + 1, 10) != 0)
+            break;
+        if (recoverable(file))
+            return file;
+        if (!match && file->state != DELETED_RESTORED)
+            match = file;
+    }
+    return match;
+}
+
+// The same by long name, compared with case folded
+static DeletedFile *find_deleted_long(uint32_t dir_cluster, const char *name)
+{
+    uint32_t lo = 0, hi = DELETED->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (DELETED->files[DELETED->by_name[mid]].dirCluster < dir_cluster)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    char folded[2 * LFN_NAME_BYTES];
+    char candidate[2 * LFN_NAME_BYTES];
+    lfn_fold(name, folded, sizeof(folded));
+    DeletedFile *match = NULL;
+    for (; lo < DELETED->count; lo++)
+    {
+        DeletedFile *file = &DELETED->files[DELETED->by_name[lo]];
+        if (file->dirCluster != dir_cluster)
+            break;
+        if (!file->longName)
+            continue;
+        lfn_fold(file->longName, candidate, sizeof(candidate));
+        if (strcmp(candidate, folded) != 0)
+            continue;
+        if (recoverable(file))
+            return file;
+        if (!match && file->state != DELETED_RESTORED)
+            match = file;
+    }
+    return match;
+}
+
+// Put the file's entry back under its name with the given first letter,
+// and its chain too if that had been freed
+static int restore(DeletedFile *file, char lead)
+{
+    uint32_t bytes_per_cluster = bs.bytesPerSector * bs.sectorsPerCluster;
+    char name[11];
+    memcpy(name, file->name, 11);
+    name[0] = lead;
+
+    DirEntry existing;
+    int keeps_long = file->longName && lead == file->lead;
+    if (find_file_entry(name, file->dirCluster, &existing) ||
+        (keeps_long && dir_find_name(file->dirCluster, file->longName, &existing, NULL, NULL)))
+        return UNDEL_EXISTS;
+
+    uint8_t buffer[SECTOR_SIZE];
+    if (read_disk_sector(file->sector, buffer) != 1)
+        return UNDEL_FAILED;
+    DirEntry *dir = &((DirEntry *)buffer)[file->slot];
+    if (memcmp(dir->DIR_Name, file->name, 11) != 0)
+        return UNDEL_NOT_FOUND; // changed since the index was built
+
+    fat_begin();
+    if (file->state == DELETED_FREE)
+    {
+        uint32_t needed = (uint32_t)(((uint64_t)file->size + bytes_per_cluster - 1) / bytes_per_cluster);
+        for (uint32_t i = 0; i < needed; i++)
+        {
+            uint32_t cluster = file->firstCluster + i;
+            if (get_fat_entry(cluster) != 0)
+            {
+                fat_abort();
+                return UNDEL_REUSED;
+            }
+            update_fat_entry(cluster, i + 1 < needed ? cluster + 1 : 0x0FFFFFFF);
+        }
+    }
+
+    // The long name, if del left one ahead of the entry, comes back only
+    // when its checksum matches the name under the new first letter
+    int result = UNDEL_FAILED;
+    dir->DIR_Name[0] = lead;
+    journal_begin();
+    if (fat_flush() == 0 && write_disk_sector(file->sector, buffer) == 1)
+    {
+        result = UNDEL_OK;
+        if (dir_revive_long_name(file->dirCluster, file->sector, file->slot) != 0)
+        {
+            dir_mark_deleted(file->dirCluster, file->sector, file->slot);
+            result = UNDEL_FAILED;
+        }
+    }
+    if (journal_end() != 0 && result == UNDEL_OK)
+    {
+        // Not durable: leave the entry and its long name deleted and the
+        // clusters free
+        dir_mark_deleted(file->dirCluster, file->sector, file->slot);
+        result = UNDEL_FAILED;
+    }
+    if (result == UNDEL_OK)
+    {
+        fat_commit();
+        file->state = DELETED_RESTORED;
+    }
+    else
+    {
+        fat_abort();
+    }
+
+    // Another deleted entry with the same name may now be the first match
+    dir_index_invalidate(file->dirCluster);
+    return result;
+}
+
+static const char *state_name(int state)
+{
+    switch (state)
+    {
+    case DELETED_EMPTY: return "empty";
+    case DELETED_HELD: return "allocated";
+    case DELETED_FREE: return "free";
+    case DELETED_RESTORED: return "restored";
+    default: return "reused";
+    }
+}
+
+void cmd_lsdel(void)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+    if (current_index() != 0)
+    {
+        print_error("Could not read directory\n");
+        return;
+    }
+
+    uint32_t recoverable_count = 0;
+    printf("%-40s %10s %9s %s\n", "path", "size", "cluster", "data");
+    for (uint32_t i = 0; i < DELETED->count; i++)
+    {
+        const DeletedFile *file = &DELETED->files[i];
+        printf("%-40s %10u %9u %s\n", file->path, file->size, file->firstCluster, state_name(file->state));
+        recoverable_count += recoverable(file);
+    }
+    printf("%u deleted files, %u recoverable\n", DELETED->count, recoverable_count);
+}
+
+static void report_failure(int result, const char *name, int named)
+{
+    const char *message = result == UNDEL_NOT_FOUND ? "Deleted file not found"
+                          : result == UNDEL_EXISTS  ? "File already exists"
+                          : result == UNDEL_REUSED  ? "Clusters of the deleted file have been reused"
+                                                    : "Could not write sector";
+    if (named)
+        print_error("%s: %s\n", name, message);
+    else
+        print_error("%s\n", message);
+}
+
+// undel -all: every recoverable file, under the first letter its long name
+// calls for if it has one, else '_' or the first free letter
+static void restore_all(void)
+{
+    static const char leads[] = "_0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    uint32_t restored = 0, candidates = 0, failed = 0;
+
+    for (uint32_t i = 0; i < DELETED->count; i++)
+    {
+        DeletedFile *file = &DELETED->files[i];
+        if (!recoverable(file))
+            continue;
+        candidates++;
+
+        int result = file->lead ? restore(file, file->lead) : UNDEL_EXISTS;
+        for (const char *lead = leads; *lead && result == UNDEL_EXISTS; lead++)
+            result = restore(file, *lead);
+        if (result == UNDEL_OK)
+            restored++;
+        else
+            failed++;
+    }
+
+    printf("Restored %u of %u deleted files\n", restored, DELETED->count);
+    if (DELETED->count > candidates)
+        printf("%u files left deleted: their clusters have been reused\n", DELETED->count - candidates);
+    if (failed > 0)
+        print_error("Could not restore %u files\n", failed);
+}
+
+// undel NAME... | undel -all
+void cmd_undel(char **names, int count)
+{
+    if (disk_fd < 0)
+    {
+        print_error("File system not open\n");
+        return;
+    }
+    if (current_index() != 0)
+    {
+        print_error("Could not read directory\n");
+        return;
+    }
+
+    if (count == 1 && strcmp(names[0], "-all") == 0)
+    {
+        restore_all();
+        return;
+    }
+
+    int restored = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t dir_cluster = current_dir_cluster;
+        const char *base = path_basename(names[i]);
+        if (base != names[i])
+        {
+            char parent[Mx_COMMAND_LENGTH];
+            snprintf(parent, sizeof(parent), "%.*s", (int)(base - names[i]), names[i]);
+            if (path_resolve_dir(parent, &dir_cluster) != 0)
+            {
+                report_failure(UNDEL_NOT_FOUND, names[i], count > 1);
+                continue;
+            }
+        }
+
+        // A long name brings its own first letter; an 8.3 name gives it
+        char expanded_name[12];
+        DeletedFile *file = find_deleted_long(dir_cluster, base);
+        char lead = file ? file->lead : 0;
+        if (!file)
+        {
+            convert_to_fat_filename(base, expanded_name);
+            file = find_deleted(dir_cluster, expanded_name);
+            lead = expanded_name[0];
+        }
+        int result = !file                ? UNDEL_NOT_FOUND
+                     : !recoverable(file) ? UNDEL_REUSED
+                                          : restore(file, lead);
+        if (result != UNDEL_OK)
+            report_failure(result, names[i], count > 1);
+        else
+            restored++;
+    }
+
+    if (count == 1 && restored == 1)
+        printf("File restored successfully\n");
+    else if (count > 1)
+        printf("Restored %d of %d files\n", restored, count);
+}